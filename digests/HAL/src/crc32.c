@@ -56,7 +56,17 @@ void digest_crc32_init(void)
 
 void digest_crc32_calc(digest_crc32_t *result, const void *ptr, int len)
 {
-    digest_crc32_t c = 0xffffffff;
+    *result = 0;
+    digest_crc32_update(result, ptr, len);
+}
+
+/*
+ * Continue calculation with more data
+ * (*result must hold CRC of preceding data, or 0 for no data)
+ */
+void digest_crc32_update(digest_crc32_t *result, const void *ptr, int len)
+{
+    digest_crc32_t c = (*result ^ 0xffffffff);
     const uint8_t *buf = (const uint8_t *)ptr;
     int i;
     for (i = 0; i < len; ++i)    {
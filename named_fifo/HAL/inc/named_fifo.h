@@ -1,6 +1,7 @@
 #ifndef __NAMED_FIFO_H__
 #define __NAMED_FIFO_H__
 
+#include <stddef.h>
 #include "sys/stat.h"
 #include "sys/alt_dev.h"
 #include "os/alt_sem.h"
@@ -11,11 +12,37 @@ extern "C" {
 #endif
 
 #define NAMED_FIFO_MINIMUM_SIZE     (256)
+#define NAMED_FIFO_MESSAGE_HEADER   (sizeof(alt_u32))
+
+#ifndef NAMED_FIFO_STATIC_SECTION
+# define NAMED_FIFO_STATIC_SECTION  ".bss.named_fifo"
+#endif
+
+/* Compile-time version of the capacity rounding in named_fifo_create() */
+#define NAMED_FIFO_ROUNDUP_1(x)     ((x) | ((x) >> 1))
+#define NAMED_FIFO_ROUNDUP_2(x)     ((x) | ((x) >> 2))
+#define NAMED_FIFO_ROUNDUP_4(x)     ((x) | ((x) >> 4))
+#define NAMED_FIFO_ROUNDUP_8(x)     ((x) | ((x) >> 8))
+#define NAMED_FIFO_ROUNDUP_16(x)    ((x) | ((x) >> 16))
+#define NAMED_FIFO_STATIC_CAPACITY(size) \
+	(((size) <= NAMED_FIFO_MINIMUM_SIZE) ? NAMED_FIFO_MINIMUM_SIZE : \
+	(NAMED_FIFO_ROUNDUP_16(NAMED_FIFO_ROUNDUP_8(NAMED_FIFO_ROUNDUP_4( \
+	NAMED_FIFO_ROUNDUP_2(NAMED_FIFO_ROUNDUP_1((size) - 1))))) + 1))
+
+/*
+ * Define statically allocated FIFO (device and ring buffer)
+ * The FIFO must be registered by named_fifo_register() before use.
+ */
+#define NAMED_FIFO_STATIC_DEFINE(var, size) \
+	static named_fifo_dev var __attribute__((section(NAMED_FIFO_STATIC_SECTION))); \
+	static alt_u8 var##_buffer[NAMED_FIFO_STATIC_CAPACITY(size)] \
+		__attribute__((section(NAMED_FIFO_STATIC_SECTION)))
 
 enum {
 	NAMED_FIFO_FLAG_BUFFER_FULL   = (1<<0),
 	NAMED_FIFO_FLAG_READER_CLOSED = (1<<1),
 	NAMED_FIFO_FLAG_WRITER_CLOSED = (1<<2),
+	NAMED_FIFO_FLAG_MESSAGE       = (1<<3),
 };
 
 typedef struct named_fifo_dev_s {
@@ -37,6 +64,9 @@ extern void named_fifo_init(void);
 extern void named_fifo_open_stdio(void);
 extern void named_fifo_close_stdio(void);
 extern int named_fifo_create(const char *name, size_t size);
+extern int named_fifo_create_message(const char *name, size_t size);
+extern int named_fifo_put(named_fifo_dev *dev, const void *ptr, size_t len);
+extern int named_fifo_register(named_fifo_dev *dev, const char *name, alt_u8 *buffer, size_t capacity, int flags);
 extern int mkfifo(const char *name, mode_t mode);
 
 #define NAMED_FIFO_INSTANCE(name, state) extern int alt_no_storage
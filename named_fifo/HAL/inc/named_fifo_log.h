@@ -0,0 +1,61 @@
+#ifndef __NAMED_FIFO_LOG_H__
+#define __NAMED_FIFO_LOG_H__
+
+#include "alt_types.h"
+#include "system.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NAMED_FIFO_LOG_MAX_ARGS     (8)
+#define NAMED_FIFO_LOG_SECTION      ".rodata.named_fifo_log"
+
+/*
+ * Binary log record (written to NAMED_FIFO_LOG_NAME)
+ * All fields are 32-bit little-endian words:
+ *   [0]     Header (NAMED_FIFO_LOG_MAGIC | number of argument words)
+ *   [1]     Address of format string (resolved from ELF by host decoder)
+ *   [2]     Timestamp (alt_nticks)
+ *   [3...]  Raw arguments
+ * Arguments must be 32-bit values (integers, characters, pointers).
+ * %s is decoded only when the pointer refers to a constant string in ELF.
+ * The header lets decoders skip records whose format is unknown.
+ */
+#define NAMED_FIFO_LOG_MAGIC        (0x4c4f4700)
+#define NAMED_FIFO_LOG_HEADER_WORDS (3)
+
+/*
+ * Count arguments (up to NAMED_FIFO_LOG_MAX_ARGS)
+ * 9 to 16 arguments are counted as -1, which is rejected by NAMED_FIFO_LOG.
+ */
+#define NAMED_FIFO_LOG_NARGS(...) \
+	NAMED_FIFO_LOG_NARGS_(0, ##__VA_ARGS__, \
+		-1, -1, -1, -1, -1, -1, -1, -1, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define NAMED_FIFO_LOG_NARGS_(z, a1, a2, a3, a4, a5, a6, a7, a8, \
+		a9, a10, a11, a12, a13, a14, a15, a16, n, ...) n
+
+#if (NAMED_FIFO_LOG_ENABLE)
+# define NAMED_FIFO_LOG(fmt, ...) \
+	do { \
+		static const char named_fifo_log_fmt[] \
+			__attribute__((section(NAMED_FIFO_LOG_SECTION))) = fmt; \
+		typedef char named_fifo_log_too_many_args[ \
+			(NAMED_FIFO_LOG_NARGS(__VA_ARGS__) >= 0) ? 1 : -1] \
+			__attribute__((unused)); \
+		named_fifo_log_write(named_fifo_log_fmt, \
+			NAMED_FIFO_LOG_NARGS(__VA_ARGS__), ##__VA_ARGS__); \
+	} while (0)
+#else
+# define NAMED_FIFO_LOG(fmt, ...) do { } while (0)
+#endif
+
+extern void named_fifo_log_init(void);
+extern int named_fifo_log_write(const char *fmt, int nargs, ...);
+extern alt_u32 named_fifo_log_dropped(void);
+
+#ifdef __cplusplus
+}	/* extern "C" */
+#endif
+
+#endif  /* __NAMED_FIFO_LOG_H__ */
@@ -0,0 +1,54 @@
+#ifndef __NAMED_FIFO_SHM_H__
+#define __NAMED_FIFO_SHM_H__
+
+#include <stddef.h>
+#include "sys/alt_dev.h"
+#include "alt_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NAMED_FIFO_SHM_MAGIC        (0x4f464953)    /* "SIFO" */
+
+enum {
+	NAMED_FIFO_SHM_READER = (1<<0),
+	NAMED_FIFO_SHM_WRITER = (1<<1),
+};
+
+/*
+ * Ring placed in shared memory (32-byte header followed by data)
+ * Offsets are free-running counters. write_offset is updated only by
+ * the writer core, and read_offset is updated only by the reader core.
+ * The reader core bumps generation each time it initializes the ring,
+ * and the writer core acknowledges it by copying generation into
+ * writer_generation after it resets write_offset. The reader ignores
+ * write_offset until the writer has acknowledged the current generation.
+ */
+typedef struct named_fifo_shm_ring_s {
+	alt_u32 magic;
+	alt_u32 capacity;
+	alt_u32 generation;
+	alt_u32 writer_generation;
+	alt_u32 write_offset;
+	alt_u32 read_offset;
+	alt_u32 reserved[2];
+	alt_u8 buffer[0];
+} named_fifo_shm_ring;
+
+typedef struct named_fifo_shm_dev_s {
+	alt_dev dev;
+	int role;
+	size_t capacity;
+	volatile named_fifo_shm_ring *ring;
+} named_fifo_shm_dev;
+
+extern void named_fifo_shm_init(void);
+extern int named_fifo_shm_create(const char *name, void *base, size_t size, int role);
+extern int named_fifo_shm_register(named_fifo_shm_dev *dev, const char *name, void *base, size_t size, int role);
+
+#ifdef __cplusplus
+}	/* extern "C" */
+#endif
+
+#endif  /* __NAMED_FIFO_SHM_H__ */
@@ -4,10 +4,53 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include "named_fifo.h"
+#include "named_fifo_log.h"
+#include "named_fifo_shm.h"
 #include "system.h"
 #include "sys/alt_llist.h"
+#include "sys/alt_irq.h"
 #include "priv/alt_file.h"
 
+/*
+ * Update flags and offsets of FIFO
+ * IRQs are disabled during update, because named_fifo_put() may modify
+ * the same fields from ISRs. (lock_common only serializes tasks)
+ */
+static void named_fifo_update_flags(named_fifo_dev *dev, alt_u16 set, alt_u16 clear)
+{
+	alt_irq_context context;
+
+	context = alt_irq_disable_all();
+	dev->flags = (dev->flags & ~clear) | set;
+	alt_irq_enable_all(context);
+}
+
+static void named_fifo_consume(named_fifo_dev *dev, size_t read_offset)
+{
+	alt_irq_context context;
+
+	ALT_SEM_PEND(dev->lock_common, 0);
+	context = alt_irq_disable_all();
+	dev->read_offset = read_offset;
+	dev->flags &= ~NAMED_FIFO_FLAG_BUFFER_FULL;
+	alt_irq_enable_all(context);
+	ALT_SEM_POST(dev->lock_common);
+}
+
+static void named_fifo_produce(named_fifo_dev *dev, size_t write_offset)
+{
+	alt_irq_context context;
+
+	ALT_SEM_PEND(dev->lock_common, 0);
+	context = alt_irq_disable_all();
+	dev->write_offset = write_offset;
+	if (write_offset == dev->read_offset) {
+		dev->flags |= NAMED_FIFO_FLAG_BUFFER_FULL;
+	}
+	alt_irq_enable_all(context);
+	ALT_SEM_POST(dev->lock_common);
+}
+
 static int named_fifo_open(alt_fd *fd, const char *file, int flags, int mode)
 {
 	named_fifo_dev *dev = (named_fifo_dev *)fd->dev;
@@ -16,11 +59,11 @@ static int named_fifo_open(alt_fd *fd, const char *file, int flags, int mode)
 	ALT_SEM_PEND(dev->lock_common, 0);
 	if (accmode & _FREAD) {
 		++dev->readers;
-		dev->flags &= ~NAMED_FIFO_FLAG_READER_CLOSED;
+		named_fifo_update_flags(dev, 0, NAMED_FIFO_FLAG_READER_CLOSED);
 	}
 	if (accmode & _FWRITE) {
 		++dev->writers;
-		dev->flags &= ~NAMED_FIFO_FLAG_WRITER_CLOSED;
+		named_fifo_update_flags(dev, 0, NAMED_FIFO_FLAG_WRITER_CLOSED);
 	}
 	ALT_SEM_POST(dev->lock_common);
 
@@ -35,13 +78,13 @@ static int named_fifo_close(alt_fd *fd)
 	ALT_SEM_PEND(dev->lock_common, 0);
 	if (accmode & _FREAD) {
 		if (--dev->readers == 0) {
-			dev->flags |= NAMED_FIFO_FLAG_READER_CLOSED;
+			named_fifo_update_flags(dev, NAMED_FIFO_FLAG_READER_CLOSED, 0);
 			ALT_SEM_POST(dev->sem_reader);
 		}
 	}
 	if (accmode & _FWRITE) {
 		if (--dev->writers == 0) {
-			dev->flags |= NAMED_FIFO_FLAG_WRITER_CLOSED;
+			named_fifo_update_flags(dev, NAMED_FIFO_FLAG_WRITER_CLOSED, 0);
 			ALT_SEM_POST(dev->sem_writer);
 		}
 	}
@@ -50,16 +93,162 @@ static int named_fifo_close(alt_fd *fd)
 	return 0;
 }
 
+static size_t named_fifo_used(named_fifo_dev *dev)
+{
+	alt_irq_context context;
+	size_t used;
+
+	// Take offsets and flags as a consistent snapshot
+	context = alt_irq_disable_all();
+	if (dev->flags & NAMED_FIFO_FLAG_BUFFER_FULL) {
+		used = dev->capacity;
+	} else {
+		used = (dev->write_offset - dev->read_offset) & (dev->capacity - 1);
+	}
+	alt_irq_enable_all(context);
+	return used;
+}
+
+static void named_fifo_copy_out(named_fifo_dev *dev, size_t offset, void *ptr, size_t len)
+{
+	size_t len1 = dev->capacity - offset;
+
+	if (len < len1) {
+		len1 = len;
+	}
+	memcpy(ptr, dev->buffer + offset, len1);
+	if (len > len1) {
+		memcpy((alt_u8 *)ptr + len1, dev->buffer, len - len1);
+	}
+}
+
+static void named_fifo_copy_in(named_fifo_dev *dev, size_t offset, const void *ptr, size_t len)
+{
+	size_t len1 = dev->capacity - offset;
+
+	if (len < len1) {
+		len1 = len;
+	}
+	memcpy(dev->buffer + offset, ptr, len1);
+	if (len > len1) {
+		memcpy(dev->buffer, (const alt_u8 *)ptr + len1, len - len1);
+	}
+}
+
+/*
+ * Read one record (message mode)
+ * Each record is stored as a length header followed by its payload.
+ */
+static int named_fifo_read_message(alt_fd *fd, char *ptr, int len)
+{
+	named_fifo_dev *dev = (named_fifo_dev *)fd->dev;
+	alt_u32 msg_len;
+	size_t offset;
+
+	// Wait for record
+retry:
+	ALT_SEM_PEND(dev->sem_reader, 0);
+
+	if (named_fifo_used(dev) < NAMED_FIFO_MESSAGE_HEADER) {
+		// No record to read now
+		ALT_SEM_POST(dev->sem_reader);
+
+		if (dev->flags & NAMED_FIFO_FLAG_WRITER_CLOSED) {
+			// Closed pipe (No writer)
+			return 0;
+		}
+
+		if (fd->fd_flags & O_NONBLOCK) {
+			return -EWOULDBLOCK;
+		}
+		goto retry;
+	}
+
+	named_fifo_copy_out(dev, dev->read_offset, &msg_len, NAMED_FIFO_MESSAGE_HEADER);
+	if (msg_len > len) {
+		// Record does not fit (Record is kept in FIFO)
+		ALT_SEM_POST(dev->sem_reader);
+		return -EMSGSIZE;
+	}
+
+	// Data transfer
+	offset = (dev->read_offset + NAMED_FIFO_MESSAGE_HEADER) & (dev->capacity - 1);
+	named_fifo_copy_out(dev, offset, ptr, msg_len);
+
+	// Update offset & flags
+	named_fifo_consume(dev, (offset + msg_len) & (dev->capacity - 1));
+
+	ALT_SEM_POST(dev->sem_reader);
+	ALT_SEM_POST(dev->sem_writer);
+
+	return msg_len;
+}
+
+/*
+ * Write one record (message mode)
+ * The record is stored as a whole or not at all.
+ */
+static int named_fifo_write_message(alt_fd *fd, const char *ptr, int len)
+{
+	named_fifo_dev *dev = (named_fifo_dev *)fd->dev;
+	size_t required = NAMED_FIFO_MESSAGE_HEADER + len;
+	alt_u32 msg_len = len;
+	size_t offset;
+
+	if (required > dev->capacity) {
+		// Record never fits
+		return -EMSGSIZE;
+	}
+
+	// Wait for space
+retry:
+	ALT_SEM_PEND(dev->sem_writer, 0);
+
+	if ((dev->capacity - named_fifo_used(dev)) < required) {
+		// No space to write now
+		ALT_SEM_POST(dev->sem_writer);
+
+		if (dev->flags & NAMED_FIFO_FLAG_READER_CLOSED) {
+			// Closed pipe (No reader)
+			return -EPIPE;
+		}
+
+		if (fd->fd_flags & O_NONBLOCK) {
+			return -EWOULDBLOCK;
+		}
+		goto retry;
+	}
+
+	// Data transfer
+	named_fifo_copy_in(dev, dev->write_offset, &msg_len, NAMED_FIFO_MESSAGE_HEADER);
+	offset = (dev->write_offset + NAMED_FIFO_MESSAGE_HEADER) & (dev->capacity - 1);
+	named_fifo_copy_in(dev, offset, ptr, len);
+
+	// Update offset & flags
+	named_fifo_produce(dev, (offset + len) & (dev->capacity - 1));
+
+	ALT_SEM_POST(dev->sem_writer);
+	ALT_SEM_POST(dev->sem_reader);
+
+	return len;
+}
+
 static int named_fifo_read(alt_fd *fd, char *ptr, int len)
 {
 	named_fifo_dev *dev = (named_fifo_dev *)fd->dev;
+	alt_irq_context context;
 	size_t write_offset;
+	int full;
 	ssize_t readable1, readable2;
 	
 	if (!(((fd->fd_flags & O_ACCMODE) + 1) & _FREAD)) {
 		return -EACCES;
 	}
 
+	if (dev->flags & NAMED_FIFO_FLAG_MESSAGE) {
+		return named_fifo_read_message(fd, ptr, len);
+	}
+
 	if (len == 0) {
 		return 0;
 	}
@@ -67,7 +256,10 @@ static int named_fifo_read(alt_fd *fd, char *ptr, int len)
 	// Wait for data
 retry:
 	ALT_SEM_PEND(dev->sem_reader, 0);
+	context = alt_irq_disable_all();
 	write_offset = dev->write_offset;
+	full = dev->flags & NAMED_FIFO_FLAG_BUFFER_FULL;
+	alt_irq_enable_all(context);
 
 	if (dev->read_offset < write_offset) {
 		readable1 = write_offset - dev->read_offset;
@@ -75,8 +267,7 @@ retry:
 	} else {
 		readable1 = dev->capacity - dev->read_offset;
 		readable2 = write_offset;
-		if ((dev->read_offset == write_offset) &&
-			!(dev->flags & NAMED_FIFO_FLAG_BUFFER_FULL)) {
+		if ((dev->read_offset == write_offset) && !full) {
 			// No data to read now
 			ALT_SEM_POST(dev->sem_reader);
 
@@ -111,10 +302,7 @@ retry:
 	}
 
 	// Update offset & flags
-	ALT_SEM_PEND(dev->lock_common, 0);
-	dev->read_offset = (dev->read_offset + len) & (dev->capacity - 1);
-	dev->flags &= ~NAMED_FIFO_FLAG_BUFFER_FULL;
-	ALT_SEM_POST(dev->lock_common);
+	named_fifo_consume(dev, (dev->read_offset + len) & (dev->capacity - 1));
 
 	ALT_SEM_POST(dev->sem_reader);
 	ALT_SEM_POST(dev->sem_writer);
@@ -133,9 +321,14 @@ static int named_fifo_write(alt_fd *fd, const char *ptr, int len)
 	}
 
 	if (len == 0) {
+		// Empty record is not stored even in message mode
 		return 0;
 	}
 
+	if (dev->flags & NAMED_FIFO_FLAG_MESSAGE) {
+		return named_fifo_write_message(fd, ptr, len);
+	}
+
 	// Wait for space
 retry:
 	ALT_SEM_PEND(dev->sem_writer, 0);
@@ -183,15 +376,37 @@ retry:
 	}
 
 	// Update offset & flags
-	ALT_SEM_PEND(dev->lock_common, 0);
+	named_fifo_produce(dev, (dev->write_offset + len) & (dev->capacity - 1));
+
+	ALT_SEM_POST(dev->sem_writer);
+	ALT_SEM_POST(dev->sem_reader);
+
+	return len;
+}
+
+/*
+ * Write whole data into FIFO or nothing (never blocks)
+ * This can be called from ISRs because the ring is updated with IRQs disabled.
+ * Readers also update offsets and flags with IRQs disabled, but writers must
+ * not mix named_fifo_put() and write() on the same FIFO.
+ */
+int named_fifo_put(named_fifo_dev *dev, const void *ptr, size_t len)
+{
+	alt_irq_context context;
+
+	context = alt_irq_disable_all();
+	if ((dev->capacity - named_fifo_used(dev)) < len) {
+		alt_irq_enable_all(context);
+		return -EWOULDBLOCK;
+	}
+	named_fifo_copy_in(dev, dev->write_offset, ptr, len);
 	dev->write_offset = (dev->write_offset + len) & (dev->capacity - 1);
 	if (dev->write_offset == dev->read_offset) {
 		dev->flags |= NAMED_FIFO_FLAG_BUFFER_FULL;
 	}
+	alt_irq_enable_all(context);
 
-	ALT_SEM_POST(dev->sem_writer);
 	ALT_SEM_POST(dev->sem_reader);
-
 	return len;
 }
 
@@ -249,25 +464,75 @@ void named_fifo_close_stdio(void)
 #endif
 }
 
+/*
+ * Statically allocated FIFOs (declared in BSP settings)
+ */
+#if (NAMED_FIFO_STDIN_ENABLE)
+NAMED_FIFO_STATIC_DEFINE(stdin_fifo, NAMED_FIFO_STDIN_SIZE);
+#endif
+#if (NAMED_FIFO_STDOUT_ENABLE)
+NAMED_FIFO_STATIC_DEFINE(stdout_fifo, NAMED_FIFO_STDOUT_SIZE);
+#endif
+#if (NAMED_FIFO_STDERR_ENABLE)
+NAMED_FIFO_STATIC_DEFINE(stderr_fifo, NAMED_FIFO_STDERR_SIZE);
+#endif
+#if (NAMED_FIFO_FIFO0_ENABLE)
+NAMED_FIFO_STATIC_DEFINE(fifo0, NAMED_FIFO_FIFO0_SIZE);
+#endif
+#if (NAMED_FIFO_FIFO1_ENABLE)
+NAMED_FIFO_STATIC_DEFINE(fifo1, NAMED_FIFO_FIFO1_SIZE);
+#endif
+#if (NAMED_FIFO_FIFO2_ENABLE)
+NAMED_FIFO_STATIC_DEFINE(fifo2, NAMED_FIFO_FIFO2_SIZE);
+#endif
+#if (NAMED_FIFO_FIFO3_ENABLE)
+NAMED_FIFO_STATIC_DEFINE(fifo3, NAMED_FIFO_FIFO3_SIZE);
+#endif
+
+#define REGISTER_STATIC(var, name, flags) \
+	named_fifo_register(&var, name, var##_buffer, sizeof(var##_buffer), flags)
+
 void named_fifo_init(void)
 {
 #if (NAMED_FIFO_STDIN_ENABLE)
 # ifdef ALT_STDIN_PRESENT
 #  error "To use named FIFO as stdin, change hal.stdin to 'none'"
 # endif
-	named_fifo_create(NAMED_FIFO_STDIN_NAME, NAMED_FIFO_STDIN_SIZE);
+	REGISTER_STATIC(stdin_fifo, NAMED_FIFO_STDIN_NAME, 0);
 #endif
 #if (NAMED_FIFO_STDOUT_ENABLE)
 # ifdef ALT_STDOUT_PRESENT
 #  error "To use named FIFO as stdout, change hal.stdout to 'none'"
 # endif
-	named_fifo_create(NAMED_FIFO_STDOUT_NAME, NAMED_FIFO_STDOUT_SIZE);
+	REGISTER_STATIC(stdout_fifo, NAMED_FIFO_STDOUT_NAME, 0);
 #endif
 #if (NAMED_FIFO_STDERR_ENABLE)
 # ifdef ALT_STDERR_PRESENT
 #  error "To use named FIFO as stderr, change hal.stderr to 'none'"
 # endif
-	named_fifo_create(NAMED_FIFO_STDERR_NAME, NAMED_FIFO_STDERR_SIZE);
+	REGISTER_STATIC(stderr_fifo, NAMED_FIFO_STDERR_NAME, 0);
+#endif
+#if (NAMED_FIFO_FIFO0_ENABLE)
+	REGISTER_STATIC(fifo0, NAMED_FIFO_FIFO0_NAME,
+		(NAMED_FIFO_FIFO0_MESSAGE) ? NAMED_FIFO_FLAG_MESSAGE : 0);
+#endif
+#if (NAMED_FIFO_FIFO1_ENABLE)
+	REGISTER_STATIC(fifo1, NAMED_FIFO_FIFO1_NAME,
+		(NAMED_FIFO_FIFO1_MESSAGE) ? NAMED_FIFO_FLAG_MESSAGE : 0);
+#endif
+#if (NAMED_FIFO_FIFO2_ENABLE)
+	REGISTER_STATIC(fifo2, NAMED_FIFO_FIFO2_NAME,
+		(NAMED_FIFO_FIFO2_MESSAGE) ? NAMED_FIFO_FLAG_MESSAGE : 0);
+#endif
+#if (NAMED_FIFO_FIFO3_ENABLE)
+	REGISTER_STATIC(fifo3, NAMED_FIFO_FIFO3_NAME,
+		(NAMED_FIFO_FIFO3_MESSAGE) ? NAMED_FIFO_FLAG_MESSAGE : 0);
+#endif
+#if (NAMED_FIFO_LOG_ENABLE)
+	named_fifo_log_init();
+#endif
+#if (NAMED_FIFO_SHM0_ENABLE)
+	named_fifo_shm_init();
 #endif
 #if (NAMED_FIFO_STDIN_ENABLE) || (NAMED_FIFO_STDOUT_ENABLE) || (NAMED_FIFO_STDERR_ENABLE)
 # if (NAMED_FIFO_STDIO_INIT_OPENED)
@@ -276,10 +541,41 @@ void named_fifo_init(void)
 #endif
 }
 
-int named_fifo_create(const char *name, size_t size)
+/*
+ * Register FIFO with caller-provided device and ring buffer
+ * (capacity must be a power of 2 and not less than NAMED_FIFO_MINIMUM_SIZE)
+ */
+int named_fifo_register(named_fifo_dev *dev, const char *name, alt_u8 *buffer, size_t capacity, int flags)
+{
+	if ((capacity < NAMED_FIFO_MINIMUM_SIZE) || (capacity & (capacity - 1))) {
+		return -EINVAL;
+	}
+
+	memcpy(&dev->dev, &named_fifo_dev_template, sizeof(dev->dev));
+	dev->dev.name = name;
+	dev->buffer = buffer;
+
+	dev->flags = flags & NAMED_FIFO_FLAG_MESSAGE;
+	dev->reserved = 0;
+	dev->readers = 0;
+	dev->writers = 0;
+	dev->capacity = capacity;
+	dev->read_offset = 0;
+	dev->write_offset = 0;
+
+	ALT_SEM_CREATE(&dev->lock_common, 1);
+	ALT_SEM_CREATE(&dev->sem_reader, 0);
+	ALT_SEM_CREATE(&dev->sem_writer, 0);
+
+	return alt_dev_reg(&dev->dev);
+}
+
+static int named_fifo_create_with_flags(const char *name, size_t size, alt_u16 flags)
 {
 	int namelen = strlen(name) + 1;
 	named_fifo_dev *dev;
+	alt_u8 *buffer;
+	int result;
 
 	if (size <= NAMED_FIFO_MINIMUM_SIZE) {
 		size = NAMED_FIFO_MINIMUM_SIZE;
@@ -299,24 +595,29 @@ int named_fifo_create(const char *name, size_t size)
 		return -ENOMEM;
 	}
 
-	memcpy(&dev->dev, &named_fifo_dev_template, sizeof(dev->dev));
-	dev->buffer = (alt_u8 *)(dev + 1);
-	dev->dev.name = (const char *)(dev->buffer + size);
-	memcpy((char *)dev->dev.name, name, namelen);
+	buffer = (alt_u8 *)(dev + 1);
+	memcpy(buffer + size, name, namelen);
 
-	dev->flags = 0;
-	dev->reserved = 0;
-	dev->readers = 0;
-	dev->writers = 0;
-	dev->capacity = size;
-	dev->read_offset = 0;
-	dev->write_offset = 0;
+	result = named_fifo_register(dev, (const char *)(buffer + size), buffer, size, flags);
+	if (result < 0) {
+		free(dev);
+	}
+	return result;
+}
 
-	ALT_SEM_CREATE(&dev->lock_common, 1);
-	ALT_SEM_CREATE(&dev->sem_reader, 0);
-	ALT_SEM_CREATE(&dev->sem_writer, 0);
+int named_fifo_create(const char *name, size_t size)
+{
+	return named_fifo_create_with_flags(name, size, 0);
+}
 
-	return alt_dev_reg(&dev->dev);
+/*
+ * Create named FIFO which preserves record boundaries.
+ * Each write() stores one record, and each read() returns exactly one record
+ * (or -EMSGSIZE if the record does not fit in the read buffer).
+ */
+int named_fifo_create_message(const char *name, size_t size)
+{
+	return named_fifo_create_with_flags(name, size, NAMED_FIFO_FLAG_MESSAGE);
 }
 
 int mkfifo(const char *name, mode_t mode)
@@ -0,0 +1,56 @@
+#include <stdarg.h>
+#include <errno.h>
+#include "system.h"
+#include "named_fifo.h"
+#include "named_fifo_log.h"
+#include "sys/alt_alarm.h"
+
+#if (NAMED_FIFO_LOG_ENABLE)
+
+NAMED_FIFO_STATIC_DEFINE(log_fifo, NAMED_FIFO_LOG_SIZE);
+
+static alt_u32 log_dropped;
+
+void named_fifo_log_init(void)
+{
+	named_fifo_register(&log_fifo, NAMED_FIFO_LOG_NAME,
+		log_fifo_buffer, sizeof(log_fifo_buffer), 0);
+}
+
+/*
+ * Write one log record without formatting
+ * (Use NAMED_FIFO_LOG macro instead of calling this directly)
+ * Records are dropped (never blocks) when the FIFO is full.
+ */
+int named_fifo_log_write(const char *fmt, int nargs, ...)
+{
+	alt_u32 record[NAMED_FIFO_LOG_HEADER_WORDS + NAMED_FIFO_LOG_MAX_ARGS];
+	va_list args;
+	int i;
+
+	if ((nargs < 0) || (nargs > NAMED_FIFO_LOG_MAX_ARGS)) {
+		return -EINVAL;
+	}
+
+	record[0] = NAMED_FIFO_LOG_MAGIC | nargs;
+	record[1] = (alt_u32)fmt;
+	record[2] = alt_nticks();
+	va_start(args, nargs);
+	for (i = 0; i < nargs; ++i) {
+		record[NAMED_FIFO_LOG_HEADER_WORDS + i] = va_arg(args, alt_u32);
+	}
+	va_end(args);
+
+	if (named_fifo_put(&log_fifo, record, (NAMED_FIFO_LOG_HEADER_WORDS + nargs) * sizeof(alt_u32)) < 0) {
+		++log_dropped;
+		return -EWOULDBLOCK;
+	}
+	return 0;
+}
+
+alt_u32 named_fifo_log_dropped(void)
+{
+	return log_dropped;
+}
+
+#endif  /* NAMED_FIFO_LOG_ENABLE */
@@ -0,0 +1,289 @@
+#include <string.h>
+#include <malloc.h>
+#include <errno.h>
+#include <fcntl.h>
+#include "named_fifo.h"
+#include "named_fifo_shm.h"
+#include "system.h"
+#include "sys/alt_cache.h"
+#include "priv/alt_file.h"
+
+/*
+ * Single-producer single-consumer FIFO shared between two cores
+ * Ring header and data are always accessed through the cache-bypassed
+ * alias, so each core only needs ordering (not coherency) guarantees.
+ */
+
+#define SHM_BARRIER()   __sync_synchronize()
+
+#ifdef __tinythreads__
+# include <sched.h>
+# define YIELD()    sched_yield()
+#else
+# define YIELD()    do { } while (0)
+#endif
+
+/*
+ * Attach writer to current generation of ring
+ * Returns zero if attached, -EWOULDBLOCK if the reader has not initialized
+ * the ring yet, or -EINVAL if the ring was initialized with another capacity.
+ */
+static int named_fifo_shm_attach(named_fifo_shm_dev *dev)
+{
+	volatile named_fifo_shm_ring *ring = dev->ring;
+	alt_u32 generation;
+
+	// Reader clears magic before it changes generation and offsets,
+	// so generation read before a valid magic belongs to a complete ring.
+	generation = ring->generation;
+	SHM_BARRIER();
+	if (ring->magic != NAMED_FIFO_SHM_MAGIC) {
+		return -EWOULDBLOCK;
+	}
+	if (ring->capacity != dev->capacity) {
+		return -EINVAL;
+	}
+	if (ring->writer_generation != generation) {
+		// Ring has been (re-)initialized: discard what this side wrote before
+		ring->write_offset = ring->read_offset;
+		SHM_BARRIER();
+		ring->writer_generation = generation;
+	}
+	return 0;
+}
+
+static int named_fifo_shm_open(alt_fd *fd, const char *file, int flags, int mode)
+{
+	named_fifo_shm_dev *dev = (named_fifo_shm_dev *)fd->dev;
+	int accmode = (flags & O_ACCMODE) + 1;
+
+	if ((accmode & _FREAD) && !(dev->role & NAMED_FIFO_SHM_READER)) {
+		return -EACCES;
+	}
+	if ((accmode & _FWRITE) && !(dev->role & NAMED_FIFO_SHM_WRITER)) {
+		return -EACCES;
+	}
+	return 0;
+}
+
+static int named_fifo_shm_read(alt_fd *fd, char *ptr, int len)
+{
+	named_fifo_shm_dev *dev = (named_fifo_shm_dev *)fd->dev;
+	volatile named_fifo_shm_ring *ring = dev->ring;
+	alt_u32 read_offset;
+	alt_u32 readable;
+	size_t offset, readable1;
+
+	if (!(((fd->fd_flags & O_ACCMODE) + 1) & _FREAD)) {
+		return -EACCES;
+	}
+
+	if (len == 0) {
+		return 0;
+	}
+
+	// Wait for data (from writer attached to current generation)
+	read_offset = ring->read_offset;
+	for (;;) {
+		if (ring->writer_generation == ring->generation) {
+			SHM_BARRIER();
+			readable = ring->write_offset - read_offset;
+			if (readable > 0) {
+				break;
+			}
+		}
+		if (fd->fd_flags & O_NONBLOCK) {
+			return -EWOULDBLOCK;
+		}
+		YIELD();
+	}
+	SHM_BARRIER();
+
+	// Adjustment read length
+	if (readable < len) {
+		len = readable;
+	}
+	offset = read_offset & (dev->capacity - 1);
+	readable1 = dev->capacity - offset;
+	if (len < readable1) {
+		readable1 = len;
+	}
+
+	// Data transfer
+	memcpy(ptr, (const alt_u8 *)ring->buffer + offset, readable1);
+	if (len > readable1) {
+		memcpy(ptr + readable1, (const alt_u8 *)ring->buffer, len - readable1);
+	}
+
+	// Publish offset (after data is consumed)
+	SHM_BARRIER();
+	ring->read_offset = read_offset + len;
+
+	return len;
+}
+
+static int named_fifo_shm_write(alt_fd *fd, const char *ptr, int len)
+{
+	named_fifo_shm_dev *dev = (named_fifo_shm_dev *)fd->dev;
+	volatile named_fifo_shm_ring *ring = dev->ring;
+	alt_u32 generation;
+	alt_u32 write_offset;
+	alt_u32 used;
+	alt_u32 writable;
+	size_t offset, writable1;
+	int result;
+
+	if (!(((fd->fd_flags & O_ACCMODE) + 1) & _FWRITE)) {
+		return -EACCES;
+	}
+
+	if (len == 0) {
+		return 0;
+	}
+
+retry:
+	// Wait for reader side initialization and space
+	for (;;) {
+		result = named_fifo_shm_attach(dev);
+		if (result == 0) {
+			generation = ring->writer_generation;
+			SHM_BARRIER();
+			write_offset = ring->write_offset;
+			used = write_offset - ring->read_offset;
+			// More than capacity means read_offset has been reset by
+			// the reader after attach (ring of next generation)
+			if (used < dev->capacity) {
+				writable = dev->capacity - used;
+				break;
+			}
+		} else if (result != -EWOULDBLOCK) {
+			return result;
+		}
+		if (fd->fd_flags & O_NONBLOCK) {
+			return -EWOULDBLOCK;
+		}
+		YIELD();
+	}
+
+	// Adjustment write length (never exceeds capacity)
+	if (writable < len) {
+		len = writable;
+	}
+	offset = write_offset & (dev->capacity - 1);
+	writable1 = dev->capacity - offset;
+	if (len < writable1) {
+		writable1 = len;
+	}
+
+	// Data transfer
+	memcpy((alt_u8 *)ring->buffer + offset, ptr, writable1);
+	if (len > writable1) {
+		memcpy((alt_u8 *)ring->buffer, ptr + writable1, len - writable1);
+	}
+
+	// Publish offset (after data is stored) unless the reader has
+	// re-initialized the ring meanwhile (then write again to new generation)
+	SHM_BARRIER();
+	if (ring->generation != generation) {
+		goto retry;
+	}
+	ring->write_offset = write_offset + len;
+
+	return len;
+}
+
+static const alt_dev named_fifo_shm_dev_template = {
+	ALT_LLIST_ENTRY,
+	NULL, /* name: filled in named_fifo_shm_register */
+	named_fifo_shm_open,
+	NULL, /* close */
+	named_fifo_shm_read,
+	named_fifo_shm_write,
+	NULL, /* lseek */
+	NULL, /* fstat */
+	NULL, /* ioctl */
+};
+
+/*
+ * Register shared memory FIFO
+ * Both cores register the same region; one with NAMED_FIFO_SHM_READER and
+ * the other with NAMED_FIFO_SHM_WRITER. The reader side initializes the ring
+ * (again if it restarts), and the writer side follows it on next write.
+ * The writer side fails with -EINVAL if the ring is already initialized
+ * with another capacity (size differs between cores).
+ */
+int named_fifo_shm_register(named_fifo_shm_dev *dev, const char *name, void *base, size_t size, int role)
+{
+	volatile named_fifo_shm_ring *ring;
+	size_t capacity;
+
+	if ((size < sizeof(*ring) + NAMED_FIFO_MINIMUM_SIZE) ||
+		((role != NAMED_FIFO_SHM_READER) && (role != NAMED_FIFO_SHM_WRITER))) {
+		return -EINVAL;
+	}
+
+	// Round down capacity to power of 2
+	size -= sizeof(*ring);
+	for (capacity = NAMED_FIFO_MINIMUM_SIZE; (capacity << 1) <= size; capacity <<= 1);
+
+	ring = (volatile named_fifo_shm_ring *)alt_remap_uncached(base, sizeof(*ring) + capacity);
+
+	memcpy(&dev->dev, &named_fifo_shm_dev_template, sizeof(dev->dev));
+	dev->dev.name = name;
+	dev->role = role;
+	dev->capacity = capacity;
+	dev->ring = ring;
+
+	if (role == NAMED_FIFO_SHM_READER) {
+		alt_u32 generation;
+
+		ring->magic = 0;
+		SHM_BARRIER();
+		// New generation must differ from the one acknowledged by writer
+		// (contents are undefined at power-on)
+		generation = ring->generation + 1;
+		if (generation == ring->writer_generation) {
+			++generation;
+		}
+		ring->generation = generation;
+		ring->capacity = capacity;
+		ring->read_offset = 0;
+		SHM_BARRIER();
+		ring->magic = NAMED_FIFO_SHM_MAGIC;
+	} else if (named_fifo_shm_attach(dev) == -EINVAL) {
+		return -EINVAL;
+	}
+
+	return alt_dev_reg(&dev->dev);
+}
+
+int named_fifo_shm_create(const char *name, void *base, size_t size, int role)
+{
+	named_fifo_shm_dev *dev;
+	int result;
+
+	dev = (named_fifo_shm_dev *)malloc(sizeof(*dev));
+	if (!dev) {
+		return -ENOMEM;
+	}
+
+	result = named_fifo_shm_register(dev, name, base, size, role);
+	if (result < 0) {
+		free(dev);
+	}
+	return result;
+}
+
+#if (NAMED_FIFO_SHM0_ENABLE)
+# if !(NAMED_FIFO_SHM0_BASE)
+#  error "Set shm0.base to the base address of shared memory region for FIFO #0"
+# endif
+static named_fifo_shm_dev shm0;
+
+void named_fifo_shm_init(void)
+{
+	named_fifo_shm_register(&shm0, NAMED_FIFO_SHM0_NAME,
+		(void *)(NAMED_FIFO_SHM0_BASE), NAMED_FIFO_SHM0_SIZE,
+		(NAMED_FIFO_SHM0_WRITER) ? NAMED_FIFO_SHM_WRITER : NAMED_FIFO_SHM_READER);
+}
+#endif  /* NAMED_FIFO_SHM0_ENABLE */
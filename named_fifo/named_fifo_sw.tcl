@@ -13,8 +13,12 @@ set_sw_property bsp_subdirectory services
 #
 
 add_sw_property c_source HAL/src/named_fifo.c
+add_sw_property c_source HAL/src/named_fifo_log.c
+add_sw_property c_source HAL/src/named_fifo_shm.c
 
 add_sw_property include_source HAL/inc/named_fifo.h
+add_sw_property include_source HAL/inc/named_fifo_log.h
+add_sw_property include_source HAL/inc/named_fifo_shm.h
 add_sw_property include_directory inc
 
 add_sw_property supported_bsp_type HAL
@@ -36,4 +40,36 @@ add_sw_setting decimal_number system_h_define stderr.size NAMED_FIFO_STDERR_SIZE
 
 add_sw_setting boolean system_h_define stdio.initially_opened NAMED_FIFO_STDIO_INIT_OPENED 1 "Start system with stdio opened."
 
+add_sw_setting quoted_string system_h_define static.section NAMED_FIFO_STATIC_SECTION ".bss.named_fifo" "Linker section for statically allocated FIFOs (stdio and fifo0-3). A section other than .bss.* must be mapped in Linker Script page."
+
+add_sw_setting boolean system_h_define fifo0.enable NAMED_FIFO_FIFO0_ENABLE 0 "Create statically allocated named FIFO #0 at startup"
+add_sw_setting quoted_string system_h_define fifo0.name NAMED_FIFO_FIFO0_NAME "/dev/fifo0" "Name of FIFO #0"
+add_sw_setting decimal_number system_h_define fifo0.size NAMED_FIFO_FIFO0_SIZE 1024 "Buffer length for FIFO #0 (in bytes)"
+add_sw_setting boolean system_h_define fifo0.message NAMED_FIFO_FIFO0_MESSAGE 0 "Use message mode (preserve record boundaries) for FIFO #0"
+
+add_sw_setting boolean system_h_define fifo1.enable NAMED_FIFO_FIFO1_ENABLE 0 "Create statically allocated named FIFO #1 at startup"
+add_sw_setting quoted_string system_h_define fifo1.name NAMED_FIFO_FIFO1_NAME "/dev/fifo1" "Name of FIFO #1"
+add_sw_setting decimal_number system_h_define fifo1.size NAMED_FIFO_FIFO1_SIZE 1024 "Buffer length for FIFO #1 (in bytes)"
+add_sw_setting boolean system_h_define fifo1.message NAMED_FIFO_FIFO1_MESSAGE 0 "Use message mode (preserve record boundaries) for FIFO #1"
+
+add_sw_setting boolean system_h_define fifo2.enable NAMED_FIFO_FIFO2_ENABLE 0 "Create statically allocated named FIFO #2 at startup"
+add_sw_setting quoted_string system_h_define fifo2.name NAMED_FIFO_FIFO2_NAME "/dev/fifo2" "Name of FIFO #2"
+add_sw_setting decimal_number system_h_define fifo2.size NAMED_FIFO_FIFO2_SIZE 1024 "Buffer length for FIFO #2 (in bytes)"
+add_sw_setting boolean system_h_define fifo2.message NAMED_FIFO_FIFO2_MESSAGE 0 "Use message mode (preserve record boundaries) for FIFO #2"
+
+add_sw_setting boolean system_h_define fifo3.enable NAMED_FIFO_FIFO3_ENABLE 0 "Create statically allocated named FIFO #3 at startup"
+add_sw_setting quoted_string system_h_define fifo3.name NAMED_FIFO_FIFO3_NAME "/dev/fifo3" "Name of FIFO #3"
+add_sw_setting decimal_number system_h_define fifo3.size NAMED_FIFO_FIFO3_SIZE 1024 "Buffer length for FIFO #3 (in bytes)"
+add_sw_setting boolean system_h_define fifo3.message NAMED_FIFO_FIFO3_MESSAGE 0 "Use message mode (preserve record boundaries) for FIFO #3"
+
+add_sw_setting boolean system_h_define log.enable NAMED_FIFO_LOG_ENABLE 0 "Enable binary logger (NAMED_FIFO_LOG) which writes unformatted records to a named FIFO. Use tools/named_fifo_logdec.py to decode them on host."
+add_sw_setting quoted_string system_h_define log.name NAMED_FIFO_LOG_NAME "/dev/log" "Name of binary log device"
+add_sw_setting decimal_number system_h_define log.size NAMED_FIFO_LOG_SIZE 4096 "Buffer length for binary log device (in bytes)"
+
+add_sw_setting boolean system_h_define shm0.enable NAMED_FIFO_SHM0_ENABLE 0 "Create named FIFO #0 in memory shared with another core. Both cores must enable this with the same base and size, and opposite direction."
+add_sw_setting quoted_string system_h_define shm0.name NAMED_FIFO_SHM0_NAME "/dev/shm0" "Name of shared memory FIFO #0"
+add_sw_setting unquoted_string system_h_define shm0.base NAMED_FIFO_SHM0_BASE none "Base address of shared memory region for FIFO #0 (required; must not be used by anything else)"
+add_sw_setting decimal_number system_h_define shm0.size NAMED_FIFO_SHM0_SIZE 1056 "Byte length of shared memory region for FIFO #0 (including 32-byte header). Must be the same on both cores"
+add_sw_setting boolean system_h_define shm0.writer NAMED_FIFO_SHM0_WRITER 0 "This core writes to shared memory FIFO #0 (When disabled, this core reads from it)"
+
 # End of file
@@ -0,0 +1,12 @@
+/*
+ * Minimal HAL headers for building named_fifo on Linux (tools only)
+ */
+#ifndef __ALT_FILE_H__
+#define __ALT_FILE_H__
+
+#include "sys/alt_dev.h"
+
+#define _FREAD  1
+#define _FWRITE 2
+
+#endif  /* __ALT_FILE_H__ */
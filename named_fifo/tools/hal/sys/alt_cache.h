@@ -0,0 +1,13 @@
+/*
+ * Minimal HAL headers for building named_fifo on Linux (tools only)
+ * Host memory is coherent, so no remapping is needed.
+ */
+#ifndef __ALT_CACHE_H__
+#define __ALT_CACHE_H__
+
+static inline void *alt_remap_uncached(void *ptr, unsigned long len)
+{
+    return ptr;
+}
+
+#endif  /* __ALT_CACHE_H__ */
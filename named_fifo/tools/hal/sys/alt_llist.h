@@ -0,0 +1,14 @@
+/*
+ * Minimal HAL headers for building named_fifo on Linux (tools only)
+ */
+#ifndef __ALT_LLIST_H__
+#define __ALT_LLIST_H__
+
+typedef struct alt_llist_s {
+	struct alt_llist_s *next;
+	struct alt_llist_s *previous;
+} alt_llist;
+
+#define ALT_LLIST_ENTRY {0, 0}
+
+#endif  /* __ALT_LLIST_H__ */
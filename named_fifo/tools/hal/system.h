@@ -0,0 +1,8 @@
+/*
+ * Minimal HAL headers for building named_fifo on Linux (tools only)
+ * Settings of named_fifo are given by -D options instead.
+ */
+#ifndef __SYSTEM_H_
+#define __SYSTEM_H_
+
+#endif  /* __SYSTEM_H_ */
@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+#
+# named_fifo_logdec.py
+#
+# Decode binary log records written by NAMED_FIFO_LOG (named_fifo_log.h).
+# Format strings are looked up in the ELF file of the application.
+#
+# Usage: named_fifo_logdec.py <app.elf> [<log.bin>]  (reads stdin if omitted)
+#
+
+import re
+import struct
+import sys
+
+MAGIC = 0x4c4f4700  # NAMED_FIFO_LOG_MAGIC
+HEADER_SIZE = 12    # NAMED_FIFO_LOG_HEADER_WORDS * 4
+
+SHF_ALLOC = 0x2
+SHT_NOBITS = 8
+
+CONVERSION = re.compile(r"%([-+ #0]*)(\*|\d+)?(?:\.(\*|\d+))?(hh|h|ll|l|j|z|t)?([diouxXcsp%])")
+
+
+class ElfImage:
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            data = f.read()
+        if data[:4] != b"\x7fELF" or data[4] != 1 or data[5] != 1:
+            raise ValueError("%s is not a 32-bit little-endian ELF" % path)
+        (shoff,) = struct.unpack_from("<I", data, 0x20)
+        shentsize, shnum = struct.unpack_from("<HH", data, 0x2e)
+        self.sections = []
+        for i in range(shnum):
+            (_, sh_type, flags, addr, offset, size) = struct.unpack_from(
+                "<IIIIII", data, shoff + i * shentsize)
+            if (flags & SHF_ALLOC) and sh_type != SHT_NOBITS and size > 0:
+                self.sections.append((addr, data[offset:offset + size]))
+
+    def string(self, addr):
+        for (base, body) in self.sections:
+            if base <= addr < base + len(body):
+                start = addr - base
+                end = body.find(b"\0", start)
+                if end < 0:
+                    end = len(body)
+                return body[start:end].decode("utf-8", "replace")
+        return None
+
+
+def signed(value):
+    return value - 0x100000000 if value & 0x80000000 else value
+
+
+def format_record(elf, fmt, words):
+    args = iter(words)
+    out = []
+    pos = 0
+    for m in CONVERSION.finditer(fmt):
+        out.append(fmt[pos:m.start()])
+        pos = m.end()
+        flags, width, prec, _, conv = m.groups()
+        if conv == "%":
+            out.append("%")
+            continue
+        if width == "*":
+            width = str(signed(next(args)))
+        if prec == "*":
+            prec = str(signed(next(args)))
+        spec = "%" + flags + (width or "") + ("." + prec if prec else "")
+        value = next(args)
+        if conv in "di":
+            out.append((spec + "d") % signed(value))
+        elif conv == "c":
+            out.append((spec + "c") % chr(value & 0xff))
+        elif conv == "s":
+            text = elf.string(value)
+            out.append((spec + "s") % (text if text is not None else "<0x%08x>" % value))
+        elif conv == "p":
+            out.append((spec + "s") % ("0x%x" % value))
+        else:
+            out.append((spec + conv) % value)
+    out.append(fmt[pos:])
+    return "".join(out)
+
+
+def count_words(fmt):
+    count = 0
+    for m in CONVERSION.finditer(fmt):
+        _, width, prec, _, conv = m.groups()
+        if conv == "%":
+            continue
+        count += 1 + (width == "*") + (prec == "*")
+    return count
+
+
+def main(argv):
+    if len(argv) < 2:
+        sys.stderr.write("usage: %s <app.elf> [<log.bin>]\n" % argv[0])
+        return 1
+    elf = ElfImage(argv[1])
+    if len(argv) > 2:
+        with open(argv[2], "rb") as f:
+            stream = f.read()
+    else:
+        stream = sys.stdin.buffer.read()
+
+    pos = 0
+    while pos + HEADER_SIZE <= len(stream):
+        header, addr, ticks = struct.unpack_from("<III", stream, pos)
+        if (header & ~0xff) != MAGIC:
+            sys.stderr.write("broken record at offset %d\n" % pos)
+            return 1
+        nargs = header & 0xff
+        if pos + HEADER_SIZE + nargs * 4 > len(stream):
+            break
+        words = struct.unpack_from("<%dI" % nargs, stream, pos + HEADER_SIZE)
+        pos += HEADER_SIZE + nargs * 4
+        fmt = elf.string(addr)
+        if fmt is None:
+            sys.stderr.write("unknown format address 0x%08x (record skipped)\n" % addr)
+            continue
+        if count_words(fmt) != nargs:
+            sys.stderr.write("argument count mismatch for \"%s\" (%d words)\n" % (fmt.rstrip("\n"), nargs))
+            continue
+        sys.stdout.write("[%10u] %s" % (ticks, format_record(elf, fmt, words)))
+        if not fmt.endswith("\n"):
+            sys.stdout.write("\n")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,219 @@
+/*
+ * Test of shared memory FIFO with two threads (runs on Linux host)
+ *
+ * One thread acts as the writer core and another as the reader core.
+ * Both register their own device on the same memory region.
+ * The writer sends 8-byte records (sequence number and its complement)
+ * and the reader checks them. The reader core restarts (re-initializes
+ * the ring) several times while the writer keeps writing; records must
+ * never be torn or stale, and sequence numbers must keep increasing.
+ * Then the reader core (emulated by interval timer signal, so that it runs
+ * at any point of the writer) restarts many times while the writer is
+ * waiting in a write larger than the ring; writes must never exceed the
+ * capacity nor the shared region (guarded by words placed after it).
+ * Registering the writer with a different size must fail.
+ *
+ * Build (in this directory):
+ *   gcc -O2 -D__tinythreads__ -Ihal -I../HAL/inc \
+ *       named_fifo_shm_test.c ../HAL/src/named_fifo_shm.c \
+ *       -lpthread -o named_fifo_shm_test
+ *
+ * Usage:
+ *   named_fifo_shm_test
+ *     Exit status is zero if passed.
+ */
+#include "named_fifo.h"
+#include "named_fifo_shm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#define TEST_SIZE       (sizeof(named_fifo_shm_ring) + 1024)
+#define TEST_RECORDS    (1000000)
+#define TEST_RESTARTS   (1000)
+#define TEST_LARGE_RESTARTS (20000)
+#define TEST_LARGE_USEC (20)
+#define TEST_LARGE_LEN  (4 * 1024)
+#define TEST_GUARD      (0xdeadbeef)
+
+static alt_u32 shm[TEST_SIZE / sizeof(alt_u32)];
+static struct {
+	alt_u32 shm[TEST_SIZE / sizeof(alt_u32)];
+	alt_u32 guard[TEST_LARGE_LEN / sizeof(alt_u32)];
+} large;
+static named_fifo_shm_dev reader_dev;
+static named_fifo_shm_dev writer_dev;
+static volatile int writer_done;
+static volatile int large_done;
+static volatile int large_signals;
+static volatile int large_restarts;
+
+int alt_dev_reg(alt_dev *dev)
+{
+	return 0;
+}
+
+/*
+ * Writer core
+ */
+static void *writer(void *param)
+{
+	alt_fd fd = { &writer_dev.dev, NULL, O_WRONLY };
+	alt_u32 record[2];
+	alt_u32 seq;
+	unsigned int seed = 2;
+	int result;
+
+	for (seq = 1; seq <= TEST_RECORDS; ++seq) {
+		record[0] = seq;
+		record[1] = ~seq;
+		// Records are never split because capacity is a multiple of 8
+		result = (*writer_dev.dev.write)(&fd, (const char *)record, sizeof(record));
+		if (result != sizeof(record)) {
+			printf("write returned %d\n", result);
+			break;
+		}
+		if ((rand_r(&seed) % 64) == 0) {
+			// Let reader catch up, so that it restarts while ring is not full
+			sched_yield();
+		}
+	}
+	writer_done = 1;
+	return NULL;
+}
+
+/*
+ * Reader core for restarts during large writes
+ * Called by interval timer at any point of the writer (emulates a reader
+ * running on the other core). Reads and restarts alternately.
+ */
+static void large_reader(int signum)
+{
+	alt_fd fd = { &reader_dev.dev, NULL, O_RDONLY | O_NONBLOCK };
+	char buffer[256];
+
+	if (!large_done && (large_signals++ & 1)) {
+		named_fifo_shm_register(&reader_dev, "/dev/shm_r", large.shm, sizeof(large.shm), NAMED_FIFO_SHM_READER);
+		if (++large_restarts >= TEST_LARGE_RESTARTS) {
+			large_done = 1;
+		}
+	} else {
+		(*reader_dev.dev.read)(&fd, buffer, sizeof(buffer));
+	}
+}
+
+/*
+ * Restart reader core while writer waits for space in a large write
+ */
+static int test_large_write(void)
+{
+	alt_fd fd = { &writer_dev.dev, NULL, O_WRONLY };
+	static char buffer[TEST_LARGE_LEN];
+	struct itimerval timer = { { 0, TEST_LARGE_USEC }, { 0, TEST_LARGE_USEC } };
+	struct itimerval stop = { { 0, 0 }, { 0, 0 } };
+	int result;
+	int index;
+	int errors = 0;
+
+	for (index = 0; index < TEST_LARGE_LEN / sizeof(alt_u32); ++index) {
+		large.guard[index] = TEST_GUARD;
+	}
+	if ((named_fifo_shm_register(&reader_dev, "/dev/shm_r", large.shm, sizeof(large.shm), NAMED_FIFO_SHM_READER) != 0) ||
+		(named_fifo_shm_register(&writer_dev, "/dev/shm_w", large.shm, sizeof(large.shm), NAMED_FIFO_SHM_WRITER) != 0)) {
+		puts("registration failed");
+		return 1;
+	}
+
+	signal(SIGALRM, large_reader);
+	setitimer(ITIMER_REAL, &timer, NULL);
+	while (!large_done) {
+		result = (*writer_dev.dev.write)(&fd, buffer, sizeof(buffer));
+		if ((result <= 0) || (result > (int)writer_dev.capacity)) {
+			if (errors++ < 10) {
+				printf("large write returned %d\n", result);
+			}
+		}
+	}
+	setitimer(ITIMER_REAL, &stop, NULL);
+
+	for (index = 0; index < TEST_LARGE_LEN / sizeof(alt_u32); ++index) {
+		if (large.guard[index] != TEST_GUARD) {
+			printf("region overrun at offset %d after ring\n", index * 4);
+			++errors;
+			break;
+		}
+	}
+	printf("large writes: %d restarts, %d errors\n", large_restarts, errors);
+	return errors;
+}
+
+int main(void)
+{
+	alt_fd fd = { &reader_dev.dev, NULL, O_RDONLY | O_NONBLOCK };
+	named_fifo_shm_dev other_dev;
+	pthread_t thread;
+	alt_u32 record[64];
+	alt_u32 last = 0;
+	long received = 0;
+	int restarts = 0;
+	int errors = 0;
+	int result;
+	unsigned int seed = 1;
+
+	if ((named_fifo_shm_register(&writer_dev, "/dev/shm_w", shm, sizeof(shm), NAMED_FIFO_SHM_WRITER) != 0) ||
+		(named_fifo_shm_register(&reader_dev, "/dev/shm_r", shm, sizeof(shm), NAMED_FIFO_SHM_READER) != 0)) {
+		puts("registration failed");
+		return 1;
+	}
+	result = named_fifo_shm_register(&other_dev, "/dev/shm_x", shm, sizeof(shm) * 2, NAMED_FIFO_SHM_WRITER);
+	if (result != -EINVAL) {
+		printf("registration with different size returned %d\n", result);
+		++errors;
+	}
+
+	pthread_create(&thread, NULL, writer, NULL);
+	for (;;) {
+		int index;
+		result = (*reader_dev.dev.read)(&fd, (char *)record, sizeof(record));
+		if (result == -EWOULDBLOCK) {
+			if (writer_done) {
+				break;
+			}
+			sched_yield();
+			continue;
+		}
+		if ((result <= 0) || (result % 8)) {
+			printf("read returned %d\n", result);
+			++errors;
+			break;
+		}
+		for (index = 0; index < result / 4; index += 2) {
+			if ((record[index] != ~record[index + 1]) || (record[index] <= last)) {
+				if (errors++ < 10) {
+					printf("bad record (%u, 0x%08x) after %u\n", record[index], record[index + 1], last);
+				}
+			}
+			last = record[index];
+			++received;
+		}
+		if ((restarts < TEST_RESTARTS) && ((rand_r(&seed) % 256) == 0)) {
+			// Restart reader core
+			named_fifo_shm_register(&reader_dev, "/dev/shm_r", shm, sizeof(shm), NAMED_FIFO_SHM_READER);
+			++restarts;
+		}
+	}
+	pthread_join(thread, NULL);
+
+	printf("received %ld records (last %u), %d restarts, %d errors\n", received, last, restarts, errors);
+	if ((last != TEST_RECORDS) || (restarts == 0)) {
+		++errors;
+	}
+	errors += test_large_write();
+	puts(errors ? "FAILED" : "passed");
+	return errors ? 1 : 0;
+}
@@ -8,6 +8,7 @@
 #include "sys/alt_irq.h"
 #include "peridot_client_fs.h"
 #include "peridot_rpc_server.h"
+#include "peridot_sw_hostbridge_gen2.h"
 #include "bson.h"
 #include "system.h"
 
@@ -183,6 +184,7 @@ static void *peridot_client_fs_open(const void *params)
 	context = alt_irq_disable_all();
 	if (vfd_list[vfd] == VFD_ALLOC) {
 		vfd_list[vfd] = fd;
+		HOSTBRIDGE_TELEMETRY_ADD(fs_open_fds, 1);
 	} else {
 		vfd_list[vfd] = VFD_FREE;
 		vfd = -1;
@@ -258,6 +260,7 @@ static void *peridot_client_fs_close(const void *params)
 	}
 
 	peridot_client_fs_free_vfd(vfd);
+	HOSTBRIDGE_TELEMETRY_ADD(fs_open_fds, -1);
 	errno = 0;
 	return NULL;
 }
@@ -322,6 +325,7 @@ static void *peridot_client_fs_read(const void *params)
 		return NULL;
 	}
 	bson_shrink_binary(result, buf, read_len);
+	HOSTBRIDGE_TELEMETRY_ADD(fs_read_bytes, read_len);
 
 	bson_set_int32(result, "length", read_len);
 	return result;
@@ -480,6 +484,7 @@ static void *peridot_client_fs_write(const void *params)
 		return NULL;
 	}
 
+	HOSTBRIDGE_TELEMETRY_ADD(fs_write_bytes, written_len);
 	bson_create_empty_document(result);
 	bson_set_int32(result, "length", written_len);
 	return result;
@@ -721,6 +726,7 @@ static void *peridot_client_fs_cleanup(const void *params)
 		if (fd >= 0) {
 			vfd_list[vfd] = VFD_FREE;
 			close(fd);
+			HOSTBRIDGE_TELEMETRY_ADD(fs_open_fds, -1);
 		}
 	}
 	ALT_SEM_POST(sem_lock);
@@ -6,6 +6,10 @@
 #include <malloc.h>
 #include <stdlib.h>
 #include "sys/alt_cache.h"
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_STATISTICS
+# include <stdio.h>
+# include "sys/alt_alarm.h"
+#endif
 #include "peridot_rpc_server.h"
 #include "peridot_sw_hostbridge_gen2.h"
 #if (PERIDOT_RPCSRV_WORKER_THREADS > 0) && !defined(PERIDOT_RPCSRV_MULTI_THREADED)
@@ -37,6 +41,8 @@ struct peridot_rpc_server_state_s {
         alt_32 value;
     } length;
     rpcsrv_job *incoming_job;
+    rpcsrv_job *lent_job;       // Job whose buffer is given to hostbridge for current read
+    rpcsrv_job *retired_job;    // Job discarded while its buffer was lent (freed later)
     rpcsrv_job *volatile pending_job;
 #ifdef PERIDOT_RPCSRV_MULTI_THREADED
     sem_t sem;
@@ -51,6 +57,7 @@ static struct peridot_rpc_server_state_s state
 __attribute__((alias("peridot_rpc_server_state")));
 
 static int send_reply(rpcsrv_job *job, int off_id, void *result, int result_errno);
+static int register_method(const char *name, peridot_rpc_server_sync_function sync, peridot_rpc_server_async_function async);
 
 /*
  * Find method entry
@@ -68,6 +75,60 @@ static peridot_rpc_server_method_entry *peridot_rpc_server_find_method(const cha
     return NULL;
 }
 
+/**
+ * @func job_contains
+ * @brief Check if pointer is inside data of job
+ */
+static int job_contains(rpcsrv_job *job, const void *ptr)
+{
+    const alt_u8 *p = (const alt_u8 *)ptr;
+
+    return (p >= job->data.bytes) && (p < job->data.bytes + job->data.words[0]);
+}
+
+/**
+ * @func discard_incoming_job
+ * @brief Free incoming job
+ * @note If its buffer is lent to hostbridge, the rest of received data
+ *       may still be read from it, so freeing is deferred until
+ *       the next read.
+ */
+static void discard_incoming_job(void)
+{
+    if (state.incoming_job && (state.incoming_job == state.lent_job)) {
+        state.lent_job = NULL;
+        free(state.retired_job);
+        state.retired_job = state.incoming_job;
+    } else {
+        free(state.incoming_job);
+    }
+    state.incoming_job = NULL;
+}
+
+/**
+ * @func peridot_rpc_server_get_rx_buffer
+ * @brief Let request data be received directly into job buffer
+ * @note Escaped data is shorter than raw bytes, so decoding in place
+ *       never overtakes the raw bytes not decoded yet.
+ *       At most remaining length of packet is lent, so the packet cannot
+ *       complete inside the buffer (its last byte follows EOP prefix).
+ */
+static void *peridot_rpc_server_get_rx_buffer(hostbridge_channel *channel, int *len)
+{
+    // Previous read has been decoded completely
+    free(state.retired_job);
+    state.retired_job = NULL;
+    state.lent_job = NULL;
+
+    if (!state.incoming_job || (state.offset < 4) || state.pending_job ||
+        (state.offset >= (size_t)state.length.value)) {
+        return NULL;
+    }
+    *len = state.length.value - state.offset;
+    state.lent_job = state.incoming_job;
+    return state.incoming_job->data.bytes + state.offset;
+}
+
 /**
  * @func peridot_rpc_server_sink
  * @brief Stream sink function for RPC server
@@ -77,11 +138,49 @@ static int peridot_rpc_server_sink(hostbridge_channel *channel, const void *ptr,
     const alt_u8 *src = (const alt_u8 *)ptr;
     int read_len = 0;
 
+    // Data outside lent buffer means that the decoder has finished with it
+    if (state.lent_job && !job_contains(state.lent_job, ptr)) {
+        state.lent_job = NULL;
+    }
+    if (state.retired_job && !job_contains(state.retired_job, ptr)) {
+        free(state.retired_job);
+        state.retired_job = NULL;
+    }
+
     while ((read_len < len) && (!state.pending_job)) {
-        alt_u8 byte = *src++;
+        alt_u8 byte;
+
+        if (state.incoming_job && (state.offset >= 4) && !state.escape_prefix && !state.eop_prefix) {
+            // Bulk copy of bytes without special meaning (no copy if received in place)
+            alt_u8 *dest = state.incoming_job->data.bytes + state.offset;
+            int max = len - read_len;
+            int run = 0;
+            if ((size_t)max > state.length.value - state.offset) {
+                max = state.length.value - state.offset;
+            }
+            while ((run < max) && !AST_NEEDS_ESCAPE(src[run])) {
+                ++run;
+            }
+            if (dest != src) {
+                memmove(dest, src, run);
+            }
+            src += run;
+            read_len += run;
+            state.offset += run;
+            if (read_len == len) {
+                break;
+            }
+        }
+
+        byte = *src++;
         ++read_len;
         switch (byte) {
         case AST_SOP:
+            if (state.incoming_job) {
+                // Previous packet is incomplete => Discard
+                HOSTBRIDGE_GEN2_STATS_ADD(channel, rx_dropped, state.offset);
+                discard_incoming_job();
+            }
             state.offset = 0;
             state.inside_packet = 1;
             state.eop_prefix = 0;
@@ -116,7 +215,8 @@ static int peridot_rpc_server_sink(hostbridge_channel *channel, const void *ptr,
         } else if (state.offset >= state.length.value) {
             // Packet data too large
 drop_packet:
-            free(state.incoming_job);
+            HOSTBRIDGE_GEN2_STATS_ADD(channel, rx_dropped, state.offset);
+            discard_incoming_job();
 next_packet:
             state.incoming_job = NULL;
             state.offset = 0;
@@ -125,6 +225,9 @@ next_packet:
             continue;
         } else if (state.incoming_job) {
             state.incoming_job->data.bytes[state.offset++] = byte;
+        } else {
+            // Oversized (or out of memory) request => Discard
+            HOSTBRIDGE_GEN2_STATS_ADD(channel, rx_dropped, 1);
         }
         if (!state.eop_prefix) {
             continue;
@@ -135,6 +238,8 @@ next_packet:
         }
         state.pending_job = state.incoming_job;
         state.incoming_job = NULL;
+        HOSTBRIDGE_TELEMETRY_SET(rpc_pending, 1);
+        HOSTBRIDGE_GEN2_STATS_ADD(channel, rx_packets, 1);
 #ifdef PERIDOT_RPCSRV_MULTI_THREADED
         sem_post(&state.sem);
 #endif
@@ -144,6 +249,198 @@ next_packet:
     return read_len;
 }
 
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_STATISTICS
+/*
+ * Make statistics document of channel
+ */
+static int make_channel_stats(alt_u8 number, void *doc)
+{
+    hostbridge_channel_stats stats;
+
+    if (peridot_sw_hostbridge_gen2_get_channel_stats(number, &stats) != 0) {
+        return -ENOENT;
+    }
+    bson_create_empty_document(doc);
+    bson_set_int32(doc, "rx_bytes", stats.rx_bytes);
+    bson_set_int32(doc, "rx_packets", stats.rx_packets);
+    bson_set_int32(doc, "rx_dropped", stats.rx_dropped);
+    bson_set_int32(doc, "tx_bytes", stats.tx_bytes);
+    bson_set_int32(doc, "tx_packets", stats.tx_packets);
+    bson_set_int32(doc, "tx_encoded", stats.tx_encoded);
+    return 0;
+}
+
+/*
+ * RPC method: hostbridge.stats
+ * Returns link counters and counters of each registered channel (keyed by channel number)
+ */
+static void *peridot_rpc_server_method_hostbridge_stats(const void *params)
+{
+    alt_u8 entry[128];
+    char key[4];
+    hostbridge_link_stats link;
+    void *channels;
+    void *result;
+    int len;
+    int number;
+
+    (void)params;
+    len = 0;
+    for (number = 0; number < 256; ++number) {
+        if (make_channel_stats(number, entry) == 0) {
+            snprintf(key, sizeof(key), "%d", number);
+            len += bson_measure_subdocument(key, entry);
+        }
+    }
+    channels = bson_alloc(len);
+    if (!channels) {
+        goto nomem;
+    }
+    for (number = 0; number < 256; ++number) {
+        if (make_channel_stats(number, entry) == 0) {
+            snprintf(key, sizeof(key), "%d", number);
+            bson_set_subdocument(channels, key, entry);
+        }
+    }
+
+    peridot_sw_hostbridge_gen2_get_link_stats(&link);
+    result = bson_alloc(
+        bson_measure_int32("rx_bytes") +
+        bson_measure_int32("rx_unrouted") +
+        bson_measure_int32("tx_bytes") +
+        bson_measure_int32("tx_blocked_ms") +
+        bson_measure_subdocument("channels", channels)
+    );
+    if (!result) {
+        bson_free(channels);
+        goto nomem;
+    }
+    bson_set_int32(result, "rx_bytes", link.rx_bytes);
+    bson_set_int32(result, "rx_unrouted", link.rx_unrouted);
+    bson_set_int32(result, "tx_bytes", link.tx_bytes);
+    bson_set_int32(result, "tx_blocked_ms",
+        (alt_u64)link.tx_blocked_ticks * 1000 / alt_ticks_per_second());
+    bson_set_subdocument(result, "channels", channels);
+    bson_free(channels);
+    return result;
+
+nomem:
+    errno = JSONRPC_ERR_INTERNAL_ERROR;
+    return NULL;
+}
+#endif  /* PERIDOT_SW_HOSTBRIDGE_GEN2_STATISTICS */
+
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_COMPRESSION
+/*
+ * RPC method: hostbridge.compress
+ * Enables (or disables with "enable": false) compression of channel.
+ * Returns compression method and maximum length of compressed packet.
+ * For RPC channel itself, compression is switched after this reply
+ * (by peridot_rpc_server_service() which sends it).
+ */
+static void *peridot_rpc_server_method_hostbridge_compress(const void *params)
+{
+    int off_channel, off_enable;
+    int number, enable;
+    void *result;
+
+    if (!params) {
+        goto invalid;
+    }
+    bson_get_props(params, "channel", &off_channel, "enable", &off_enable, NULL);
+    number = bson_get_int32(params, off_channel, -1);
+    enable = bson_get_boolean(params, off_enable, 1);
+    if ((number < 0) || (number > 255)) {
+        goto invalid;
+    }
+    if (number != state.channel.number) {
+        int error = peridot_sw_hostbridge_gen2_set_compression(number, enable);
+        if (error < 0) {
+            errno = -error;
+            return NULL;
+        }
+    }
+
+    result = bson_alloc(
+        bson_measure_boolean("enabled") +
+        bson_measure_string("method", "lzf") +
+        bson_measure_int32("max_packet")
+    );
+    if (!result) {
+        errno = JSONRPC_ERR_INTERNAL_ERROR;
+        return NULL;
+    }
+    bson_set_boolean(result, "enabled", enable);
+    bson_set_string(result, "method", "lzf");
+    bson_set_int32(result, "max_packet", PERIDOT_SW_HOSTBRIDGE_GEN2_COMPRESS_MAX_PACKET);
+    return result;
+
+invalid:
+    errno = JSONRPC_ERR_INVALID_PARAMS;
+    return NULL;
+}
+
+/*
+ * Get switch of RPC channel compression requested by hostbridge.compress
+ * (0:none, 1:disable, 2:enable)
+ */
+static int get_compress_request(const void *params)
+{
+    int off_channel, off_enable;
+
+    bson_get_props(params, "channel", &off_channel, "enable", &off_enable, NULL);
+    if (bson_get_int32(params, off_channel, -1) != state.channel.number) {
+        return 0;
+    }
+    return bson_get_boolean(params, off_enable, 1) ? 2 : 1;
+}
+#endif  /* PERIDOT_SW_HOSTBRIDGE_GEN2_COMPRESSION */
+
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_BLOCK_FRAMING
+/*
+ * RPC method: hostbridge.framing
+ * Enables (or disables with "enable": false) block framing of channel.
+ * Returns maximum length of a block.
+ */
+static void *peridot_rpc_server_method_hostbridge_framing(const void *params)
+{
+    int off_channel, off_enable;
+    int number, enable, error;
+    void *result;
+
+    if (!params) {
+        goto invalid;
+    }
+    bson_get_props(params, "channel", &off_channel, "enable", &off_enable, NULL);
+    number = bson_get_int32(params, off_channel, -1);
+    enable = bson_get_boolean(params, off_enable, 1);
+    if ((number < 0) || (number > 255)) {
+        goto invalid;
+    }
+    error = peridot_sw_hostbridge_gen2_set_block_framing(number, enable);
+    if (error < 0) {
+        errno = -error;
+        return NULL;
+    }
+
+    result = bson_alloc(
+        bson_measure_boolean("enabled") +
+        bson_measure_int32("max_block")
+    );
+    if (!result) {
+        errno = JSONRPC_ERR_INTERNAL_ERROR;
+        return NULL;
+    }
+    bson_set_boolean(result, "enabled", enable);
+    bson_set_int32(result, "max_block", HOSTBRIDGE_GEN2_BLOCK_MAX_LEN);
+    return result;
+
+invalid:
+    errno = JSONRPC_ERR_INVALID_PARAMS;
+    return NULL;
+}
+#endif  /* PERIDOT_SW_HOSTBRIDGE_GEN2_BLOCK_FRAMING */
+
 #if (PERIDOT_RPCSRV_WORKER_THREADS > 0)
 /*
  * Worker for server operations
@@ -170,10 +467,27 @@ int peridot_rpc_server_init(void)
 
     // Register packetized stream channel
     state.channel.dest.sink = peridot_rpc_server_sink;
+    state.channel.get_rx_buffer = peridot_rpc_server_get_rx_buffer;
     state.channel.number = PERIDOT_RPCSRV_CHANNEL;
     state.channel.packetized = 1;
     state.channel.use_fd = 0;
+    state.channel.priority = HOSTBRIDGE_GEN2_PRIORITY_HIGH;
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_COMPRESSION
+    state.channel.compressible = 1;
+#endif
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_RELIABLE
+    state.channel.recoverable = 1;
+#endif
     peridot_sw_hostbridge_gen2_register_channel(&state.channel);
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_STATISTICS
+    register_method("hostbridge.stats", peridot_rpc_server_method_hostbridge_stats, NULL);
+#endif
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_COMPRESSION
+    register_method("hostbridge.compress", peridot_rpc_server_method_hostbridge_compress, NULL);
+#endif
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_BLOCK_FRAMING
+    register_method("hostbridge.framing", peridot_rpc_server_method_hostbridge_framing, NULL);
+#endif
 
 #ifdef PERIDOT_RPCSRV_MULTI_THREADED
     sem_init(&state.sem, 0, 0);
@@ -249,6 +563,7 @@ static int async_reply(peridot_rpc_server_async_context *context, void *result_o
     // For notify call
     free(result_or_error);
     free(job);
+    HOSTBRIDGE_TELEMETRY_ADD(rpc_running, -1);
     return 0;
 }
 
@@ -281,6 +596,10 @@ int peridot_rpc_server_service(void)
     const char *method;
     peridot_rpc_server_method_entry *entry;
     void *result;
+    int ret;
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_COMPRESSION
+    int compress_request = 0;
+#endif
 
 #ifdef PERIDOT_RPCSRV_MULTI_THREADED
     sem_wait(&state.sem);
@@ -291,6 +610,9 @@ int peridot_rpc_server_service(void)
         // No job
         return 0;
     }
+    HOSTBRIDGE_TELEMETRY_SET(rpc_pending, 0);
+    HOSTBRIDGE_TELEMETRY_ADD(rpc_requests, 1);
+    HOSTBRIDGE_TELEMETRY_ADD(rpc_running, 1);
 
     // TODO: support batch request
 
@@ -320,6 +642,12 @@ int peridot_rpc_server_service(void)
             // Synchronous call
             errno = 0;
             result = (*entry->sync)(params);
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_COMPRESSION
+            if (result && (entry->sync == peridot_rpc_server_method_hostbridge_compress)) {
+                // Switched after reply (other workers may send replies meanwhile)
+                compress_request = get_compress_request(params);
+            }
+#endif
         } else {
             // Asynchronous call
             job->context.params = params;
@@ -338,11 +666,20 @@ int peridot_rpc_server_service(void)
         // Notification => Do not reply (even if error occurs)
         free(result);
         free(job);
-        return 0;
+        HOSTBRIDGE_TELEMETRY_ADD(rpc_running, -1);
+        ret = 0;
+        goto done;
     }
 
 reply:
-    return send_reply(job, off_id, result, result ? 0 : errno);
+    ret = send_reply(job, off_id, result, result ? 0 : errno);
+done:
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_COMPRESSION
+    if (compress_request) {
+        peridot_sw_hostbridge_gen2_set_compression(state.channel.number, compress_request - 1);
+    }
+#endif
+    return ret;
 }
 
 /**
@@ -351,64 +688,97 @@ reply:
  */
 static int send_reply(rpcsrv_job *job, int off_id, void *result_or_error, int result_errno)
 {
+    static const char result_header[] = "\x03" "result";
+    static const char error_header[] = "\x03" "error";
+    static const alt_u8 terminator = 0x00;
     alt_u8 error_doc_buffer[16];
-    void *error_doc = error_doc_buffer;
-    void *output;
-    int reply_len;
+    void *sub_doc = NULL;
+    const char *sub_header = NULL;
+    int sub_header_len = 0;
+    void *envelope;
+    int envelope_len;
+    hostbridge_iovec iov[4];
+    int iovcnt;
+    alt_u32 reply_len;
     void *input = &job->data;
 
-reply:
-    reply_len = bson_empty_size;
-    reply_len += bson_measure_string("jsonrpc", PERIDOT_RPCSRV_JSONRPC_VER);
-    reply_len += bson_measure_element("id", input, off_id);
+    HOSTBRIDGE_TELEMETRY_ADD(rpc_running, -1);
     if (result_errno == 0) {
         // Success
         if (result_or_error) {
-            reply_len += bson_measure_subdocument("result", result_or_error);
-        } else {
-            reply_len += bson_measure_null("result");
+            sub_doc = result_or_error;
+            sub_header = result_header;
+            sub_header_len = sizeof(result_header);
         }
     } else {
         // Fail
+        HOSTBRIDGE_TELEMETRY_ADD(rpc_errors, 1);
         if (result_or_error) {
-            error_doc = result_or_error;
+            sub_doc = result_or_error;
         } else {
             bson_create_empty_document(error_doc_buffer);
             bson_set_int32(error_doc_buffer, "code", result_errno);
+            sub_doc = error_doc_buffer;
         }
-        reply_len += bson_measure_subdocument("error", error_doc);
-    }
-    output = malloc(reply_len);
-    if (!output) {
-        if (result_errno != 0) {
-            // FIXME: Double error => Ignore this packet
-            free(result_or_error);
-            free(job);
-            return 0;
-        }
-        result_errno = JSONRPC_ERR_INTERNAL_ERROR;
+        sub_header = error_header;
+        sub_header_len = sizeof(error_header);
+    }
+
+    // Envelope ("jsonrpc" and "id") is built separately so that
+    // the result document can be sent without copying
+    envelope_len = bson_empty_size;
+    envelope_len += bson_measure_string("jsonrpc", PERIDOT_RPCSRV_JSONRPC_VER);
+    envelope_len += bson_measure_element("id", input, off_id);
+    if (!sub_doc) {
+        envelope_len += bson_measure_null("result");
+    }
+    envelope = malloc(envelope_len);
+    if (!envelope) {
+        // FIXME: No memory even for envelope => Ignore this packet
         free(result_or_error);
-        result_or_error = NULL;
-        goto reply;
+        free(job);
+        return 0;
     }
 
-    bson_create_empty_document(output);
-    bson_set_string(output, "jsonrpc", PERIDOT_RPCSRV_JSONRPC_VER);
-    bson_set_element(output, "id", input, off_id);
+    bson_create_empty_document(envelope);
+    bson_set_string(envelope, "jsonrpc", PERIDOT_RPCSRV_JSONRPC_VER);
+    bson_set_element(envelope, "id", input, off_id);
     free(job);
 
-    if (result_errno == 0) {
-        if (result_or_error) {
-            bson_set_subdocument(output, "result", result_or_error);
-            free(result_or_error);
+    for (;;) {
+        if (sub_doc) {
+            // Envelope without its terminator, then "result"/"error" element, then terminator
+            reply_len = (envelope_len - 1) + sub_header_len + bson_measure_document(sub_doc) + 1;
+            memcpy(envelope, &reply_len, sizeof(reply_len));
+            iov[0].base = envelope;
+            iov[0].len = envelope_len - 1;
+            iov[1].base = sub_header;
+            iov[1].len = sub_header_len;
+            iov[2].base = sub_doc;
+            iov[2].len = bson_measure_document(sub_doc);
+            iov[3].base = &terminator;
+            iov[3].len = 1;
+            iovcnt = 4;
         } else {
-            bson_set_null(output, "result");
+            bson_set_null(envelope, "result");
+            iov[0].base = envelope;
+            iov[0].len = envelope_len;
+            iovcnt = 1;
         }
-    } else {
-        bson_set_subdocument(output, "error", error_doc);
-        free(result_or_error);
+        if ((peridot_sw_hostbridge_gen2_sourcev(&state.channel, iov, iovcnt, HOSTBRIDGE_GEN2_SOURCE_PACKETIZED) >= 0) ||
+            !sub_doc || (sub_doc == error_doc_buffer)) {
+            break;
+        }
+        // Reply cannot be sent (e.g. too large or no memory for framing)
+        // => Send error instead so that host does not wait for it forever
+        HOSTBRIDGE_TELEMETRY_ADD(rpc_errors, 1);
+        bson_create_empty_document(error_doc_buffer);
+        bson_set_int32(error_doc_buffer, "code", JSONRPC_ERR_INTERNAL_ERROR);
+        sub_doc = error_doc_buffer;
+        sub_header = error_header;
+        sub_header_len = sizeof(error_header);
     }
-    peridot_sw_hostbridge_gen2_source(&state.channel, output, reply_len, HOSTBRIDGE_GEN2_SOURCE_PACKETIZED);
-    free(output);
+    free(envelope);
+    free(result_or_error);
     return 0;
 }
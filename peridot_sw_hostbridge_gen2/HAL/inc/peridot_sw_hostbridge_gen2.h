@@ -19,29 +19,320 @@ enum {
 
 #define AST_NEEDS_ESCAPE(x) ((AST_SOP <= (x)) && ((x) <= AST_ESCAPE_PREFIX))
 
+/* Non-zero if any byte in 32-bit word needs escape (SWAR range test) */
+#define AST_WORD_ONES       ((alt_u32)0x01010101)
+#define AST_WORD_NEEDS_ESCAPE(w) \
+    (((AST_WORD_ONES * (127 + AST_ESCAPE_PREFIX + 1) - ((w) & AST_WORD_ONES * 127)) & \
+      ~(w) & (((w) & AST_WORD_ONES * 127) + AST_WORD_ONES * (127 - (AST_SOP - 1)))) & \
+     (AST_WORD_ONES * 128))
+
+enum {
+    HOSTBRIDGE_GEN2_PRIORITY_NORMAL     = 0,
+    HOSTBRIDGE_GEN2_PRIORITY_HIGH       = 1,
+    HOSTBRIDGE_GEN2_PRIORITY_URGENT     = 2,
+};
+
 enum {
     HOSTBRIDGE_GEN2_SOURCE_PACKETIZED   = (1 << 0),
     HOSTBRIDGE_GEN2_SOURCE_RESET        = (1 << 1),
+    HOSTBRIDGE_GEN2_SOURCE_NONBLOCK     = (1 << 2),
 };
 
+#ifndef PERIDOT_SW_HOSTBRIDGE_GEN2_CREDIT_CHANNEL
+# define PERIDOT_SW_HOSTBRIDGE_GEN2_CREDIT_CHANNEL  2
+#endif
+
+/*
+ * Messages on credit channel (device to host, packetized):
+ *   [type] [pipe channel] [credit (32-bit, little endian)]
+ * GRANT adds credit, SYNC replaces it. Host may request SYNC by sending
+ * a packet of pipe channel numbers on credit channel.
+ */
+enum {
+    HOSTBRIDGE_GEN2_CREDIT_GRANT    = 0,
+    HOSTBRIDGE_GEN2_CREDIT_SYNC     = 1,
+};
+
+/*
+ * Packets on channel with compression enabled (both directions):
+ *   [method] [payload]
+ * STORED carries payload as it is, LZF carries payload compressed in LZF format.
+ * Host enables compression with "hostbridge.compress" RPC method.
+ */
+enum {
+    HOSTBRIDGE_GEN2_COMPRESS_STORED = 0,
+    HOSTBRIDGE_GEN2_COMPRESS_LZF    = 1,
+};
+
+#ifndef PERIDOT_SW_HOSTBRIDGE_GEN2_COMPRESS_MAX_PACKET
+# define PERIDOT_SW_HOSTBRIDGE_GEN2_COMPRESS_MAX_PACKET 1024
+#endif
+
+#ifndef PERIDOT_SW_HOSTBRIDGE_GEN2_COALESCE_SIZE
+# define PERIDOT_SW_HOSTBRIDGE_GEN2_COALESCE_SIZE   0
+#endif
+
+#ifndef PERIDOT_SW_HOSTBRIDGE_GEN2_RELIABLE_CHANNEL
+# define PERIDOT_SW_HOSTBRIDGE_GEN2_RELIABLE_CHANNEL    3
+#endif
+#ifndef PERIDOT_SW_HOSTBRIDGE_GEN2_RELIABLE_HISTORY
+# define PERIDOT_SW_HOSTBRIDGE_GEN2_RELIABLE_HISTORY    4
+#endif
+
+/*
+ * Packets on channel with reliable framing enabled (both directions):
+ *   [sequence number] [payload] [CRC-32 of sequence number and payload (32-bit, little endian)]
+ * Messages on reliable control channel (both directions, packetized):
+ *   [type] [channel] [sequence number] [check (bitwise NOT of XOR of first 3 bytes)]
+ * Host sends ENABLE or DISABLE, and device replies with the same message
+ * (DISABLE if channel is not recoverable) after resetting sequence numbers
+ * of both directions to 0. Receiver of a broken or out-of-order packet sends
+ * NAK with the sequence number it expects, and sender resends packets from it.
+ * Device replies LOST if they are no longer in history (host should re-enable).
+ * NAK is sent once for each missing packet, so host must also resend packets
+ * by timeout when no progress is seen.
+ */
+enum {
+    HOSTBRIDGE_GEN2_RELIABLE_ENABLE     = 0,
+    HOSTBRIDGE_GEN2_RELIABLE_DISABLE    = 1,
+    HOSTBRIDGE_GEN2_RELIABLE_NAK        = 2,
+    HOSTBRIDGE_GEN2_RELIABLE_LOST       = 3,
+};
+
+/*
+ * Data on non-packetized channel with block framing enabled (both directions):
+ *   [SOP] [length (16-bit, little endian, escaped)] [payload (length bytes, not escaped)]
+ * Payload is copied as it is, so special bytes cost nothing and only 3 to 5
+ * bytes are added for each block. SOP never appears on non-packetized channel
+ * otherwise, so receiver can accept both forms. Channel prefix is not allowed
+ * inside a block. Host enables block framing with "hostbridge.framing" RPC method.
+ */
+#define HOSTBRIDGE_GEN2_BLOCK_MAX_LEN   65535
+
+/*
+ * Traffic counters of channel (wrap around at 2^32)
+ */
+typedef struct hostbridge_channel_stats_s {
+    alt_u32 rx_bytes;       // Bytes routed to channel (raw packet bytes for packetized channel)
+    alt_u32 rx_packets;     // Packets accepted by sink of packetized channel
+    alt_u32 rx_dropped;     // Bytes discarded out of rx_bytes
+    alt_u32 tx_bytes;       // Payload bytes passed to source functions
+    alt_u32 tx_packets;     // Packets sent with HOSTBRIDGE_GEN2_SOURCE_PACKETIZED
+    alt_u32 tx_encoded;     // Bytes on wire for tx_bytes (including SOP/EOP and escapes)
+} hostbridge_channel_stats;
+
+/*
+ * Counters of whole link (total of all links, wrap around at 2^32)
+ */
+typedef struct hostbridge_link_stats_s {
+    alt_u32 rx_bytes;           // Bytes read from UART
+    alt_u32 rx_unrouted;        // Bytes for unregistered channels
+    alt_u32 tx_bytes;           // Bytes written to UART
+    alt_u32 tx_blocked_ticks;   // Time blocked by full UART (in alt_nticks)
+} hostbridge_link_stats;
+
 typedef struct hostbridge_channel_s {
-    struct hostbridge_channel_s *next;
     union {
         int fd;
         int (*sink)(struct hostbridge_channel_s *channel, const void *ptr, int len);
     } dest;
+    /*
+     * Optional for sink: Return buffer where data from host can be read into
+     * directly (zero-copy receive), and store its length to *len.
+     * Return NULL if no space is available.
+     * The sink is then called with ptr pointing into this buffer.
+     * Data for other channels may also be placed in the buffer temporarily,
+     * so the sink must move data with memmove() when ptr differs from
+     * its write position.
+     */
+    void *(*get_rx_buffer)(struct hostbridge_channel_s *channel, int *len);
     alt_u8 number;
     alt_u8 packetized;
     alt_u8 use_fd;
+    alt_u8 priority;    // Larger value goes out first (only with TX queue)
+    alt_u8 link;        // Index of link used to send data from this channel
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_STATISTICS
+    hostbridge_channel_stats stats;
+#endif
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_COMPRESSION
+    alt_u8 compressible;        // Host may enable compression (packetized channel only)
+    volatile alt_u8 compressed; // Compression is enabled by host
+    struct hostbridge_lz_rx_s *lz_rx;
+#endif
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_RELIABLE
+    alt_u8 recoverable;         // Sink discards incomplete packet at SOP (host may enable reliable framing)
+    volatile alt_u8 reliable;   // Reliable framing is enabled by host
+    struct hostbridge_rel_s *rel;
+#endif
+#if (PERIDOT_SW_HOSTBRIDGE_GEN2_COALESCE_SIZE > 0)
+    alt_u8 *coalesce_buffer;    // Small writes waiting to be sent in a burst (allocated on first use)
+    volatile alt_u16 coalesced; // Bytes in coalesce_buffer (kept until they are sent)
+    struct hostbridge_channel_s *coalesce_next;
+#endif
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_BLOCK_FRAMING
+    volatile alt_u8 block_framed;   // Block framing is enabled by host (non-packetized channel only)
+#endif
 } hostbridge_channel;
 
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_STATISTICS
+# define HOSTBRIDGE_GEN2_STATS_ADD(channel, member, value) \
+    do { (channel)->stats.member += (value); } while (0)
+#else
+# define HOSTBRIDGE_GEN2_STATS_ADD(channel, member, value) \
+    do { } while (0)
+#endif
+
+typedef struct hostbridge_iovec_s {
+    const void *base;
+    int len;
+} hostbridge_iovec;
+
+enum {
+    HOSTBRIDGE_AVM_READ     = (1 << 0),
+    HOSTBRIDGE_AVM_WRITE    = (1 << 1),
+};
+
+/*
+ * Memory window accessible from host over AVM channel
+ */
+typedef struct hostbridge_avm_window_s {
+    struct hostbridge_avm_window_s *next;
+    const char *name;
+    alt_u32 base;   // Address seen by host
+    alt_u32 span;   // Length in bytes
+    void *ptr;      // Local address of window
+    int flags;      // HOSTBRIDGE_AVM_READ and/or HOSTBRIDGE_AVM_WRITE
+} hostbridge_avm_window;
+
+/*
+ * Telemetry block readable from host over AVM channel
+ * (window "telemetry" at PERIDOT_SW_HOSTBRIDGE_GEN2_TELEMETRY_BASE)
+ * Each package updates its own members in place with HOSTBRIDGE_TELEMETRY_*.
+ * HOSTBRIDGE_TELEMETRY_ADD updates with IRQs disabled, so counters and gauges
+ * may be shared by several threads (and ISRs).
+ * ticks and heap_used are refreshed when host reads the block.
+ * Counters wrap around at 2^32.
+ */
+#define HOSTBRIDGE_TELEMETRY_MAGIC      0x4d544248  /* "HBTM" */
+#define HOSTBRIDGE_TELEMETRY_VERSION    1
+#define HOSTBRIDGE_TELEMETRY_WORKERS    4
+
+typedef struct hostbridge_telemetry_s {
+    alt_u32 magic;
+    alt_u16 version;
+    alt_u16 size;               // sizeof(hostbridge_telemetry)
+    alt_u32 ticks;              // alt_nticks()
+    alt_u32 heap_used;          // Bytes allocated by malloc
+    /* peridot_sw_hostbridge_gen2 */
+    alt_u32 hb_rx_bytes;        // Bytes read from UART (total of all links)
+    alt_u32 hb_rx_unrouted;     // Bytes for unregistered channels
+    alt_u32 hb_tx_bytes;        // Bytes written to UART (total of all links)
+    alt_u16 hb_tx_queued;       // Frames waiting in TX queues
+    alt_u16 hb_channels;        // Registered channels
+    /* peridot_rpc_server */
+    alt_u32 rpc_requests;       // Requests taken by server
+    alt_u32 rpc_errors;         // Error replies sent
+    alt_u16 rpc_pending;        // Requests received but not taken yet
+    alt_u16 rpc_running;        // Requests taken but not replied yet
+    /* peridot_client_fs */
+    alt_u16 fs_open_fds;
+    alt_u16 reserved;
+    alt_u32 fs_read_bytes;
+    alt_u32 fs_write_bytes;
+    /* rubic_agent */
+    alt_u8 agent_worker_state[HOSTBRIDGE_TELEMETRY_WORKERS];   // State of first workers
+} hostbridge_telemetry;
+
+#ifndef PERIDOT_SW_HOSTBRIDGE_GEN2_TELEMETRY_BASE
+# define PERIDOT_SW_HOSTBRIDGE_GEN2_TELEMETRY_BASE 0x10000100
+#endif
+
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_TELEMETRY
+# include "sys/alt_irq.h"
+extern volatile hostbridge_telemetry peridot_sw_hostbridge_gen2_telemetry;
+# define HOSTBRIDGE_TELEMETRY_ADD(member, value) \
+    do { \
+        alt_irq_context hostbridge_telemetry_context = alt_irq_disable_all(); \
+        peridot_sw_hostbridge_gen2_telemetry.member += (value); \
+        alt_irq_enable_all(hostbridge_telemetry_context); \
+    } while (0)
+# define HOSTBRIDGE_TELEMETRY_SET(member, value) \
+    do { peridot_sw_hostbridge_gen2_telemetry.member = (value); } while (0)
+#else
+# define HOSTBRIDGE_TELEMETRY_ADD(member, value)  do { } while (0)
+# define HOSTBRIDGE_TELEMETRY_SET(member, value)  do { } while (0)
+#endif
+
+/*
+ * Byte stream transport to host
+ * read/write return number of bytes transferred, zero if nothing can be
+ * transferred without blocking (in non-blocking mode), or negative errno.
+ */
+typedef struct hostbridge_transport_s {
+    int (*open)(struct hostbridge_transport_s *transport, int nonblock);
+    int (*read)(struct hostbridge_transport_s *transport, void *ptr, int len);
+    int (*write)(struct hostbridge_transport_s *transport, const void *ptr, int len);
+    int fd;
+    int nonblock;
+    const char *path;   // Device path (HAL UART transport only)
+    int notify_rx;      // Non-zero if driver calls peridot_sw_hostbridge_gen2_notify_rx()
+} hostbridge_transport;
+
+/*
+ * Transport wrapper which records byte stream (see peridot_sw_hostbridge_gen2_capture.c)
+ */
+enum {
+    HOSTBRIDGE_GEN2_CAPTURE_RX = 0,     // Received from host
+    HOSTBRIDGE_GEN2_CAPTURE_TX = 1,     // Sent to host
+};
+
+typedef struct hostbridge_capture_s {
+    hostbridge_transport transport;     // Must be the first member
+    hostbridge_transport *inner;
+    int fd;                             // Destination of records
+    int error;                          // Error of write() to fd (capturing stopped if negative)
+} hostbridge_capture;
+
+typedef void (*hostbridge_source_callback)(hostbridge_channel *channel, void *context, int result);
+
 extern int peridot_sw_hostbridge_gen2_init(void);
+extern int peridot_sw_hostbridge_gen2_set_transport(hostbridge_transport *transport);
+extern int peridot_sw_hostbridge_gen2_set_link_transport(int index, hostbridge_transport *transport);
+extern void peridot_sw_hostbridge_gen2_capture(hostbridge_capture *capture, hostbridge_transport *inner, int fd);
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_TRANSPORT_POSIX
+extern void peridot_sw_hostbridge_gen2_posix_transport(hostbridge_transport *transport, int fd);
+#else
+extern hostbridge_transport peridot_sw_hostbridge_gen2_hal_transport;
+extern void peridot_sw_hostbridge_gen2_uart_transport(hostbridge_transport *transport, const char *path);
+#endif
 #ifndef PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD
 extern void peridot_sw_hostbridge_gen2_service(void);
 #endif
 
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_RX_EVENT
+extern void peridot_sw_hostbridge_gen2_notify_rx(void);
+#endif
 extern int peridot_sw_hostbridge_gen2_register_channel(hostbridge_channel *channel);
+extern hostbridge_channel *peridot_sw_hostbridge_gen2_find_channel(alt_u8 number);
 extern int peridot_sw_hostbridge_gen2_source(hostbridge_channel *channel, const void *ptr, int len, int flags);
+extern int peridot_sw_hostbridge_gen2_source_async(hostbridge_channel *channel, const void *ptr, int len, int flags, hostbridge_source_callback callback, void *context);
+extern int peridot_sw_hostbridge_gen2_sourcev(hostbridge_channel *channel, const hostbridge_iovec *iov, int iovcnt, int flags);
+
+extern int peridot_sw_hostbridge_gen2_avm_register(hostbridge_avm_window *window);
+extern hostbridge_avm_window *peridot_sw_hostbridge_gen2_avm_find(const char *name);
+
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_STATISTICS
+extern void peridot_sw_hostbridge_gen2_get_link_stats(hostbridge_link_stats *stats);
+extern int peridot_sw_hostbridge_gen2_get_channel_stats(alt_u8 number, hostbridge_channel_stats *stats);
+#endif
+
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_COMPRESSION
+extern int peridot_sw_hostbridge_gen2_set_compression(alt_u8 number, int enable);
+#endif
+
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_BLOCK_FRAMING
+extern int peridot_sw_hostbridge_gen2_set_block_framing(alt_u8 number, int enable);
+#endif
 
 extern int peridot_sw_hostbridge_gen2_mkpipe(alt_u8 channel, int output_fd, int input_fd, size_t input_capacity);
 
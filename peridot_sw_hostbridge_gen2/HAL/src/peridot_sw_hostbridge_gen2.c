@@ -1,57 +1,201 @@
 #include "system.h"
 #include "peridot_sw_hostbridge_gen2.h"
 #include <unistd.h>
-#include <sys/fcntl.h>
 #include <string.h>
+#include <stdint.h>
 #include <errno.h>
+#include <malloc.h>
 #include "os/alt_sem.h"
-
-#ifndef HOSTBRIDGE_NAME
-# error "peridot_sw_hostbridge_gen2 requires UART device named 'hostbridge'!"
-#endif
-
-#define PERIDOT_SW_HOSTBRIDGE_PORT hostbridge
-#define PERIDOT_SW_HOSTBRIDGE_PATH "/dev/hostbridge"
-
-#ifdef ALT_USE_DIRECT_DRIVERS
-# include "sys/alt_driver.h"
+#if defined(PERIDOT_SW_HOSTBRIDGE_GEN2_STATISTICS) || (PERIDOT_SW_HOSTBRIDGE_GEN2_COALESCE_SIZE > 0)
+# include "sys/alt_alarm.h"
 #endif
 
-#define READ_BUFFER_LEN     128
+#define READ_BUFFER_LEN     256
+#define READ_BATCH_MIN      16
 #define WRITE_BUFFER_LEN    128
 
+// Runs without special bytes longer than this are written directly
+#define DIRECT_WRITE_THRESHOLD  16
+
 #ifdef __tinythreads__
 # include <pthread.h>
 # include <sched.h>
 # define YIELD()    sched_yield()
 #else
-# define YIELD()    (void)
+# define YIELD()    do { } while (0)
 #endif
 
-struct peridot_sw_hostbridge_gen2_state_s {
-    hostbridge_channel *channels;
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_STATISTICS
+# define LINK_STATS_ADD(member, value)  do { state.link_stats.member += (value); } while (0)
+#else
+# define LINK_STATS_ADD(member, value)  do { } while (0)
+#endif
+
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_BLOCK_FRAMING
+# define BLOCK_FRAMED(channel)          ((channel)->block_framed)
+# define BLOCK_HEADER_PENDING(link)     ((link)->block_header)
+// SOP and 2 length bytes (both may be escaped)
+# define BLOCK_HEADER_MAX_LEN           5
+#else
+# define BLOCK_FRAMED(channel)          0
+# define BLOCK_HEADER_PENDING(link)     0
+#endif
+
+#ifndef PERIDOT_SW_HOSTBRIDGE_GEN2_CHANNELS
+# define PERIDOT_SW_HOSTBRIDGE_GEN2_CHANNELS    256
+#endif
+
+#ifndef PERIDOT_SW_HOSTBRIDGE_GEN2_TX_QUEUE_DEPTH
+# define PERIDOT_SW_HOSTBRIDGE_GEN2_TX_QUEUE_DEPTH  0
+#endif
+
+#ifndef PERIDOT_SW_HOSTBRIDGE_GEN2_LINKS
+# define PERIDOT_SW_HOSTBRIDGE_GEN2_LINKS   1
+#endif
+
+#ifndef PERIDOT_SW_HOSTBRIDGE_GEN2_COALESCE_MS
+# define PERIDOT_SW_HOSTBRIDGE_GEN2_COALESCE_MS 2
+#endif
+
+#if (PERIDOT_SW_HOSTBRIDGE_GEN2_COALESCE_SIZE > 65535)
+# error "peridot_sw_hostbridge_gen2.coalesce_size must be 65535 or less"
+#endif
+
+#if ((PERIDOT_SW_HOSTBRIDGE_GEN2_TX_QUEUE_DEPTH > 0) || defined(PERIDOT_SW_HOSTBRIDGE_GEN2_RX_EVENT) || \
+     (PERIDOT_SW_HOSTBRIDGE_GEN2_COALESCE_SIZE > 0)) && \
+    defined(PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD)
+# include <semaphore.h>
+#endif
+
+#if (PERIDOT_SW_HOSTBRIDGE_GEN2_TX_QUEUE_DEPTH > 0)
+
+// Queued frames can be preempted at every this number of bytes
+#define PREEMPT_CHUNK       32
+
+/*
+ * Encoded frame waiting for transmission
+ */
+typedef struct hostbridge_tx_frame_s {
+    struct hostbridge_tx_frame_s *next;
+    hostbridge_channel *channel;
+    hostbridge_source_callback callback;
+    void *context;
+    int flags;
+    int len;
+    int written;    // -1 until channel prefix is written
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_BLOCK_FRAMING
+    alt_u8 unbreakable; // Contains block payload (cannot be suspended)
+#endif
+    alt_u8 data[0];
+} hostbridge_tx_frame;
+
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_BLOCK_FRAMING
+# define FRAME_UNBREAKABLE(frame)   ((frame)->unbreakable)
+#else
+# define FRAME_UNBREAKABLE(frame)   0
+#endif
+#endif  /* PERIDOT_SW_HOSTBRIDGE_GEN2_TX_QUEUE_DEPTH > 0 */
+
+/*
+ * Physical link to host (each link has its own transport, decoder and TX queue)
+ */
+typedef struct hostbridge_link_s {
+    hostbridge_transport *transport;
+    volatile alt_u8 started;    // Transport opened and receiver running
     hostbridge_channel *sink_channel;
     alt_16 source_channel_number;
     alt_u8 channel_prefix;
     alt_u8 escape_prefix;
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_BLOCK_FRAMING
+    alt_u8 block_header;        // Number of length bytes received after SOP (0:none)
+    alt_u8 block_low;
+    alt_u16 block_remaining;    // Bytes left in current block payload
+#endif
     ALT_SEM(lock);
-#ifndef ALT_USE_DIRECT_DRIVERS
-    int fd;
+    int tx_error;               // Error of transport in current transfer (0:none)
+    int read_batch;
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_STATISTICS
+    alt_u32 tx_bytes;
 #endif
 #ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD
     pthread_t tid;
 #endif
+#if defined(PERIDOT_SW_HOSTBRIDGE_GEN2_RX_EVENT) && defined(PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD)
+    volatile alt_u8 rx_waiting;
+    sem_t rx_sem;
+#endif
+#if (PERIDOT_SW_HOSTBRIDGE_GEN2_TX_QUEUE_DEPTH > 0)
+    ALT_SEM(tx_lock);           // Held by flusher while writing frame (lock is for queue)
+    hostbridge_tx_frame *tx_head;
+    hostbridge_tx_frame *tx_tail;
+    hostbridge_tx_frame *tx_current;    // Frame suspended at unsafe point
+    int tx_queued;
+# ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD
+    sem_t tx_sem;
+    pthread_t tx_tid;
+# endif
+#endif
+#if (PERIDOT_SW_HOSTBRIDGE_GEN2_COALESCE_SIZE > 0)
+    ALT_SEM(coalesce_lock);
+    hostbridge_channel *coalesce_first; // Channels with buffered small writes
+    alt_u32 coalesce_since;             // Ticks when the first of them was buffered
+# ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD
+    alt_alarm coalesce_alarm;
+    volatile alt_u8 coalesce_alarm_active;
+    sem_t coalesce_sem;
+    pthread_t coalesce_tid;
+# endif
+#endif
+} hostbridge_link;
+
+struct peridot_sw_hostbridge_gen2_state_s {
+    hostbridge_channel *channels[PERIDOT_SW_HOSTBRIDGE_GEN2_CHANNELS];
+    hostbridge_link links[PERIDOT_SW_HOSTBRIDGE_GEN2_LINKS];
+    alt_u8 initialized;
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_STATISTICS
+    hostbridge_link_stats link_stats;
+#endif
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_RX_EVENT
+    volatile alt_u8 rx_event;
+#endif
 } peridot_sw_hostbridge_gen2_state __attribute__((weak));
 
 static struct peridot_sw_hostbridge_gen2_state_s state
 __attribute__((alias("peridot_sw_hostbridge_gen2_state")));
 
-#ifdef ALT_USE_DIRECT_DRIVERS
-ALT_DRIVER_READ_EXTERNS(PERIDOT_SW_HOSTBRIDGE_PORT);
-ALT_DRIVER_WRITE_EXTERNS(PERIDOT_SW_HOSTBRIDGE_PORT);
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_UART
+extern hostbridge_transport peridot_sw_hostbridge_gen2_direct_transport;
+extern int peridot_sw_hostbridge_gen2_direct_attach(hostbridge_channel *channel);
+extern int peridot_sw_hostbridge_gen2_direct_drain(void (*deliver)(hostbridge_channel *, const alt_u8 *, int, int));
 #endif
-
 extern int peridot_sw_hostbridge_gen2_avm_init(void);
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_FLOW_CONTROL
+extern int peridot_sw_hostbridge_gen2_pipe_init(void);
+#endif
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_COMPRESSION
+extern int peridot_sw_hostbridge_gen2_lz_init(void);
+extern int peridot_sw_hostbridge_gen2_lz_attach(hostbridge_channel *channel);
+extern void peridot_sw_hostbridge_gen2_lz_enable(hostbridge_channel *channel, int enable);
+extern int peridot_sw_hostbridge_gen2_lz_encode(const hostbridge_iovec *iov, int iovcnt, int len, hostbridge_iovec **out);
+extern void peridot_sw_hostbridge_gen2_lz_release(hostbridge_iovec *iov);
+extern void peridot_sw_hostbridge_gen2_lz_sink(hostbridge_channel *channel, const alt_u8 *ptr, int len,
+                                               void (*deliver)(hostbridge_channel *, const alt_u8 *, int));
+#endif
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_RELIABLE
+extern int peridot_sw_hostbridge_gen2_rel_init(int (*transmit)(hostbridge_channel *channel, const void *ptr, int len));
+extern int peridot_sw_hostbridge_gen2_rel_attach(hostbridge_channel *channel);
+extern int peridot_sw_hostbridge_gen2_rel_encode(hostbridge_channel *channel, const hostbridge_iovec *iov, int iovcnt, int len, const alt_u8 **out);
+extern void peridot_sw_hostbridge_gen2_rel_release(void);
+extern void peridot_sw_hostbridge_gen2_rel_sink(hostbridge_channel *channel, const alt_u8 *ptr, int len,
+                                                void (*deliver)(hostbridge_channel *, const alt_u8 *, int));
+static int transmit_frame(hostbridge_channel *channel, const void *ptr, int len);
+#endif
+#if (PERIDOT_SW_HOSTBRIDGE_GEN2_TX_QUEUE_DEPTH > 0)
+static void flush_to_host(hostbridge_link *link);
+#endif
+#if (PERIDOT_SW_HOSTBRIDGE_GEN2_COALESCE_SIZE > 0)
+static void flush_coalesced(hostbridge_link *link, int force);
+#endif
 
 /**
  * @func find_channel
@@ -60,38 +204,32 @@ extern int peridot_sw_hostbridge_gen2_avm_init(void);
  */
 static hostbridge_channel *find_channel(alt_u8 number)
 {
-    hostbridge_channel *channel;
-    for (channel = state.channels; channel; channel = channel->next) {
-        if (channel->number == number) {
-            return channel;
-        }
+#if (PERIDOT_SW_HOSTBRIDGE_GEN2_CHANNELS < 256)
+    if (number >= PERIDOT_SW_HOSTBRIDGE_GEN2_CHANNELS) {
+        return NULL;
     }
-    return NULL;
+#endif
+    return state.channels[number];
 }
 
 /**
- * @func write_to_channel
- * @brief Write data to channel
+ * @func deliver_to_channel
+ * @brief Pass data to destination of channel
  * @param channel Destination channel
  * @param buffer Pointer to buffer
- * @param from Start offset
- * @param to End offset (exclusive)
+ * @param len Length of buffer
  */
-static void write_to_channel(hostbridge_channel *channel, const alt_u8 *buffer, int from, int to)
+static void deliver_to_channel(hostbridge_channel *channel, const alt_u8 *buffer, int len)
 {
-    int len;
-
-    if (!channel) {
-        return;
-    }
-
-    buffer += from;
-    len = to - from;
     while (len > 0) {
         int written;
         if (channel->use_fd) {
             // Use file descriptor
             written = write(channel->dest.fd, buffer, len);
+            if ((written < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+                // Non-blocking descriptor is full (retried below as sinks)
+                written = -EWOULDBLOCK;
+            }
         } else {
             // Use callback function
             written = (*channel->dest.sink)(channel, buffer, len);
@@ -99,222 +237,1706 @@ static void write_to_channel(hostbridge_channel *channel, const alt_u8 *buffer,
         if (written > 0) {
             buffer += written;
             len -= written;
-        } else {
+            continue;
+        }
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD
+        if ((written == 0) || (written == -EWOULDBLOCK)) {
+            // Wait for reader in other thread
             YIELD();
+            continue;
         }
+#endif
+        // No progress can be made in this context => Drop remaining data
+        HOSTBRIDGE_GEN2_STATS_ADD(channel, rx_dropped, len);
+        break;
     }
 }
 
-#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD
-static
+/**
+ * @func decode_to_channel
+ * @brief Pass data to destination of channel through decompression (if enabled)
+ * @param channel Destination channel
+ * @param buffer Pointer to buffer
+ * @param len Length of buffer
+ */
+static void decode_to_channel(hostbridge_channel *channel, const alt_u8 *buffer, int len)
+{
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_COMPRESSION
+    if (channel->compressed) {
+        peridot_sw_hostbridge_gen2_lz_sink(channel, buffer, len, deliver_to_channel);
+        return;
+    }
 #endif
+    deliver_to_channel(channel, buffer, len);
+}
+
 /**
- * @func peridot_sw_hostbridge_gen2_service
- * @brief Process I/O with software-based hostbridge (Gen2)
+ * @func write_to_channel
+ * @brief Write data to channel
+ * @param channel Destination channel
+ * @param buffer Pointer to buffer
+ * @param from Start offset
+ * @param to End offset (exclusive)
  */
-void peridot_sw_hostbridge_gen2_service(void)
+static void write_to_channel(hostbridge_channel *channel, const alt_u8 *buffer, int from, int to)
 {
-    alt_u8 buffer[READ_BUFFER_LEN];
-    int index;
-    int head;
-    int read_len;
+    if (!channel) {
+        LINK_STATS_ADD(rx_unrouted, to - from);
+        HOSTBRIDGE_TELEMETRY_ADD(hb_rx_unrouted, to - from);
+        return;
+    }
 
-#ifndef ALT_USE_DIRECT_DRIVERS
-    read_len = read(state.fd, buffer, sizeof(buffer));
-#else
-    read_len = ALT_DRIVER_READ(PERIDOT_SW_HOSTBRIDGE_PORT, buffer, sizeof(buffer), O_NONBLOCK);
-#endif
-    if (read_len <= 0) {
+    HOSTBRIDGE_GEN2_STATS_ADD(channel, rx_bytes, to - from);
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_RELIABLE
+    if (channel->reliable) {
+        peridot_sw_hostbridge_gen2_rel_sink(channel, buffer + from, to - from, decode_to_channel);
         return;
     }
+#endif
+    decode_to_channel(channel, buffer + from, to - from);
+}
+
+/**
+ * @func count_plain_bytes
+ * @brief Count bytes from head which do not need escape
+ * @param ptr Pointer to buffer
+ * @param len Length of buffer
+ * @note Scans 4 bytes at a time after alignment
+ */
+static int count_plain_bytes(const alt_u8 *ptr, int len)
+{
+    const alt_u8 *src = ptr;
+    const alt_u8 *end = ptr + len;
+
+    while ((src < end) && ((uintptr_t)src & 3)) {
+        if (AST_NEEDS_ESCAPE(*src)) {
+            return src - ptr;
+        }
+        ++src;
+    }
+    while ((end - src) >= 4) {
+        if (AST_WORD_NEEDS_ESCAPE(*(const alt_u32 *)src)) {
+            break;
+        }
+        src += 4;
+    }
+    while ((src < end) && !AST_NEEDS_ESCAPE(*src)) {
+        ++src;
+    }
+    return src - ptr;
+}
+
+/**
+ * @func decode_from_host
+ * @brief Demultiplex received data (sink) to channels
+ * @param link Link which received data
+ * @param buffer Pointer to received data (modified in place)
+ * @param len Length of received data
+ * @note Data for non-packetized channels is unescaped by compacting
+ *       the buffer with separate read/write cursors in a single pass.
+ *       Data for packetized channels is passed as it is (except channel
+ *       switches) because their sinks parse packets by themselves.
+ *       Block payload on block framed channels is copied as it is.
+ *       Data for channels pinned to other links is discarded, so that
+ *       the sink of each channel is called only by one receiver.
+ */
+static void decode_from_host(hostbridge_link *link, alt_u8 *buffer, int len)
+{
+    hostbridge_channel *sink = link->sink_channel;
+    const alt_u8 *src = buffer;
+    const alt_u8 *end = buffer + len;
+    alt_u8 *head = buffer;
+    alt_u8 *dest = buffer;
 
-    head = 0;
-    for (index = 0; index < read_len; ++index) {
-        alt_u8 byte = buffer[index];
-        switch (byte) {
-        case AST_CHANNEL_PREFIX:
-            state.channel_prefix = 1;
+    while (src < end) {
+        alt_u8 byte;
+
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_BLOCK_FRAMING
+        if (link->block_remaining > 0) {
+            // Payload of block (including special bytes)
+            int plain = end - src;
+            if (plain > link->block_remaining) {
+                plain = link->block_remaining;
+            }
+            if (dest != src) {
+                memmove(dest, src, plain);
+            }
+            src += plain;
+            dest += plain;
+            link->block_remaining -= plain;
             continue;
-        case AST_ESCAPE_PREFIX:
-            state.escape_prefix = 1;
-            if (state.sink_channel && !state.sink_channel->packetized) {
-                // Drop special byte
-                --read_len;
-                memmove(buffer, buffer + 1, read_len - index);
+        }
+#endif
+        if (!link->channel_prefix) {
+            // Bulk copy of bytes without special meaning
+            int plain;
+            int unescape = 0;
+            if (sink && sink->packetized) {
+                const alt_u8 *next = memchr(src, AST_CHANNEL_PREFIX, end - src);
+                plain = (next ? next : end) - src;
+            } else if (!link->escape_prefix && !BLOCK_HEADER_PENDING(link)) {
+                plain = count_plain_bytes(src, end - src);
+                unescape = 1;
+            } else {
+                plain = 0;
+            }
+            if (plain > 0) {
+                if (dest != src) {
+                    memmove(dest, src, plain);
+                }
+                src += plain;
+                dest += plain;
+            }
+            if (unescape) {
+                // Escaped bytes in a row (channel switch is left to the code below)
+                while (((end - src) >= 2) && (src[0] == AST_ESCAPE_PREFIX) &&
+                       (src[1] != AST_CHANNEL_PREFIX)) {
+                    *dest++ = src[1] ^ AST_ESCAPE_XOR;
+                    src += 2;
+                }
+            }
+            if (src == end) {
+                break;
+            }
+        }
+
+        byte = *src++;
+        if (link->channel_prefix) {
+            // Channel number (may be escaped)
+            if (byte == AST_ESCAPE_PREFIX) {
+                link->escape_prefix = 1;
+                continue;
+            }
+            if (link->escape_prefix) {
+                byte ^= AST_ESCAPE_XOR;
+                link->escape_prefix = 0;
+            }
+            write_to_channel(sink, head, 0, dest - head);
+            sink = find_channel(byte);
+            if (sink && (&state.links[sink->link] != link)) {
+                sink = NULL;
             }
+            head = dest = (alt_u8 *)src;
+            link->channel_prefix = 0;
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_BLOCK_FRAMING
+            link->block_header = 0;
+#endif
+            continue;
+        }
+        if (byte == AST_CHANNEL_PREFIX) {
+            link->channel_prefix = 1;
+            continue;
+        }
+        if (sink && sink->packetized) {
+            // Pass special bytes to packetized channel
+            *dest++ = byte;
             continue;
         }
-        if (state.escape_prefix) {
+        if (link->escape_prefix) {
             byte ^= AST_ESCAPE_XOR;
-            if (state.sink_channel && !state.sink_channel->packetized) {
-                buffer[index] = byte;
+            link->escape_prefix = 0;
+        } else if (byte == AST_ESCAPE_PREFIX) {
+            link->escape_prefix = 1;
+            continue;
+        } else if (AST_NEEDS_ESCAPE(byte)) {
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_BLOCK_FRAMING
+            if ((byte == AST_SOP) && sink && sink->block_framed) {
+                link->block_header = 1;
             }
-            state.escape_prefix = 0;
+#endif
+            // Drop special bytes (SOP and EOP)
+            continue;
         }
-        if (state.channel_prefix) {
-            write_to_channel(state.sink_channel, buffer, head, index - 1);
-            state.sink_channel = find_channel(byte);
-            head = index + 1;
-            state.channel_prefix = 0;
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_BLOCK_FRAMING
+        if (link->block_header == 1) {
+            link->block_low = byte;
+            link->block_header = 2;
             continue;
         }
-        if (state.sink_channel && !state.sink_channel->packetized) {
-            // Drop special bytes
-            switch (byte) {
-            case AST_SOP:
-            case AST_EOP_PREFIX:
-                --read_len;
-                memmove(buffer, buffer + 1, read_len - index);
-                continue;
-            }
+        if (link->block_header == 2) {
+            link->block_remaining = link->block_low | (byte << 8);
+            link->block_header = 0;
+            continue;
         }
+#endif
+        *dest++ = byte;
     }
 
-    write_to_channel(state.sink_channel, buffer, head, read_len);
+    write_to_channel(sink, head, 0, dest - head);
+    link->sink_channel = sink;
 }
 
-#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD
-static void *peridot_sw_hostbridge_gen2_worker(void *param)
+/**
+ * @func get_rx_buffer
+ * @brief Get buffer of current sink to read data into directly
+ * @param link Link to read
+ * @param len Pointer to store length of buffer
+ * @return Buffer of sink (NULL if not available)
+ */
+static alt_u8 *get_rx_buffer(hostbridge_link *link, int *len)
 {
-    (void)param;
-    pthread_setname_np(pthread_self(), "sw_bridge_gen2");
-    for (;;) {
-        peridot_sw_hostbridge_gen2_service();
+    hostbridge_channel *channel = link->sink_channel;
+
+    if (!channel || channel->use_fd || !channel->get_rx_buffer) {
+        return NULL;
     }
-    return NULL;
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_COMPRESSION
+    if (channel->compressed) {
+        return NULL;
+    }
+#endif
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_RELIABLE
+    if (channel->reliable) {
+        return NULL;
+    }
+#endif
+    return (alt_u8 *)(*channel->get_rx_buffer)(channel, len);
 }
-#endif  /* PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD */
 
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_UART
 /**
- * @func peridot_sw_hostbridge_gen2_init
- * @brief Initialize software-based hostbridge (Gen2)
- * @note This function will be called from alt_sys_init
+ * @func service_direct
+ * @brief Pass data decoded by interrupt handler of direct UART driver
+ * @param link Link to process
  */
-int peridot_sw_hostbridge_gen2_init(void)
+static void service_direct(hostbridge_link *link)
 {
-    int result;
-#ifndef ALT_USE_DIRECT_DRIVERS
-    state.fd = open(PERIDOT_SW_HOSTBRIDGE_PATH, O_RDWR
-# ifndef PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD
-         | O_NONBLOCK
-# endif /* !PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD */
-    );
-#endif  /* !ALT_USE_DIRECT_DRIVERS */
-    state.source_channel_number = -1;
-    ALT_SEM_CREATE(&state.lock, 1);
-    result = peridot_sw_hostbridge_gen2_avm_init();
-    if (result != 0) {
-        return result;
+    int read_len;
+
+#if defined(PERIDOT_SW_HOSTBRIDGE_GEN2_RX_EVENT) && defined(PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD)
+    link->rx_waiting = 1;
+    state.rx_event = 0;
+#endif
+
+    read_len = peridot_sw_hostbridge_gen2_direct_drain(write_to_channel);
+    if (read_len <= 0) {
+#if defined(PERIDOT_SW_HOSTBRIDGE_GEN2_RX_EVENT) && defined(PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD)
+        // Sleep until interrupt handler calls peridot_sw_hostbridge_gen2_notify_rx()
+        sem_wait(&link->rx_sem);
+#else
+        YIELD();
+#endif
+        return;
     }
-#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD
-    result = -pthread_create(&state.tid, NULL, peridot_sw_hostbridge_gen2_worker, NULL);
+    LINK_STATS_ADD(rx_bytes, read_len);
+    HOSTBRIDGE_TELEMETRY_ADD(hb_rx_bytes, read_len);
+#if defined(PERIDOT_SW_HOSTBRIDGE_GEN2_RX_EVENT) && defined(PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD)
+    link->rx_waiting = 0;
 #endif
-    return result;
 }
+#endif  /* PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_UART */
 
 /**
- * @func peridot_sw_hostbridge_gen2_register_channel
- * @brief Register channel
- * @param channel Channel structure to register
+ * @func service_link
+ * @brief Read and process data from link
+ * @param link Link to read
+ * @note When the current sink provides its buffer, data is read into it
+ *       directly and decoded in place. Otherwise data is read into stack
+ *       in batches which adapt to amount of pending data.
  */
-int peridot_sw_hostbridge_gen2_register_channel(hostbridge_channel *channel)
+static void service_link(hostbridge_link *link)
 {
-    hostbridge_channel *next, **prev;
+    alt_u8 local[READ_BUFFER_LEN];
+    alt_u8 *buffer;
+    int capacity = 0;
+    int read_len;
+
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_UART
+    if (link->transport == &peridot_sw_hostbridge_gen2_direct_transport) {
+        service_direct(link);
+        return;
+    }
+#endif
+#if defined(PERIDOT_SW_HOSTBRIDGE_GEN2_RX_EVENT) && defined(PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD)
+    if (link->transport->notify_rx) {
+        link->rx_waiting = 1;
+        state.rx_event = 0;
+    }
+#endif
+
+    buffer = get_rx_buffer(link, &capacity);
+    if (!buffer || (capacity <= 0)) {
+        buffer = local;
+        capacity = link->read_batch;
+    }
 
-    for (prev = &state.channels; (next = *prev) != NULL; prev = &next->next) {
-        if (next->number == channel->number) {
-            return -EEXIST;
+    read_len = (*link->transport->read)(link->transport, buffer, capacity);
+    if (read_len <= 0) {
+#if defined(PERIDOT_SW_HOSTBRIDGE_GEN2_RX_EVENT) && defined(PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD)
+        if (link->transport->notify_rx) {
+            // Sleep until peridot_sw_hostbridge_gen2_notify_rx() is called
+            sem_wait(&link->rx_sem);
         }
+#endif
+        return;
     }
-    channel->next = NULL;
-    *prev = channel;
-    return 0;
+    LINK_STATS_ADD(rx_bytes, read_len);
+    HOSTBRIDGE_TELEMETRY_ADD(hb_rx_bytes, read_len);
+#if defined(PERIDOT_SW_HOSTBRIDGE_GEN2_RX_EVENT) && defined(PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD)
+    link->rx_waiting = 0;
+#endif
+
+    // Adapt batch size to amount of pending data
+    if (read_len >= capacity) {
+#if defined(PERIDOT_SW_HOSTBRIDGE_GEN2_RX_EVENT) && !defined(PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD)
+        // More data may be pending
+        state.rx_event = 1;
+#endif
+        if ((buffer == local) && (link->read_batch < READ_BUFFER_LEN)) {
+            link->read_batch *= 2;
+        }
+    } else if ((buffer == local) && (read_len < link->read_batch / 4) && (link->read_batch > READ_BATCH_MIN)) {
+        link->read_batch /= 2;
+    }
+
+    decode_from_host(link, buffer, read_len);
 }
 
+#ifndef PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD
 /**
- * @func write_to_host
- * @brief Write data (source) to host
- * @param ptr Pointer to buffer
- * @param len Length of buffer
+ * @func peridot_sw_hostbridge_gen2_service
+ * @brief Process I/O with software-based hostbridge (Gen2)
  */
-static void write_to_host(const void *ptr, int len)
+void peridot_sw_hostbridge_gen2_service(void)
 {
-    while (len > 0) {
-        int written;
-#ifndef ALT_USE_DIRECT_DRIVERS
-        written = write(state.fd, ptr, len);
-#else
-        written = ALT_DRIVER_WRITE(PERIDOT_SW_HOSTBRIDGE_PORT, ptr, len, O_NONBLOCK);
+    int index;
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_RX_EVENT
+    int event;
 #endif
-        if (written > 0) {
-            ptr = (const alt_u8 *)ptr + written;
-            len -= written;
-        } else {
-            YIELD();
+
+#if (PERIDOT_SW_HOSTBRIDGE_GEN2_COALESCE_SIZE > 0)
+    for (index = 0; index < PERIDOT_SW_HOSTBRIDGE_GEN2_LINKS; ++index) {
+        if (state.links[index].started) {
+            flush_coalesced(&state.links[index], 0);
+        }
+    }
+#endif
+#if (PERIDOT_SW_HOSTBRIDGE_GEN2_TX_QUEUE_DEPTH > 0)
+    for (index = 0; index < PERIDOT_SW_HOSTBRIDGE_GEN2_LINKS; ++index) {
+        if (state.links[index].started) {
+            flush_to_host(&state.links[index]);
+        }
+    }
+#endif
+
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_RX_EVENT
+    event = state.rx_event;
+    state.rx_event = 0;
+#endif
+
+    for (index = 0; index < PERIDOT_SW_HOSTBRIDGE_GEN2_LINKS; ++index) {
+        hostbridge_link *link = &state.links[index];
+        if (!link->started) {
+            continue;
+        }
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_RX_EVENT
+        if (!event && link->transport->notify_rx) {
+            // Nothing arrived since last read
+            continue;
         }
+#endif
+        service_link(link);
     }
 }
+#endif  /* !PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD */
 
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_RX_EVENT
 /**
- * @func peridot_sw_hostbridge_gen2_source
- * @brief Write data from channel
- * @param channel Source channel
- * @param ptr Pointer to buffer
- * @param len Length of buffer
+ * @func peridot_sw_hostbridge_gen2_notify_rx
+ * @brief Notify that UART has received data
+ * @note This must be called by UART driver (e.g. RX interrupt handler)
+ *       whenever new bytes arrive. The receiver sleeps until notified.
+ *       With multiple links, all links are checked.
+ *       Only links whose transports have notify_rx set wait for this.
+ *       Other links are read without waiting (in blocking mode with
+ *       receiver thread) as if rx_event were disabled.
  */
-int peridot_sw_hostbridge_gen2_source(hostbridge_channel *channel, const void *ptr, int len, int flags)
+void peridot_sw_hostbridge_gen2_notify_rx(void)
 {
-    int packetize = (flags & HOSTBRIDGE_GEN2_SOURCE_PACKETIZED) ? 1 : 0;
-    ALT_SEM_PEND(state.lock, 0);
-
-    if ((channel->number != state.source_channel_number) || (flags & HOSTBRIDGE_GEN2_SOURCE_RESET)) {
-        alt_u8 buffer[3];
-        alt_u8 byte = channel->number;
-        int write_len;
-        buffer[0] = AST_CHANNEL_PREFIX;
-        if (AST_NEEDS_ESCAPE(byte)) {
-            // Escape
-            buffer[1] = AST_ESCAPE_PREFIX;
-            buffer[2] = byte ^ AST_ESCAPE_XOR;
-            write_len = 3;
-        } else {
-            buffer[1] = byte;
-            write_len = 2;
-        }
-        write_to_host(buffer, write_len);
-        state.source_channel_number = byte;
-    }
+# ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD
+    int index;
+# endif
 
-    if (channel->packetized && !packetize) {
-        write_to_host(ptr, len);
-    } else {
-        alt_u8 buffer[WRITE_BUFFER_LEN + 2];
-        const alt_u8 *src = (const alt_u8 *)ptr;
-        while (len > 0) {
-            int write_len = 0;
-            if (packetize > 0) {
-                buffer[0] = AST_SOP;
-                write_len = 1;
-                packetize = -1;
-            }
-            while ((write_len < WRITE_BUFFER_LEN) && (len > 0)) {
-                alt_u8 byte = *src++;
-                if (packetize && (len == 1)) {
-                    buffer[write_len++] = AST_EOP_PREFIX;
-                }
-                if (AST_NEEDS_ESCAPE(byte)) {
-                    // Escape
-                    buffer[write_len++] = AST_ESCAPE_PREFIX;
-                    buffer[write_len++] = byte ^ AST_ESCAPE_XOR;
-                } else {
-                    buffer[write_len++] = byte;
-                }
-                --len;
-            }
-            write_to_host(buffer, write_len);
+    state.rx_event = 1;
+# ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD
+    for (index = 0; index < PERIDOT_SW_HOSTBRIDGE_GEN2_LINKS; ++index) {
+        hostbridge_link *link = &state.links[index];
+        if (link->rx_waiting) {
+            link->rx_waiting = 0;
+            sem_post(&link->rx_sem);
         }
     }
+# endif
+}
+#endif  /* PERIDOT_SW_HOSTBRIDGE_GEN2_RX_EVENT */
 
-    ALT_SEM_POST(state.lock);
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD
+static void *peridot_sw_hostbridge_gen2_worker(void *param)
+{
+    hostbridge_link *link = (hostbridge_link *)param;
+
+    pthread_setname_np(pthread_self(), "sw_bridge_gen2");
+    for (;;) {
+        service_link(link);
+    }
+    return NULL;
+}
+
+# if (PERIDOT_SW_HOSTBRIDGE_GEN2_TX_QUEUE_DEPTH > 0)
+static void *peridot_sw_hostbridge_gen2_flusher(void *param)
+{
+    hostbridge_link *link = (hostbridge_link *)param;
+
+    pthread_setname_np(pthread_self(), "sw_bridge_tx");
+    for (;;) {
+        sem_wait(&link->tx_sem);
+        flush_to_host(link);
+    }
+    return NULL;
+}
+# endif /* PERIDOT_SW_HOSTBRIDGE_GEN2_TX_QUEUE_DEPTH > 0 */
+
+# if (PERIDOT_SW_HOSTBRIDGE_GEN2_COALESCE_SIZE > 0)
+static alt_u32 coalesce_alarm(void *context)
+{
+    hostbridge_link *link = (hostbridge_link *)context;
+
+    link->coalesce_alarm_active = 0;
+    sem_post(&link->coalesce_sem);
+    return 0;
+}
+
+static void *peridot_sw_hostbridge_gen2_coalescer(void *param)
+{
+    hostbridge_link *link = (hostbridge_link *)param;
+
+    pthread_setname_np(pthread_self(), "sw_bridge_coal");
+    for (;;) {
+        sem_wait(&link->coalesce_sem);
+        flush_coalesced(link, 1);
+    }
+    return NULL;
+}
+# endif /* PERIDOT_SW_HOSTBRIDGE_GEN2_COALESCE_SIZE > 0 */
+#endif  /* PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD */
+
+/**
+ * @func start_link
+ * @brief Open transport of link and start its threads
+ * @param link Link with transport
+ */
+static int start_link(hostbridge_link *link)
+{
+    int result;
+
+    result = (*link->transport->open)(link->transport,
+#if !defined(PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD)
+        1
+#elif defined(PERIDOT_SW_HOSTBRIDGE_GEN2_RX_EVENT)
+        link->transport->notify_rx
+#else
+        0
+#endif
+    );
+    if (result < 0) {
+        return result;
+    }
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD
+# if (PERIDOT_SW_HOSTBRIDGE_GEN2_TX_QUEUE_DEPTH > 0)
+    result = -pthread_create(&link->tx_tid, NULL, peridot_sw_hostbridge_gen2_flusher, link);
+    if (result != 0) {
+        return result;
+    }
+# endif
+# if (PERIDOT_SW_HOSTBRIDGE_GEN2_COALESCE_SIZE > 0)
+    result = -pthread_create(&link->coalesce_tid, NULL, peridot_sw_hostbridge_gen2_coalescer, link);
+    if (result != 0) {
+        return result;
+    }
+# endif
+#endif
+    link->started = 1;
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD
+    result = -pthread_create(&link->tid, NULL, peridot_sw_hostbridge_gen2_worker, link);
+    if (result != 0) {
+        return result;
+    }
+#endif
+    return 0;
+}
+
+/**
+ * @func peridot_sw_hostbridge_gen2_init
+ * @brief Initialize software-based hostbridge (Gen2)
+ * @note This function will be called from alt_sys_init
+ *       Only links which already have transports are started here.
+ *       Link 0 uses UART named 'hostbridge' unless manual_start is enabled.
+ */
+int peridot_sw_hostbridge_gen2_init(void)
+{
+    int result;
+    int index;
+
+#if defined(PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_UART)
+    if (!state.links[0].transport) {
+        state.links[0].transport = &peridot_sw_hostbridge_gen2_direct_transport;
+    }
+#elif !defined(PERIDOT_SW_HOSTBRIDGE_GEN2_TRANSPORT_POSIX) && !defined(PERIDOT_SW_HOSTBRIDGE_GEN2_MANUAL_START)
+    if (!state.links[0].transport) {
+        state.links[0].transport = &peridot_sw_hostbridge_gen2_hal_transport;
+    }
+#endif
+    for (index = 0; index < PERIDOT_SW_HOSTBRIDGE_GEN2_LINKS; ++index) {
+        hostbridge_link *link = &state.links[index];
+        link->source_channel_number = -1;
+        link->read_batch = READ_BUFFER_LEN;
+        ALT_SEM_CREATE(&link->lock, 1);
+#if defined(PERIDOT_SW_HOSTBRIDGE_GEN2_RX_EVENT) && defined(PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD)
+        sem_init(&link->rx_sem, 0, 0);
+#endif
+#if (PERIDOT_SW_HOSTBRIDGE_GEN2_TX_QUEUE_DEPTH > 0)
+        ALT_SEM_CREATE(&link->tx_lock, 1);
+#endif
+#if (PERIDOT_SW_HOSTBRIDGE_GEN2_COALESCE_SIZE > 0)
+        ALT_SEM_CREATE(&link->coalesce_lock, 1);
+#endif
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD
+# if (PERIDOT_SW_HOSTBRIDGE_GEN2_TX_QUEUE_DEPTH > 0)
+        sem_init(&link->tx_sem, 0, 0);
+# endif
+# if (PERIDOT_SW_HOSTBRIDGE_GEN2_COALESCE_SIZE > 0)
+        sem_init(&link->coalesce_sem, 0, 0);
+# endif
+#endif
+    }
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_RX_EVENT
+    // Read once at first to catch data received before initialization
+    state.rx_event = 1;
+#endif
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_COMPRESSION
+    peridot_sw_hostbridge_gen2_lz_init();
+#endif
+    result = peridot_sw_hostbridge_gen2_avm_init();
+    if (result != 0) {
+        return result;
+    }
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_FLOW_CONTROL
+    result = peridot_sw_hostbridge_gen2_pipe_init();
+    if (result != 0) {
+        return result;
+    }
+#endif
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_RELIABLE
+    result = peridot_sw_hostbridge_gen2_rel_init(transmit_frame);
+    if (result != 0) {
+        return result;
+    }
+#endif
+    state.initialized = 1;
+    for (index = 0; index < PERIDOT_SW_HOSTBRIDGE_GEN2_LINKS; ++index) {
+        hostbridge_link *link = &state.links[index];
+        if (link->transport) {
+            result = start_link(link);
+            if (result != 0) {
+                return result;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @func peridot_sw_hostbridge_gen2_set_transport
+ * @brief Select transport used by hostbridge
+ * @param transport Transport (must be kept valid)
+ * @note Same as peridot_sw_hostbridge_gen2_set_link_transport() for link 0.
+ *       Without this, UART named 'hostbridge' is used via HAL.
+ */
+int peridot_sw_hostbridge_gen2_set_transport(hostbridge_transport *transport)
+{
+    return peridot_sw_hostbridge_gen2_set_link_transport(0, transport);
+}
+
+/**
+ * @func peridot_sw_hostbridge_gen2_set_link_transport
+ * @brief Select transport used by link
+ * @param index Link index (0 to number of links minus 1)
+ * @param transport Transport (must be kept valid)
+ * @note If this is called after peridot_sw_hostbridge_gen2_init()
+ *       (e.g. from main() because hostbridge is initialized by alt_sys_init),
+ *       the link is started immediately. Until then, data from channels
+ *       pinned to the link is discarded.
+ */
+int peridot_sw_hostbridge_gen2_set_link_transport(int index, hostbridge_transport *transport)
+{
+    hostbridge_link *link;
+
+    if ((index < 0) || (index >= PERIDOT_SW_HOSTBRIDGE_GEN2_LINKS)) {
+        return -EINVAL;
+    }
+    link = &state.links[index];
+    if (link->transport) {
+        return -EBUSY;
+    }
+    link->transport = transport;
+    if (!state.initialized) {
+        return 0;
+    }
+    return start_link(link);
+}
+
+/**
+ * @func peridot_sw_hostbridge_gen2_register_channel
+ * @brief Register channel
+ * @param channel Channel structure to register
+ */
+int peridot_sw_hostbridge_gen2_register_channel(hostbridge_channel *channel)
+{
+#if (PERIDOT_SW_HOSTBRIDGE_GEN2_CHANNELS < 256)
+    if (channel->number >= PERIDOT_SW_HOSTBRIDGE_GEN2_CHANNELS) {
+        return -EINVAL;
+    }
+#endif
+    if (channel->link >= PERIDOT_SW_HOSTBRIDGE_GEN2_LINKS) {
+        return -EINVAL;
+    }
+    if (state.channels[channel->number]) {
+        return -EEXIST;
+    }
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_COMPRESSION
+    if (channel->compressible) {
+        int result = peridot_sw_hostbridge_gen2_lz_attach(channel);
+        if (result < 0) {
+            return result;
+        }
+    }
+#endif
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_RELIABLE
+    if (channel->recoverable && channel->packetized) {
+        int result = peridot_sw_hostbridge_gen2_rel_attach(channel);
+        if (result < 0) {
+            return result;
+        }
+    }
+#endif
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_UART
+    if (channel->link == 0) {
+        // Registers of UART 'hostbridge' are driven only on link 0
+        int result = peridot_sw_hostbridge_gen2_direct_attach(channel);
+        if (result < 0) {
+            return result;
+        }
+    }
+#endif
+    state.channels[channel->number] = channel;
+    HOSTBRIDGE_TELEMETRY_ADD(hb_channels, 1);
+    return 0;
+}
+
+/**
+ * @func peridot_sw_hostbridge_gen2_find_channel
+ * @brief Find registered channel
+ * @param number Channel number
+ * @return Channel structure, or NULL if not registered
+ */
+hostbridge_channel *peridot_sw_hostbridge_gen2_find_channel(alt_u8 number)
+{
+    return find_channel(number);
+}
+
+/**
+ * @func write_to_host_once
+ * @brief Write data (source) to host with single driver call
+ * @param link Link to write
+ * @param ptr Pointer to buffer
+ * @param len Length of buffer
+ * @return Number of bytes written (zero or negative if nothing written)
+ */
+static int write_to_host_once(hostbridge_link *link, const void *ptr, int len)
+{
+    int written = (*link->transport->write)(link->transport, ptr, len);
+
+    if (written > 0) {
+        LINK_STATS_ADD(tx_bytes, written);
+        HOSTBRIDGE_TELEMETRY_ADD(hb_tx_bytes, written);
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_STATISTICS
+        link->tx_bytes += written;
+#endif
+    }
+    return written;
+}
+
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_STATISTICS
+/**
+ * @func count_blocked
+ * @brief Accumulate time blocked by UART
+ * @param since Pointer to tick count when blocking started (0 if not blocked)
+ * @param blocked Non-zero if UART is still blocking
+ */
+static void count_blocked(alt_u32 *since, int blocked)
+{
+    alt_u32 now = alt_nticks() | 1;
+
+    if (blocked) {
+        if (*since == 0) {
+            *since = now;
+        }
+    } else if (*since != 0) {
+        state.link_stats.tx_blocked_ticks += now - *since;
+        *since = 0;
+    }
+}
+# define COUNT_BLOCKED(since, blocked)  count_blocked(since, blocked)
+#else
+# define COUNT_BLOCKED(since, blocked)  do { } while (0)
+#endif
+
+/**
+ * @func write_to_host
+ * @brief Write data (source) to host
+ * @param link Link to write
+ * @param ptr Pointer to buffer
+ * @param len Length of buffer
+ * @note If transport fails, error is stored to link->tx_error and
+ *       nothing is written until caller clears it.
+ */
+static void write_to_host(hostbridge_link *link, const void *ptr, int len)
+{
+    alt_u32 blocked_since = 0;
+
+    while ((len > 0) && !link->tx_error) {
+        int written = write_to_host_once(link, ptr, len);
+        if (written > 0) {
+            ptr = (const alt_u8 *)ptr + written;
+            len -= written;
+        } else if (written < 0) {
+            // Give up this transfer
+            link->tx_error = written;
+        } else {
+            COUNT_BLOCKED(&blocked_since, 1);
+            YIELD();
+        }
+    }
+    COUNT_BLOCKED(&blocked_since, 0);
+    (void)blocked_since;
+}
+
+#if (PERIDOT_SW_HOSTBRIDGE_GEN2_TX_QUEUE_DEPTH == 0)
+/**
+ * @func write_escaped_to_host
+ * @brief Write data to host with escaping special bytes
+ * @param link Link to write
+ * @param buffer Staging buffer (WRITE_BUFFER_LEN + 2 bytes)
+ * @param buffered Number of bytes already in staging buffer
+ * @param src Pointer to data
+ * @param len Length of data
+ * @return Number of bytes left in staging buffer
+ * @note Long runs without special bytes are written directly from the source
+ */
+static int write_escaped_to_host(hostbridge_link *link, alt_u8 *buffer, int buffered, const alt_u8 *src, int len)
+{
+    while (len > 0) {
+        int plain = count_plain_bytes(src, len);
+        if (plain >= DIRECT_WRITE_THRESHOLD) {
+            if (buffered > 0) {
+                write_to_host(link, buffer, buffered);
+                buffered = 0;
+            }
+            write_to_host(link, src, plain);
+        } else {
+            int copy_len;
+            for (copy_len = plain; copy_len > 0; ) {
+                int chunk = WRITE_BUFFER_LEN - buffered;
+                if (chunk > copy_len) {
+                    chunk = copy_len;
+                }
+                memcpy(buffer + buffered, src + plain - copy_len, chunk);
+                buffered += chunk;
+                copy_len -= chunk;
+                if (buffered >= WRITE_BUFFER_LEN) {
+                    write_to_host(link, buffer, buffered);
+                    buffered = 0;
+                }
+            }
+        }
+        src += plain;
+        len -= plain;
+        if (len > 0) {
+            // Escape
+            buffer[buffered++] = AST_ESCAPE_PREFIX;
+            buffer[buffered++] = *src++ ^ AST_ESCAPE_XOR;
+            --len;
+            if (buffered >= WRITE_BUFFER_LEN) {
+                write_to_host(link, buffer, buffered);
+                buffered = 0;
+            }
+        }
+    }
+    return buffered;
+}
+#endif  /* PERIDOT_SW_HOSTBRIDGE_GEN2_TX_QUEUE_DEPTH == 0 */
+
+/**
+ * @func write_channel_prefix
+ * @brief Switch source channel if needed
+ * @param link Link to write
+ * @param number Channel number
+ * @param flags Flags for source function
+ */
+static void write_channel_prefix(hostbridge_link *link, alt_u8 number, int flags)
+{
+    alt_u8 buffer[3];
+    int write_len;
+
+    if ((number == link->source_channel_number) && !(flags & HOSTBRIDGE_GEN2_SOURCE_RESET)) {
+        return;
+    }
+
+    buffer[0] = AST_CHANNEL_PREFIX;
+    if (AST_NEEDS_ESCAPE(number)) {
+        // Escape
+        buffer[1] = AST_ESCAPE_PREFIX;
+        buffer[2] = number ^ AST_ESCAPE_XOR;
+        write_len = 3;
+    } else {
+        buffer[1] = number;
+        write_len = 2;
+    }
+    write_to_host(link, buffer, write_len);
+    link->source_channel_number = number;
+}
+
+/**
+ * @func measure_iov
+ * @brief Get total length of vector
+ * @param iov Array of segments
+ * @param iovcnt Number of segments
+ * @return Total length in bytes (or negative errno)
+ */
+static int measure_iov(const hostbridge_iovec *iov, int iovcnt)
+{
+    int total = 0;
+
+    if (iovcnt < 0) {
+        return -EINVAL;
+    }
+    for (; iovcnt > 0; ++iov, --iovcnt) {
+        if (iov->len < 0) {
+            return -EINVAL;
+        }
+        total += iov->len;
+    }
+    return total;
+}
+
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_BLOCK_FRAMING
+/**
+ * @func encode_block_header
+ * @brief Encode SOP and length of block
+ * @param dest Pointer to destination (BLOCK_HEADER_MAX_LEN bytes)
+ * @param len Length of block payload
+ * @return Length of encoded header
+ */
+static int encode_block_header(alt_u8 *dest, int len)
+{
+    alt_u8 bytes[2];
+    int total = 0;
+    int i;
+
+    bytes[0] = len;
+    bytes[1] = len >> 8;
+    dest[total++] = AST_SOP;
+    for (i = 0; i < 2; ++i) {
+        if (AST_NEEDS_ESCAPE(bytes[i])) {
+            dest[total++] = AST_ESCAPE_PREFIX;
+            dest[total++] = bytes[i] ^ AST_ESCAPE_XOR;
+        } else {
+            dest[total++] = bytes[i];
+        }
+    }
+    return total;
+}
+
+/**
+ * @func encode_blocks
+ * @brief Encode vector as blocks (payload is not escaped)
+ * @param link Link to write directly (NULL to encode into memory)
+ * @param dest Pointer to destination (NULL to measure length only)
+ * @param iov Array of segments
+ * @param len Total length of segments
+ * @return Length of encoded data
+ * @note Data longer than HOSTBRIDGE_GEN2_BLOCK_MAX_LEN is split into blocks.
+ */
+static int encode_blocks(hostbridge_link *link, alt_u8 *dest, const hostbridge_iovec *iov, int len)
+{
+    int total = 0;
+    int offset = 0;
+
+    while (len > 0) {
+        alt_u8 header[BLOCK_HEADER_MAX_LEN];
+        int block = (len > HOSTBRIDGE_GEN2_BLOCK_MAX_LEN) ? HOSTBRIDGE_GEN2_BLOCK_MAX_LEN : len;
+        int header_len = encode_block_header(header, block);
+
+        if (link) {
+            write_to_host(link, header, header_len);
+        } else if (dest) {
+            memcpy(dest + total, header, header_len);
+        }
+        total += header_len;
+        len -= block;
+        if (!link && !dest) {
+            total += block;
+            continue;
+        }
+        while (block > 0) {
+            int chunk = iov->len - offset;
+            if (chunk > block) {
+                chunk = block;
+            }
+            if (chunk > 0) {
+                const alt_u8 *src = (const alt_u8 *)iov->base + offset;
+                if (link) {
+                    write_to_host(link, src, chunk);
+                } else {
+                    memcpy(dest + total, src, chunk);
+                }
+                total += chunk;
+                offset += chunk;
+                block -= chunk;
+            }
+            if (offset == iov->len) {
+                ++iov;
+                offset = 0;
+            }
+        }
+    }
+    return total;
+}
+#endif  /* PERIDOT_SW_HOSTBRIDGE_GEN2_BLOCK_FRAMING */
+
+#if (PERIDOT_SW_HOSTBRIDGE_GEN2_TX_QUEUE_DEPTH > 0)
+/**
+ * @func encode_escaped
+ * @brief Encode data with escaping special bytes into memory
+ * @param dest Pointer to destination (NULL to measure length only)
+ * @param src Pointer to data
+ * @param len Length of data
+ * @return Length of encoded data
+ */
+static int encode_escaped(alt_u8 *dest, const alt_u8 *src, int len)
+{
+    int total = 0;
+
+    while (len > 0) {
+        int plain = count_plain_bytes(src, len);
+        if (dest) {
+            memcpy(dest + total, src, plain);
+        }
+        total += plain;
+        src += plain;
+        len -= plain;
+        if (len > 0) {
+            // Escape
+            if (dest) {
+                dest[total] = AST_ESCAPE_PREFIX;
+                dest[total + 1] = *src ^ AST_ESCAPE_XOR;
+            }
+            total += 2;
+            ++src;
+            --len;
+        }
+    }
+    return total;
+}
+
+/**
+ * @func encode_payload
+ * @brief Encode payload (with SOP/EOP if packetized) into memory
+ * @param dest Pointer to destination (NULL to measure length only)
+ * @param channel Source channel
+ * @param iov Array of segments
+ * @param iovcnt Number of segments
+ * @param len Total length of segments
+ * @param flags Flags for source function
+ * @param block Non-zero to encode as blocks
+ * @return Length of encoded data
+ */
+static int encode_payload(alt_u8 *dest, hostbridge_channel *channel, const hostbridge_iovec *iov, int iovcnt, int len, int flags, int block)
+{
+    int packetize = (flags & HOSTBRIDGE_GEN2_SOURCE_PACKETIZED) ? 1 : 0;
+    int total = 0;
+
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_BLOCK_FRAMING
+    if (block) {
+        return encode_blocks(NULL, dest, iov, len);
+    }
+#endif
+    if (channel->packetized && !packetize) {
+        for (; iovcnt > 0; ++iov, --iovcnt) {
+            if (dest) {
+                memcpy(dest + total, iov->base, iov->len);
+            }
+            total += iov->len;
+        }
+        return total;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    if (packetize) {
+        if (dest) {
+            dest[total] = AST_SOP;
+        }
+        ++total;
+    }
+    for (; iovcnt > 0; ++iov, --iovcnt) {
+        const alt_u8 *src = (const alt_u8 *)iov->base;
+        int seg_len = iov->len;
+        len -= seg_len;
+        if (packetize && (seg_len > 0) && (len == 0)) {
+            // Last byte will be encoded after EOP
+            total += encode_escaped(dest ? dest + total : NULL, src, seg_len - 1);
+            if (dest) {
+                dest[total] = AST_EOP_PREFIX;
+            }
+            ++total;
+            total += encode_escaped(dest ? dest + total : NULL, src + seg_len - 1, 1);
+            break;
+        }
+        total += encode_escaped(dest ? dest + total : NULL, src, seg_len);
+    }
+    return total;
+}
+
+/**
+ * @func pick_frame
+ * @brief Select frame to be written next
+ * @return Frame (or NULL if queue is empty)
+ * @note Frame interrupted at unsafe point must be finished first.
+ *       Otherwise the oldest frame of the highest priority is selected.
+ *       Caller must hold link->lock.
+ */
+static hostbridge_tx_frame *pick_frame(hostbridge_link *link)
+{
+    hostbridge_tx_frame *frame;
+    hostbridge_tx_frame *best;
+
+    if (link->tx_current) {
+        return link->tx_current;
+    }
+    best = link->tx_head;
+    for (frame = best; frame; frame = frame->next) {
+        if (frame->channel->priority > best->channel->priority) {
+            best = frame;
+        }
+    }
+    return best;
+}
+
+/**
+ * @func preempt_pending
+ * @brief Check if frame with higher priority is waiting
+ * @note Caller must hold link->lock.
+ */
+static int preempt_pending(hostbridge_link *link, hostbridge_tx_frame *current)
+{
+    hostbridge_tx_frame *frame;
+
+    for (frame = link->tx_head; frame; frame = frame->next) {
+        if (frame->channel->priority > current->channel->priority) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @func remove_frame
+ * @brief Remove frame from queue
+ * @note Caller must hold link->lock.
+ */
+static void remove_frame(hostbridge_link *link, hostbridge_tx_frame *frame)
+{
+    hostbridge_tx_frame **ref;
+    hostbridge_tx_frame *prev = NULL;
+
+    for (ref = &link->tx_head; *ref != frame; ref = &(*ref)->next) {
+        prev = *ref;
+    }
+    *ref = frame->next;
+    if (link->tx_tail == frame) {
+        link->tx_tail = prev;
+    }
+    --link->tx_queued;
+    HOSTBRIDGE_TELEMETRY_ADD(hb_tx_queued, -1);
+}
+
+/**
+ * @func flush_to_host
+ * @brief Write queued frames to host
+ * @param link Link to write
+ * @note Without receiver thread, this returns when UART cannot accept more data.
+ *       Frame is written in chunks of PREEMPT_CHUNK bytes, and may be suspended
+ *       between chunks (never inside escape sequence, just after EOP or inside
+ *       frame of blocks) so that frames of higher priority channels go out
+ *       first. Channel prefix is written again when suspended frame is resumed.
+ */
+static void flush_to_host(hostbridge_link *link)
+{
+    hostbridge_tx_frame *frame;
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD
+    alt_u32 blocked_since = 0;
+#endif
+
+    for (;;) {
+        int result;
+
+        // Only one flusher writes frames at a time
+        ALT_SEM_PEND(link->tx_lock, 0);
+        ALT_SEM_PEND(link->lock, 0);
+        frame = pick_frame(link);
+        ALT_SEM_POST(link->lock);
+        if (!frame) {
+            ALT_SEM_POST(link->tx_lock);
+            return;
+        }
+
+        link->tx_error = 0;
+        if (frame->written < 0) {
+            write_channel_prefix(link, frame->channel->number, frame->flags);
+            frame->written = 0;
+        } else {
+            // Resume after other frames
+            write_channel_prefix(link, frame->channel->number, 0);
+        }
+        while ((frame->written < frame->len) && !link->tx_error) {
+            int chunk = frame->len - frame->written;
+            int written;
+            if (chunk > PREEMPT_CHUNK) {
+                chunk = PREEMPT_CHUNK;
+            }
+            written = write_to_host_once(link, frame->data + frame->written, chunk);
+            if (written > 0) {
+                alt_u8 last;
+                int unsafe;
+                frame->written += written;
+                last = frame->data[frame->written - 1];
+                if (FRAME_UNBREAKABLE(frame)) {
+                    // Block payload may contain any byte
+                    unsafe = (frame->written < frame->len);
+                } else {
+                    unsafe = (last == AST_ESCAPE_PREFIX) || (last == AST_EOP_PREFIX);
+                }
+                if (unsafe) {
+                    // Unsafe point to switch channels
+                    link->tx_current = frame;
+                    continue;
+                }
+                link->tx_current = NULL;
+                if (frame->written < frame->len) {
+                    int preempt;
+                    ALT_SEM_PEND(link->lock, 0);
+                    preempt = preempt_pending(link, frame);
+                    ALT_SEM_POST(link->lock);
+                    if (preempt) {
+                        break;
+                    }
+                }
+                continue;
+            }
+            if (written < 0) {
+                // Give up this frame
+                link->tx_error = written;
+                break;
+            }
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD
+            COUNT_BLOCKED(&blocked_since, 1);
+            YIELD();
+#else
+            ALT_SEM_POST(link->tx_lock);
+            return;
+#endif
+        }
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD
+        COUNT_BLOCKED(&blocked_since, 0);
+        (void)blocked_since;
+#endif
+        result = link->tx_error;
+        if (result < 0) {
+            // Host may have lost channel prefix and frame boundary
+            link->tx_current = NULL;
+            link->source_channel_number = -1;
+        } else if (frame->written < frame->len) {
+            // Preempted
+            ALT_SEM_POST(link->tx_lock);
+            continue;
+        }
+
+        ALT_SEM_PEND(link->lock, 0);
+        remove_frame(link, frame);
+        ALT_SEM_POST(link->lock);
+        ALT_SEM_POST(link->tx_lock);
+
+        if (frame->callback) {
+            (*frame->callback)(frame->channel, frame->context, result);
+        }
+        free(frame);
+    }
+}
+
+/**
+ * @func queue_to_host
+ * @brief Encode data and queue it for transmission
+ * @note Waits for free entry in queue unless HOSTBRIDGE_GEN2_SOURCE_NONBLOCK is specified
+ */
+static int queue_to_host(hostbridge_channel *channel, const hostbridge_iovec *iov, int iovcnt, int len, int flags, hostbridge_source_callback callback, void *context)
+{
+    hostbridge_link *link = &state.links[channel->link];
+    hostbridge_tx_frame *frame;
+    int block = BLOCK_FRAMED(channel);
+    int encoded_len;
+
+    encoded_len = encode_payload(NULL, channel, iov, iovcnt, len, flags, block);
+    frame = (hostbridge_tx_frame *)malloc(sizeof(*frame) + encoded_len);
+    if (!frame) {
+        return -ENOMEM;
+    }
+    encode_payload(frame->data, channel, iov, iovcnt, len, flags, block);
+    HOSTBRIDGE_GEN2_STATS_ADD(channel, tx_encoded, encoded_len);
+    frame->next = NULL;
+    frame->channel = channel;
+    frame->callback = callback;
+    frame->context = context;
+    frame->flags = flags;
+    frame->len = encoded_len;
+    frame->written = -1;
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_BLOCK_FRAMING
+    frame->unbreakable = block;
+#endif
+
+    for (;;) {
+        ALT_SEM_PEND(link->lock, 0);
+        if (link->tx_queued < PERIDOT_SW_HOSTBRIDGE_GEN2_TX_QUEUE_DEPTH) {
+            break;
+        }
+        ALT_SEM_POST(link->lock);
+        if (flags & HOSTBRIDGE_GEN2_SOURCE_NONBLOCK) {
+            free(frame);
+            return -EWOULDBLOCK;
+        }
+#ifndef PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD
+        flush_to_host(link);
+#endif
+        YIELD();
+    }
+
+    if (link->tx_tail) {
+        link->tx_tail->next = frame;
+    } else {
+        link->tx_head = frame;
+    }
+    link->tx_tail = frame;
+    ++link->tx_queued;
+    HOSTBRIDGE_TELEMETRY_ADD(hb_tx_queued, 1);
+    ALT_SEM_POST(link->lock);
+
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD
+    sem_post(&link->tx_sem);
+#endif
+    return 0;
+}
+#endif  /* PERIDOT_SW_HOSTBRIDGE_GEN2_TX_QUEUE_DEPTH > 0 */
+
+/**
+ * @func transmit_iov
+ * @brief Encode vector and write (or queue) it to host
+ */
+static int transmit_iov(hostbridge_channel *channel, const hostbridge_iovec *iov, int iovcnt, int len, int flags, hostbridge_source_callback callback, void *context)
+{
+#if (PERIDOT_SW_HOSTBRIDGE_GEN2_TX_QUEUE_DEPTH > 0)
+    return queue_to_host(channel, iov, iovcnt, len, flags, callback, context);
+#else
+    hostbridge_link *link = &state.links[channel->link];
+    int packetize = (flags & HOSTBRIDGE_GEN2_SOURCE_PACKETIZED) ? 1 : 0;
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_STATISTICS
+    alt_u32 tx_start;
+#endif
+    int result;
+    ALT_SEM_PEND(link->lock, 0);
+
+    link->tx_error = 0;
+    write_channel_prefix(link, channel->number, flags);
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_STATISTICS
+    tx_start = link->tx_bytes;
+#endif
+
+    if (channel->packetized && !packetize) {
+        for (; iovcnt > 0; ++iov, --iovcnt) {
+            write_to_host(link, iov->base, iov->len);
+        }
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_BLOCK_FRAMING
+    } else if (channel->block_framed) {
+        encode_blocks(link, NULL, iov, len);
+#endif
+    } else if (len > 0) {
+        alt_u8 buffer[WRITE_BUFFER_LEN + 2];
+        int buffered = 0;
+        if (packetize) {
+            buffer[buffered++] = AST_SOP;
+        }
+        for (; iovcnt > 0; ++iov, --iovcnt) {
+            const alt_u8 *src = (const alt_u8 *)iov->base;
+            int seg_len = iov->len;
+            len -= seg_len;
+            if (packetize && (seg_len > 0) && (len == 0)) {
+                // Last byte will be written after EOP
+                buffered = write_escaped_to_host(link, buffer, buffered, src, seg_len - 1);
+                buffer[buffered++] = AST_EOP_PREFIX;
+                buffered = write_escaped_to_host(link, buffer, buffered, src + seg_len - 1, 1);
+                break;
+            }
+            buffered = write_escaped_to_host(link, buffer, buffered, src, seg_len);
+        }
+        if (buffered > 0) {
+            write_to_host(link, buffer, buffered);
+        }
+    }
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_STATISTICS
+    channel->stats.tx_encoded += link->tx_bytes - tx_start;
+#endif
+    result = link->tx_error;
+    if (result < 0) {
+        // Host may have lost channel prefix
+        link->source_channel_number = -1;
+    }
+
+    ALT_SEM_POST(link->lock);
+
+    if (callback) {
+        (*callback)(channel, context, result);
+    }
+    return result;
+#endif
+}
+
+#if (PERIDOT_SW_HOSTBRIDGE_GEN2_COALESCE_SIZE > 0)
+/**
+ * @func flush_coalesced_channel
+ * @brief Send small writes buffered for channel
+ * @param link Link of channel
+ * @param channel Channel with buffered data
+ * @note Caller must hold link->coalesce_lock.
+ */
+static void flush_coalesced_channel(hostbridge_link *link, hostbridge_channel *channel)
+{
+    hostbridge_channel **prev;
+    hostbridge_iovec iov;
+
+    for (prev = &link->coalesce_first; *prev; prev = &(*prev)->coalesce_next) {
+        if (*prev == channel) {
+            *prev = channel->coalesce_next;
+            break;
+        }
+    }
+    iov.base = channel->coalesce_buffer;
+    iov.len = channel->coalesced;
+    transmit_iov(channel, &iov, 1, iov.len, 0, NULL, NULL);
+    // Cleared after transmission so that coalesce_iov() of other thread
+    // waits for the lock instead of sending its data before these bytes
+    channel->coalesced = 0;
+}
+
+/**
+ * @func flush_coalesced
+ * @brief Send small writes buffered for all channels of link
+ * @param link Link
+ * @param force Non-zero to send them before coalesce_ms passes
+ */
+static void flush_coalesced(hostbridge_link *link, int force)
+{
+    ALT_SEM_PEND(link->coalesce_lock, 0);
+    if (link->coalesce_first && (force ||
+        ((alt_nticks() - link->coalesce_since) >=
+         ((alt_u32)PERIDOT_SW_HOSTBRIDGE_GEN2_COALESCE_MS * alt_ticks_per_second() / 1000)))) {
+        while (link->coalesce_first) {
+            flush_coalesced_channel(link, link->coalesce_first);
+        }
+    }
+    ALT_SEM_POST(link->coalesce_lock);
+}
+
+/**
+ * @func coalesce_iov
+ * @brief Buffer small non-packetized write to send it later in a burst
+ * @return Non-zero if data is buffered. Otherwise, data must be transmitted
+ *         by caller (data buffered before for the channel has been sent).
+ */
+static int coalesce_iov(hostbridge_channel *channel, const hostbridge_iovec *iov, int iovcnt, int len, int flags, hostbridge_source_callback callback)
+{
+    hostbridge_link *link = &state.links[channel->link];
+    int small = (len > 0) && (len < PERIDOT_SW_HOSTBRIDGE_GEN2_COALESCE_SIZE) && !callback &&
+                !channel->packetized && !(flags & (HOSTBRIDGE_GEN2_SOURCE_PACKETIZED | HOSTBRIDGE_GEN2_SOURCE_RESET));
+    int buffered = 0;
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD
+    int no_alarm = 0;
+#endif
+
+    if (!small && (channel->coalesced == 0)) {
+        // Nothing buffered nor being flushed (cleared after flush completes)
+        return 0;
+    }
+
+    ALT_SEM_PEND(link->coalesce_lock, 0);
+    if ((channel->coalesced > 0) && (!small || ((channel->coalesced + len) > PERIDOT_SW_HOSTBRIDGE_GEN2_COALESCE_SIZE))) {
+        flush_coalesced_channel(link, channel);
+    }
+    if (small && !channel->coalesce_buffer) {
+        channel->coalesce_buffer = (alt_u8 *)malloc(PERIDOT_SW_HOSTBRIDGE_GEN2_COALESCE_SIZE);
+    }
+    if (small && channel->coalesce_buffer) {
+        if (channel->coalesced == 0) {
+            if (!link->coalesce_first) {
+                link->coalesce_since = alt_nticks();
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD
+                if (!link->coalesce_alarm_active) {
+                    alt_u32 ticks = (alt_u32)PERIDOT_SW_HOSTBRIDGE_GEN2_COALESCE_MS * alt_ticks_per_second() / 1000;
+                    link->coalesce_alarm_active = 1;
+                    if (alt_alarm_start(&link->coalesce_alarm, ticks ? ticks : 1, coalesce_alarm, link) < 0) {
+                        link->coalesce_alarm_active = 0;
+                        no_alarm = 1;
+                    }
+                }
+#endif
+            }
+            channel->coalesce_next = link->coalesce_first;
+            link->coalesce_first = channel;
+        }
+        for (; iovcnt > 0; ++iov, --iovcnt) {
+            memcpy(channel->coalesce_buffer + channel->coalesced, iov->base, iov->len);
+            channel->coalesced += iov->len;
+        }
+        buffered = 1;
+    }
+    ALT_SEM_POST(link->coalesce_lock);
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD
+    if (no_alarm) {
+        // No system timer => Send now
+        sem_post(&link->coalesce_sem);
+    }
+#endif
+    return buffered;
+}
+#endif  /* PERIDOT_SW_HOSTBRIDGE_GEN2_COALESCE_SIZE > 0 */
+
+/**
+ * @func frame_iov
+ * @brief Add reliable framing (if enabled) and transmit vector
+ */
+static int frame_iov(hostbridge_channel *channel, const hostbridge_iovec *iov, int iovcnt, int len, int flags, hostbridge_source_callback callback, void *context)
+{
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_RELIABLE
+    if (channel->reliable && (len > 0) && (flags & HOSTBRIDGE_GEN2_SOURCE_PACKETIZED)) {
+        hostbridge_iovec frame;
+        const alt_u8 *ptr;
+        int result;
+        result = peridot_sw_hostbridge_gen2_rel_encode(channel, iov, iovcnt, len, &ptr);
+        if (result < 0) {
+            return result;
+        }
+        frame.base = ptr;
+        frame.len = result;
+        result = transmit_iov(channel, &frame, 1, frame.len, flags, callback, context);
+        peridot_sw_hostbridge_gen2_rel_release();
+        return result;
+    }
+#endif
+    return transmit_iov(channel, iov, iovcnt, len, flags, callback, context);
+}
+
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_RELIABLE
+/**
+ * @func transmit_frame
+ * @brief Send packet already framed (used for retransmission)
+ * @param channel Source channel
+ * @param ptr Pointer to framed packet
+ * @param len Length of framed packet
+ */
+static int transmit_frame(hostbridge_channel *channel, const void *ptr, int len)
+{
+    hostbridge_iovec frame;
+
+    frame.base = ptr;
+    frame.len = len;
+    return transmit_iov(channel, &frame, 1, len, HOSTBRIDGE_GEN2_SOURCE_PACKETIZED, NULL, NULL);
+}
+#endif
+
+/**
+ * @func source_iov
+ * @brief Write vector from channel as one transfer
+ */
+static int source_iov(hostbridge_channel *channel, const hostbridge_iovec *iov, int iovcnt, int flags, hostbridge_source_callback callback, void *context)
+{
+    int len = measure_iov(iov, iovcnt);
+
+    if (len < 0) {
+        return len;
+    }
+    if (!state.links[channel->link].started) {
+        // Transport of link is not given yet
+        return -ENOTCONN;
+    }
+    HOSTBRIDGE_GEN2_STATS_ADD(channel, tx_bytes, len);
+    if ((len > 0) && (flags & HOSTBRIDGE_GEN2_SOURCE_PACKETIZED)) {
+        HOSTBRIDGE_GEN2_STATS_ADD(channel, tx_packets, 1);
+    }
+#if (PERIDOT_SW_HOSTBRIDGE_GEN2_COALESCE_SIZE > 0)
+    if (coalesce_iov(channel, iov, iovcnt, len, flags, callback)) {
+        return 0;
+    }
+#endif
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_COMPRESSION
+    if (channel->compressed && (len > 0) && (flags & HOSTBRIDGE_GEN2_SOURCE_PACKETIZED)) {
+        hostbridge_iovec *lz_iov;
+        int result;
+        iovcnt = peridot_sw_hostbridge_gen2_lz_encode(iov, iovcnt, len, &lz_iov);
+        if (iovcnt < 0) {
+            return iovcnt;
+        }
+        result = frame_iov(channel, lz_iov, iovcnt, measure_iov(lz_iov, iovcnt), flags, callback, context);
+        peridot_sw_hostbridge_gen2_lz_release(lz_iov);
+        return result;
+    }
+#endif
+    return frame_iov(channel, iov, iovcnt, len, flags, callback, context);
+}
+
+/**
+ * @func peridot_sw_hostbridge_gen2_source
+ * @brief Write data from channel
+ * @param channel Source channel
+ * @param ptr Pointer to buffer
+ * @param len Length of buffer
+ */
+int peridot_sw_hostbridge_gen2_source(hostbridge_channel *channel, const void *ptr, int len, int flags)
+{
+    return peridot_sw_hostbridge_gen2_source_async(channel, ptr, len, flags, NULL, NULL);
+}
+
+/**
+ * @func peridot_sw_hostbridge_gen2_source_async
+ * @brief Write data from channel with completion callback
+ * @param channel Source channel
+ * @param ptr Pointer to buffer (can be reused after this function returns)
+ * @param len Length of buffer
+ * @param callback Function called when all data is written to host (can be NULL)
+ *                 with result of zero, or negative errno if transport failed
+ * @param context User data passed to callback
+ * @note With TX queue, this returns when the data is queued.
+ */
+int peridot_sw_hostbridge_gen2_source_async(hostbridge_channel *channel, const void *ptr, int len, int flags, hostbridge_source_callback callback, void *context)
+{
+    hostbridge_iovec iov;
+
+    iov.base = ptr;
+    iov.len = len;
+    return source_iov(channel, &iov, 1, flags, callback, context);
+}
+
+/**
+ * @func peridot_sw_hostbridge_gen2_sourcev
+ * @brief Write multiple buffers from channel as one transfer
+ * @param channel Source channel
+ * @param iov Array of segments (written in order)
+ * @param iovcnt Number of segments
+ * @note With HOSTBRIDGE_GEN2_SOURCE_PACKETIZED, all segments form one packet.
+ */
+int peridot_sw_hostbridge_gen2_sourcev(hostbridge_channel *channel, const hostbridge_iovec *iov, int iovcnt, int flags)
+{
+    return source_iov(channel, iov, iovcnt, flags, NULL, NULL);
+}
+
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_STATISTICS
+/**
+ * @func peridot_sw_hostbridge_gen2_get_link_stats
+ * @brief Get statistics of whole link
+ * @param stats Pointer to store statistics
+ */
+void peridot_sw_hostbridge_gen2_get_link_stats(hostbridge_link_stats *stats)
+{
+    memcpy(stats, &state.link_stats, sizeof(*stats));
+}
+
+/**
+ * @func peridot_sw_hostbridge_gen2_get_channel_stats
+ * @brief Get statistics of channel
+ * @param number Channel number
+ * @param stats Pointer to store statistics
+ * @return 0 on success, -ENOENT if channel is not registered
+ */
+int peridot_sw_hostbridge_gen2_get_channel_stats(alt_u8 number, hostbridge_channel_stats *stats)
+{
+    hostbridge_channel *channel = find_channel(number);
+
+    if (!channel) {
+        return -ENOENT;
+    }
+    memcpy(stats, &channel->stats, sizeof(*stats));
+    return 0;
+}
+#endif  /* PERIDOT_SW_HOSTBRIDGE_GEN2_STATISTICS */
+
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_COMPRESSION
+/**
+ * @func peridot_sw_hostbridge_gen2_set_compression
+ * @brief Enable or disable compression of channel
+ * @param number Channel number
+ * @param enable Non-zero to enable
+ * @return 0 on success, -ENOENT if channel is not registered,
+ *         -EPERM if channel is not compressible
+ * @note This should be called while no packet is being transferred on the channel.
+ */
+int peridot_sw_hostbridge_gen2_set_compression(alt_u8 number, int enable)
+{
+    hostbridge_channel *channel = find_channel(number);
+
+    if (!channel) {
+        return -ENOENT;
+    }
+    if (!channel->compressible || !channel->packetized) {
+        return -EPERM;
+    }
+    peridot_sw_hostbridge_gen2_lz_enable(channel, enable);
+    return 0;
+}
+#endif  /* PERIDOT_SW_HOSTBRIDGE_GEN2_COMPRESSION */
+
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_BLOCK_FRAMING
+/**
+ * @func peridot_sw_hostbridge_gen2_set_block_framing
+ * @brief Enable or disable block framing of channel
+ * @param number Channel number
+ * @param enable Non-zero to enable
+ * @return 0 on success, -ENOENT if channel is not registered,
+ *         -EPERM if channel is packetized
+ * @note Host must not send blocks to the channel until this returns.
+ *       Data already queued for host keeps its framing.
+ */
+int peridot_sw_hostbridge_gen2_set_block_framing(alt_u8 number, int enable)
+{
+    hostbridge_channel *channel = find_channel(number);
+    hostbridge_link *link;
+
+    if (!channel) {
+        return -ENOENT;
+    }
+    if (channel->packetized) {
+        return -EPERM;
+    }
+    link = &state.links[channel->link];
+    ALT_SEM_PEND(link->lock, 0);
+    channel->block_framed = enable ? 1 : 0;
+    ALT_SEM_POST(link->lock);
     return 0;
 }
+#endif  /* PERIDOT_SW_HOSTBRIDGE_GEN2_BLOCK_FRAMING */
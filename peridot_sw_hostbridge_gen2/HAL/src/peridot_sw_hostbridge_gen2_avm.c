@@ -1,10 +1,15 @@
 #include "peridot_sw_hostbridge_gen2.h"
+#include <errno.h>
+#include <malloc.h>
+#include <string.h>
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_TELEMETRY
+# include "sys/alt_alarm.h"
+#endif
 
 #define AST_CHANNEL_AVM     0x00
 
 #define AVM_READABLE_BASE   0x10000000
 #define AVM_READABLE_SPAN   16
-#define AVM_READABLE_END    (AVM_READABLE_BASE + AVM_READABLE_SPAN)
 
 enum {
     AVM_OFFSET_INIT = 0,
@@ -20,16 +25,45 @@ struct peridot_sw_hostbridge_gen2_avm_state_s {
     alt_u8 eop_prefix;
     alt_u8 inside_packet;
     alt_u8 offset;
+    alt_u8 incrementing;
     union {
         alt_u8 u8[8];
         alt_u16 u16[4];
         alt_u32 u32[2];
     } buffer;
+    volatile alt_u8 *write_ptr;     // NULL if write is not permitted
+    alt_u16 write_remain;
+    alt_u16 write_count;
+    hostbridge_avm_window *first;
+    hostbridge_avm_window readable;
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_TELEMETRY
+    hostbridge_avm_window telemetry;
+#endif
 } peridot_sw_hostbridge_gen2_avm_state __attribute__((weak));
 
 static struct peridot_sw_hostbridge_gen2_avm_state_s state
 __attribute__((alias("peridot_sw_hostbridge_gen2_avm_state")));
 
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_TELEMETRY
+volatile hostbridge_telemetry peridot_sw_hostbridge_gen2_telemetry = {
+    .magic = HOSTBRIDGE_TELEMETRY_MAGIC,
+    .version = HOSTBRIDGE_TELEMETRY_VERSION,
+    .size = sizeof(hostbridge_telemetry),
+};
+
+/**
+ * @func refresh_telemetry
+ * @brief Update members of telemetry block which are not counted in place
+ */
+static void refresh_telemetry(void)
+{
+    struct mallinfo info = mallinfo();
+
+    peridot_sw_hostbridge_gen2_telemetry.heap_used = info.uordblks;
+    peridot_sw_hostbridge_gen2_telemetry.ticks = alt_nticks();
+}
+#endif  /* PERIDOT_SW_HOSTBRIDGE_GEN2_TELEMETRY */
+
 inline static alt_u16 SWAP16(alt_u16 x)
 {
     return (x >> 8) | (x << 8);
@@ -40,15 +74,120 @@ inline static alt_u32 SWAP32(alt_u32 x)
     return (SWAP16(x) << 16) | SWAP16(x >> 16);
 }
 
+/**
+ * @func find_window
+ * @brief Find window which contains whole range with required permission
+ * @param addr Start address (host side)
+ * @param size Length of range
+ * @param flags Required permission
+ * @return Pointer to local memory (NULL if not accessible)
+ */
+static volatile alt_u8 *find_window(alt_u32 addr, alt_u32 size, int flags)
+{
+    hostbridge_avm_window *window;
+
+    for (window = state.first; window; window = window->next) {
+        if ((addr < window->base) || ((addr - window->base) >= window->span)) {
+            continue;
+        }
+        if (((window->flags & flags) != flags) || (size > (window->span - (addr - window->base)))) {
+            return NULL;
+        }
+        return (volatile alt_u8 *)window->ptr + (addr - window->base);
+    }
+    return NULL;
+}
+
+/**
+ * @func avm_read
+ * @brief Reply read transaction
+ * @param flags Flags for source function
+ * @note Denied read returns 1 byte zero
+ */
+static void avm_read(int flags)
+{
+    alt_u32 addr = SWAP32(state.buffer.u32[1]);
+    alt_u16 size = SWAP16(state.buffer.u16[1]);
+    volatile alt_u8 *ptr = find_window(addr, state.incrementing ? size : 1, HOSTBRIDGE_AVM_READ);
+    alt_u8 *data;
+    int i;
+
+    if (!ptr) {
+        // Out of range or not permitted
+        peridot_sw_hostbridge_gen2_source(&state.channel, "", 1, flags);
+        return;
+    }
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_TELEMETRY
+    if ((addr - PERIDOT_SW_HOSTBRIDGE_GEN2_TELEMETRY_BASE) < sizeof(hostbridge_telemetry)) {
+        refresh_telemetry();
+    }
+#endif
+    if (state.incrementing) {
+        peridot_sw_hostbridge_gen2_source(&state.channel, (const void *)ptr, size, flags);
+        return;
+    }
+
+    // Non-incrementing read (read same address repeatedly)
+    data = (alt_u8 *)malloc(size > 0 ? size : 1);
+    if (!data) {
+        peridot_sw_hostbridge_gen2_source(&state.channel, "", 1, flags);
+        return;
+    }
+    for (i = 0; i < size; ++i) {
+        data[i] = *ptr;
+    }
+    peridot_sw_hostbridge_gen2_source(&state.channel, data, size, flags);
+    free(data);
+}
+
+/**
+ * @func avm_write_data
+ * @brief Store run of write data bytes
+ * @param src Pointer to unescaped bytes
+ * @param len Number of bytes
+ */
+static void avm_write_data(const alt_u8 *src, int len)
+{
+    if (len > state.write_remain) {
+        // Excess data => Ignore
+        len = state.write_remain;
+    }
+    if (!state.write_ptr) {
+        return;
+    }
+    state.write_remain -= len;
+    state.write_count += len;
+    if (state.incrementing) {
+        while (len-- > 0) {
+            *state.write_ptr++ = *src++;
+        }
+    } else {
+        while (len-- > 0) {
+            *state.write_ptr = *src++;
+        }
+    }
+}
+
 static int avm_sink(hostbridge_channel *channel, const void *ptr, int len)
 {
     const alt_u8 *src = (const alt_u8 *)ptr;
-    int read_len = 0;
+    const alt_u8 *end = src + len;
 
-    while (read_len < len) {
+    while (src < end) {
         int flags = HOSTBRIDGE_GEN2_SOURCE_PACKETIZED;
-        alt_u8 byte = *src++;
-        ++read_len;
+        alt_u8 byte;
+        if ((state.offset == AVM_OFFSET_WRITE) && !state.escape_prefix && !state.eop_prefix) {
+            // Write data without special bytes is stored directly
+            const alt_u8 *run = src;
+            while ((src < end) && !AST_NEEDS_ESCAPE(*src)) {
+                ++src;
+            }
+            avm_write_data(run, src - run);
+            if (src == end) {
+                break;
+            }
+        }
+        byte = *src++;
         switch (byte) {
         case AST_SOP:
             state.offset = AVM_OFFSET_INIT;
@@ -71,16 +210,24 @@ static int avm_sink(hostbridge_channel *channel, const void *ptr, int len)
         }
         if (state.offset < AVM_OFFSET_FULL) {
             state.buffer.u8[state.offset++] = byte;
+        } else if (state.offset == AVM_OFFSET_WRITE) {
+            avm_write_data(&byte, 1);
         }
         if (state.offset == AVM_OFFSET_FULL) {
             switch (state.buffer.u8[0]) {
             case 0x00:  // Write, non-incrementing address
             case 0x04:  // Write, incrementing address
                 state.offset = AVM_OFFSET_WRITE;
+                state.incrementing = (state.buffer.u8[0] & 0x04) ? 1 : 0;
+                state.write_remain = SWAP16(state.buffer.u16[1]);
+                state.write_count = 0;
+                state.write_ptr = find_window(SWAP32(state.buffer.u32[1]),
+                        state.incrementing ? state.write_remain : 1, HOSTBRIDGE_AVM_WRITE);
                 break;
             case 0x10:  // Read, non-incrementing address
             case 0x14:  // Read, incrementing address
                 state.offset = AVM_OFFSET_READ;
+                state.incrementing = (state.buffer.u8[0] & 0x04) ? 1 : 0;
                 break;
             case 0x7f:  // No transaction
                 flags |= HOSTBRIDGE_GEN2_SOURCE_RESET;
@@ -95,24 +242,19 @@ static int avm_sink(hostbridge_channel *channel, const void *ptr, int len)
         }
         state.eop_prefix = 0;
         state.inside_packet = 0;
+        HOSTBRIDGE_GEN2_STATS_ADD(channel, rx_packets, 1);
         state.buffer.u8[0] ^= 0x80;
         state.buffer.u8[1] = 0x00;
         switch (state.offset) {
         case AVM_OFFSET_READ:
-            {
-                alt_u32 addr = SWAP32(state.buffer.u32[1]);
-                alt_u16 size = SWAP16(state.buffer.u16[1]);
-                if ((addr < AVM_READABLE_BASE) || ((addr + size) > AVM_READABLE_END)) {
-                    // Out of range (returns 1 byte zero)
-                    peridot_sw_hostbridge_gen2_source(channel, "", 1, flags);
-                } else {
-                    peridot_sw_hostbridge_gen2_source(channel, (const void *)addr, size, flags);
-                }
-            }
+            avm_read(flags);
             break;
         case AVM_OFFSET_WRITE:
-            // Write is not permitted
-            /* no break */
+            // Reply number of bytes written
+            state.offset = AVM_OFFSET_NOTR;
+            state.buffer.u16[1] = SWAP16(state.write_count);
+            peridot_sw_hostbridge_gen2_source(channel, &state.buffer, 4, flags);
+            break;
         default:
             // No transaction or others
             state.buffer.u16[1] = SWAP16(0);
@@ -124,10 +266,69 @@ static int avm_sink(hostbridge_channel *channel, const void *ptr, int len)
     return len;
 }
 
+/**
+ * @func peridot_sw_hostbridge_gen2_avm_register
+ * @brief Register memory window accessible from host over AVM channel
+ * @param window Window structure (must be kept valid after registration)
+ * @return 0 on success, -EINVAL for invalid window, -EEXIST if overlapped
+ */
+int peridot_sw_hostbridge_gen2_avm_register(hostbridge_avm_window *window)
+{
+    hostbridge_avm_window *other;
+
+    if ((window->span == 0) || ((window->base + (window->span - 1)) < window->base)) {
+        return -EINVAL;
+    }
+    for (other = state.first; other; other = other->next) {
+        if ((window->base - other->base < other->span) || (other->base - window->base < window->span)) {
+            return -EEXIST;
+        }
+    }
+    window->next = state.first;
+    state.first = window;
+    return 0;
+}
+
+/**
+ * @func peridot_sw_hostbridge_gen2_avm_find
+ * @brief Find registered window by name
+ * @param name Name of window
+ */
+hostbridge_avm_window *peridot_sw_hostbridge_gen2_avm_find(const char *name)
+{
+    hostbridge_avm_window *window;
+
+    for (window = state.first; window; window = window->next) {
+        if (window->name && (strcmp(window->name, name) == 0)) {
+            return window;
+        }
+    }
+    return NULL;
+}
+
 int peridot_sw_hostbridge_gen2_avm_init(void)
 {
     state.channel.dest.sink = avm_sink;
     state.channel.number = AST_CHANNEL_AVM;
     state.channel.packetized = 1;
+    state.channel.priority = HOSTBRIDGE_GEN2_PRIORITY_URGENT;
+
+    // Legacy read-only window
+    state.readable.name = "readable";
+    state.readable.base = AVM_READABLE_BASE;
+    state.readable.span = AVM_READABLE_SPAN;
+    state.readable.ptr = (void *)AVM_READABLE_BASE;
+    state.readable.flags = HOSTBRIDGE_AVM_READ;
+    peridot_sw_hostbridge_gen2_avm_register(&state.readable);
+
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_TELEMETRY
+    state.telemetry.name = "telemetry";
+    state.telemetry.base = PERIDOT_SW_HOSTBRIDGE_GEN2_TELEMETRY_BASE;
+    state.telemetry.span = sizeof(hostbridge_telemetry);
+    state.telemetry.ptr = (void *)&peridot_sw_hostbridge_gen2_telemetry;
+    state.telemetry.flags = HOSTBRIDGE_AVM_READ;
+    peridot_sw_hostbridge_gen2_avm_register(&state.telemetry);
+#endif
+
     return peridot_sw_hostbridge_gen2_register_channel(&state.channel);
 }
@@ -0,0 +1,181 @@
+/*
+ * Capture transport for hostbridge
+ *
+ * Wraps another transport and records every chunk read from / written to host
+ * into a file descriptor, so that the byte stream can be replayed later
+ * (see tools/hostbridge_replay.c).
+ *
+ * File format (little endian):
+ *   Header: "HBCP" [version (16-bit) = 1] [reserved (16-bit)] [ticks per second (32-bit)]
+ *   Record: [ticks (32-bit)] [length (16-bit)] [direction (8-bit)] [reserved (8-bit)] [data]
+ * Each record is written with single write() call, so that records from
+ * receiver and sender do not interleave.
+ * Capturing stops at the first failed (or partial) write() so that the file
+ * ends with complete records, and the error is kept in capture->error.
+ */
+#include "system.h"
+#include "peridot_sw_hostbridge_gen2.h"
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_TRANSPORT_POSIX
+# include <time.h>
+#else
+# include "sys/alt_alarm.h"
+#endif
+
+#define CAPTURE_VERSION             1
+#define CAPTURE_FILE_HEADER_LEN     12
+#define CAPTURE_RECORD_HEADER_LEN   8
+
+// Longer chunks are split into multiple records
+#define CAPTURE_RECORD_MAX  256
+
+static void put_u16(alt_u8 *dest, alt_u16 value)
+{
+    dest[0] = value;
+    dest[1] = value >> 8;
+}
+
+static void put_u32(alt_u8 *dest, alt_u32 value)
+{
+    put_u16(dest, value);
+    put_u16(dest + 2, value >> 16);
+}
+
+static alt_u32 capture_ticks(void)
+{
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_TRANSPORT_POSIX
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (alt_u32)ts.tv_sec * 1000000u + ts.tv_nsec / 1000;
+#else
+    return alt_nticks();
+#endif
+}
+
+static alt_u32 capture_ticks_per_second(void)
+{
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_TRANSPORT_POSIX
+    return 1000000;
+#else
+    return alt_ticks_per_second();
+#endif
+}
+
+/**
+ * @func put_file
+ * @brief Write data to capture file unless capturing has stopped
+ * @param capture Capture
+ * @param ptr Pointer to data
+ * @param len Length of data
+ * @return 0 on success, negative errno on error
+ */
+static int put_file(hostbridge_capture *capture, const void *ptr, int len)
+{
+    int result;
+
+    if (capture->error < 0) {
+        return capture->error;
+    }
+    result = write(capture->fd, ptr, len);
+    if (result != len) {
+        // Partial record would break the file => Stop capturing
+        capture->error = (result < 0) ? -errno : -EIO;
+        return capture->error;
+    }
+    return 0;
+}
+
+/**
+ * @func put_records
+ * @brief Write records for a chunk of byte stream
+ * @param capture Capture
+ * @param direction HOSTBRIDGE_GEN2_CAPTURE_RX or HOSTBRIDGE_GEN2_CAPTURE_TX
+ * @param ptr Pointer to data
+ * @param len Length of data
+ */
+static void put_records(hostbridge_capture *capture, int direction, const void *ptr, int len)
+{
+    alt_u8 record[CAPTURE_RECORD_HEADER_LEN + CAPTURE_RECORD_MAX];
+    const alt_u8 *src = (const alt_u8 *)ptr;
+    alt_u32 ticks = capture_ticks();
+
+    while (len > 0) {
+        int chunk = (len > CAPTURE_RECORD_MAX) ? CAPTURE_RECORD_MAX : len;
+        put_u32(record, ticks);
+        put_u16(record + 4, chunk);
+        record[6] = direction;
+        record[7] = 0;
+        memcpy(record + CAPTURE_RECORD_HEADER_LEN, src, chunk);
+        if (put_file(capture, record, CAPTURE_RECORD_HEADER_LEN + chunk) < 0) {
+            break;
+        }
+        src += chunk;
+        len -= chunk;
+    }
+}
+
+static int capture_open(hostbridge_transport *transport, int nonblock)
+{
+    hostbridge_capture *capture = (hostbridge_capture *)transport;
+    alt_u8 header[CAPTURE_FILE_HEADER_LEN];
+    int result;
+
+    result = (*capture->inner->open)(capture->inner, nonblock);
+    if (result < 0) {
+        return result;
+    }
+    transport->nonblock = nonblock;
+
+    memcpy(header, "HBCP", 4);
+    put_u16(header + 4, CAPTURE_VERSION);
+    put_u16(header + 6, 0);
+    put_u32(header + 8, capture_ticks_per_second());
+    put_file(capture, header, sizeof(header));
+    return result;
+}
+
+static int capture_read(hostbridge_transport *transport, void *ptr, int len)
+{
+    hostbridge_capture *capture = (hostbridge_capture *)transport;
+    int result = (*capture->inner->read)(capture->inner, ptr, len);
+
+    if (result > 0) {
+        put_records(capture, HOSTBRIDGE_GEN2_CAPTURE_RX, ptr, result);
+    }
+    return result;
+}
+
+static int capture_write(hostbridge_transport *transport, const void *ptr, int len)
+{
+    hostbridge_capture *capture = (hostbridge_capture *)transport;
+    int result = (*capture->inner->write)(capture->inner, ptr, len);
+
+    if (result > 0) {
+        put_records(capture, HOSTBRIDGE_GEN2_CAPTURE_TX, ptr, result);
+    }
+    return result;
+}
+
+/**
+ * @func peridot_sw_hostbridge_gen2_capture
+ * @brief Initialize capture transport
+ * @param capture Capture to initialize (pass &capture->transport to
+ *                peridot_sw_hostbridge_gen2_set_transport())
+ * @param inner Transport actually connected to host
+ * @param fd File descriptor to write records
+ */
+void peridot_sw_hostbridge_gen2_capture(hostbridge_capture *capture, hostbridge_transport *inner, int fd)
+{
+    capture->transport.open = capture_open;
+    capture->transport.read = capture_read;
+    capture->transport.write = capture_write;
+    capture->transport.fd = inner->fd;
+    capture->transport.nonblock = 0;
+    capture->transport.path = NULL;
+    capture->transport.notify_rx = inner->notify_rx;
+    capture->inner = inner;
+    capture->fd = fd;
+    capture->error = 0;
+}
@@ -0,0 +1,410 @@
+/*
+ * Direct UART driver for hostbridge (altera_avalon_uart registers)
+ *
+ * Takes over UART 'hostbridge' from HAL driver. Bytes from host are decoded
+ * in RX interrupt handler (channel switches, escapes and SOP/EOP of
+ * non-packetized channels) and appended to a ring of each registered channel,
+ * so that the service routine only passes ring contents to sinks.
+ * While the ring of current channel is full, RX interrupt is masked and the
+ * next byte is left in UART (RTS is also deasserted if UART has CTS/RTS) until
+ * the service routine drains rings, so that no byte is discarded by driver.
+ * Bytes to host are written from TX ring by TX interrupt handler.
+ *
+ * On Linux, tools/uart_model.c emulates the registers (see tools/hostbridge_replay.c).
+ */
+#include "system.h"
+#include "peridot_sw_hostbridge_gen2.h"
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_UART
+#include "altera_avalon_uart_regs.h"
+#include "sys/alt_irq.h"
+
+#ifndef HOSTBRIDGE_BASE
+# error "direct_uart requires altera_avalon_uart named 'hostbridge'!"
+#endif
+
+#ifndef PERIDOT_SW_HOSTBRIDGE_GEN2_CHANNELS
+# define PERIDOT_SW_HOSTBRIDGE_GEN2_CHANNELS    256
+#endif
+
+#ifndef PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_RX_RING
+# define PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_RX_RING  256
+#endif
+#ifndef PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_TX_RING
+# define PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_TX_RING  256
+#endif
+
+#define RX_RING_MASK    (PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_RX_RING - 1)
+#define TX_RING_MASK    (PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_TX_RING - 1)
+
+#if (PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_RX_RING & RX_RING_MASK) || \
+    (PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_RX_RING > 32768) || \
+    (PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_TX_RING & TX_RING_MASK) || \
+    (PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_TX_RING > 32768)
+# error "peridot_sw_hostbridge_gen2.direct_rx_ring and direct_tx_ring must be power of 2 (32768 or less)"
+#endif
+
+#ifdef __tinythreads__
+# include <sched.h>
+# define YIELD()    sched_yield()
+#else
+# define YIELD()    do { } while (0)
+#endif
+
+#define UART_STATUS_ERRORS \
+    (ALTERA_AVALON_UART_STATUS_PE_MSK | ALTERA_AVALON_UART_STATUS_FE_MSK | \
+     ALTERA_AVALON_UART_STATUS_BRK_MSK | ALTERA_AVALON_UART_STATUS_ROE_MSK)
+
+#if defined(HOSTBRIDGE_USE_CTS_RTS) && (HOSTBRIDGE_USE_CTS_RTS)
+# define UART_CONTROL_RX \
+    (ALTERA_AVALON_UART_CONTROL_RRDY_MSK | ALTERA_AVALON_UART_CONTROL_RTS_MSK)
+#else
+# define UART_CONTROL_RX    ALTERA_AVALON_UART_CONTROL_RRDY_MSK
+#endif
+
+/*
+ * Received data of channel (indices run freely and are masked on access)
+ */
+typedef struct hostbridge_direct_ring_s {
+    struct hostbridge_direct_ring_s *next;
+    hostbridge_channel *channel;
+    volatile alt_u16 head;      // Written by interrupt handler
+    volatile alt_u16 tail;      // Written by service routine
+    alt_u8 buffer[PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_RX_RING];
+} hostbridge_direct_ring;
+
+struct peridot_sw_hostbridge_gen2_direct_state_s {
+    hostbridge_direct_ring *rings[PERIDOT_SW_HOSTBRIDGE_GEN2_CHANNELS];
+    hostbridge_direct_ring *first;
+    // Decoder state (used only by interrupt handler)
+    hostbridge_direct_ring *sink;
+    alt_u8 channel_prefix;
+    alt_u8 escape_prefix;
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_BLOCK_FRAMING
+    alt_u8 block_header;
+    alt_u8 block_low;
+    alt_u16 block_remaining;
+#endif
+    volatile alt_u8 rx_stalled; // RX interrupt is masked because ring is full
+    volatile alt_u32 rx_bytes;
+    volatile alt_u32 rx_unrouted;
+    alt_u32 rx_bytes_reported;
+    alt_u32 rx_unrouted_reported;
+    // TX ring
+    volatile alt_u16 tx_head;   // Written by writer
+    volatile alt_u16 tx_tail;   // Written by interrupt handler
+    alt_u32 control;            // Shadow of control register
+    alt_u8 tx_buffer[PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_TX_RING];
+} peridot_sw_hostbridge_gen2_direct_state __attribute__((weak));
+
+static struct peridot_sw_hostbridge_gen2_direct_state_s state
+__attribute__((alias("peridot_sw_hostbridge_gen2_direct_state")));
+
+/**
+ * @func sink_full
+ * @brief Check if ring of current channel has no space
+ * @note Checked before reading each byte, because the byte may be appended.
+ */
+static int sink_full(void)
+{
+    hostbridge_direct_ring *ring = state.sink;
+
+    return ring && ((alt_u16)(ring->head - ring->tail) >= PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_RX_RING);
+}
+
+/**
+ * @func put_byte
+ * @brief Append decoded byte to ring of current channel
+ * @note Ring has space (checked by sink_full() before reading byte).
+ */
+static void put_byte(alt_u8 byte)
+{
+    hostbridge_direct_ring *ring = state.sink;
+
+    if (!ring) {
+        ++state.rx_unrouted;
+        return;
+    }
+    ring->buffer[ring->head & RX_RING_MASK] = byte;
+    ++ring->head;
+}
+
+/**
+ * @func decode_byte
+ * @brief Decode a byte from host
+ * @note Same rules as decode_from_host() in peridot_sw_hostbridge_gen2.c.
+ *       Bytes for packetized channels are stored as they are (except channel
+ *       switches) because their sinks parse packets by themselves.
+ */
+static void decode_byte(alt_u8 byte)
+{
+    hostbridge_direct_ring *ring = state.sink;
+
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_BLOCK_FRAMING
+    if (state.block_remaining > 0) {
+        // Payload of block (including special bytes)
+        --state.block_remaining;
+        put_byte(byte);
+        return;
+    }
+#endif
+    if (state.channel_prefix) {
+        // Channel number (may be escaped)
+        if (byte == AST_ESCAPE_PREFIX) {
+            state.escape_prefix = 1;
+            return;
+        }
+        if (state.escape_prefix) {
+            byte ^= AST_ESCAPE_XOR;
+            state.escape_prefix = 0;
+        }
+#if (PERIDOT_SW_HOSTBRIDGE_GEN2_CHANNELS < 256)
+        state.sink = (byte < PERIDOT_SW_HOSTBRIDGE_GEN2_CHANNELS) ? state.rings[byte] : NULL;
+#else
+        state.sink = state.rings[byte];
+#endif
+        state.channel_prefix = 0;
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_BLOCK_FRAMING
+        state.block_header = 0;
+#endif
+        return;
+    }
+    if (byte == AST_CHANNEL_PREFIX) {
+        state.channel_prefix = 1;
+        return;
+    }
+    if (ring && ring->channel->packetized) {
+        put_byte(byte);
+        return;
+    }
+    if (state.escape_prefix) {
+        byte ^= AST_ESCAPE_XOR;
+        state.escape_prefix = 0;
+    } else if (byte == AST_ESCAPE_PREFIX) {
+        state.escape_prefix = 1;
+        return;
+    } else if (AST_NEEDS_ESCAPE(byte)) {
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_BLOCK_FRAMING
+        if ((byte == AST_SOP) && ring && ring->channel->block_framed) {
+            state.block_header = 1;
+        }
+#endif
+        // Drop special bytes (SOP and EOP)
+        return;
+    }
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_BLOCK_FRAMING
+    if (state.block_header == 1) {
+        state.block_low = byte;
+        state.block_header = 2;
+        return;
+    }
+    if (state.block_header == 2) {
+        state.block_remaining = state.block_low | (byte << 8);
+        state.block_header = 0;
+        return;
+    }
+#endif
+    put_byte(byte);
+}
+
+/**
+ * @func direct_irq
+ * @brief Interrupt handler of UART
+ */
+#ifdef ALT_ENHANCED_INTERRUPT_API_PRESENT
+static void direct_irq(void *context)
+#else
+static void direct_irq(void *context, alt_u32 id)
+#endif
+{
+    alt_u32 status = IORD_ALTERA_AVALON_UART_STATUS(HOSTBRIDGE_BASE);
+    int received = 0;
+
+    if (status & UART_STATUS_ERRORS) {
+        // Bytes lost by overrun are recovered by channel switches or SOP
+        IOWR_ALTERA_AVALON_UART_STATUS(HOSTBRIDGE_BASE, 0);
+    }
+    while ((status & ALTERA_AVALON_UART_STATUS_RRDY_MSK) && !state.rx_stalled) {
+        if (sink_full()) {
+            // Leave byte in UART until service routine drains rings
+            state.rx_stalled = 1;
+            state.control &= ~UART_CONTROL_RX;
+            IOWR_ALTERA_AVALON_UART_CONTROL(HOSTBRIDGE_BASE, state.control);
+            received = 1;
+            break;
+        }
+        decode_byte(IORD_ALTERA_AVALON_UART_RXDATA(HOSTBRIDGE_BASE));
+        ++state.rx_bytes;
+        received = 1;
+        status = IORD_ALTERA_AVALON_UART_STATUS(HOSTBRIDGE_BASE);
+    }
+
+    if (state.control & ALTERA_AVALON_UART_CONTROL_TRDY_MSK) {
+        while ((status & ALTERA_AVALON_UART_STATUS_TRDY_MSK) && (state.tx_tail != state.tx_head)) {
+            IOWR_ALTERA_AVALON_UART_TXDATA(HOSTBRIDGE_BASE, state.tx_buffer[state.tx_tail & TX_RING_MASK]);
+            ++state.tx_tail;
+            status = IORD_ALTERA_AVALON_UART_STATUS(HOSTBRIDGE_BASE);
+        }
+        if (state.tx_tail == state.tx_head) {
+            state.control &= ~ALTERA_AVALON_UART_CONTROL_TRDY_MSK;
+            IOWR_ALTERA_AVALON_UART_CONTROL(HOSTBRIDGE_BASE, state.control);
+        }
+    }
+
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_RX_EVENT
+    if (received) {
+        peridot_sw_hostbridge_gen2_notify_rx();
+    }
+#else
+    (void)received;
+#endif
+}
+
+/**
+ * @func direct_open
+ * @brief Take over UART from HAL driver and enable RX interrupt
+ */
+static int direct_open(hostbridge_transport *transport, int nonblock)
+{
+    transport->nonblock = nonblock;
+    state.control = UART_CONTROL_RX;
+    state.rx_stalled = 0;
+    IOWR_ALTERA_AVALON_UART_CONTROL(HOSTBRIDGE_BASE, 0);
+    IOWR_ALTERA_AVALON_UART_STATUS(HOSTBRIDGE_BASE, 0);
+#ifdef ALT_ENHANCED_INTERRUPT_API_PRESENT
+    alt_ic_isr_register(HOSTBRIDGE_IRQ_INTERRUPT_CONTROLLER_ID, HOSTBRIDGE_IRQ, direct_irq, NULL, NULL);
+#else
+    alt_irq_register(HOSTBRIDGE_IRQ, NULL, direct_irq);
+#endif
+    IOWR_ALTERA_AVALON_UART_CONTROL(HOSTBRIDGE_BASE, state.control);
+    return 0;
+}
+
+/**
+ * @func direct_read
+ * @brief Nothing to read (received data is passed by peridot_sw_hostbridge_gen2_direct_drain())
+ */
+static int direct_read(hostbridge_transport *transport, void *ptr, int len)
+{
+    return 0;
+}
+
+/**
+ * @func direct_write
+ * @brief Copy data to TX ring and enable TX interrupt
+ */
+static int direct_write(hostbridge_transport *transport, const void *ptr, int len)
+{
+    const alt_u8 *src = (const alt_u8 *)ptr;
+    alt_irq_context context;
+    int space;
+    int written;
+
+    for (;;) {
+        space = PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_TX_RING - (alt_u16)(state.tx_head - state.tx_tail);
+        if ((space > 0) || transport->nonblock) {
+            break;
+        }
+        YIELD();
+    }
+    if (len > space) {
+        len = space;
+    }
+    for (written = 0; written < len; ) {
+        int offset = state.tx_head & TX_RING_MASK;
+        int chunk = PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_TX_RING - offset;
+        if (chunk > len - written) {
+            chunk = len - written;
+        }
+        memcpy(state.tx_buffer + offset, src + written, chunk);
+        written += chunk;
+        state.tx_head += chunk;
+    }
+    if (written > 0) {
+        context = alt_irq_disable_all();
+        state.control |= ALTERA_AVALON_UART_CONTROL_TRDY_MSK;
+        IOWR_ALTERA_AVALON_UART_CONTROL(HOSTBRIDGE_BASE, state.control);
+        alt_irq_enable_all(context);
+    }
+    return written;
+}
+
+hostbridge_transport peridot_sw_hostbridge_gen2_direct_transport = {
+    .open = direct_open,
+    .read = direct_read,
+    .write = direct_write,
+    .fd = -1,
+    .notify_rx = 1,
+};
+
+/**
+ * @func peridot_sw_hostbridge_gen2_direct_attach
+ * @brief Allocate ring for channel
+ * @param channel Channel being registered
+ * @return 0 on success, -ENOMEM if no memory
+ * @note Data for channels without ring is discarded by interrupt handler.
+ */
+int peridot_sw_hostbridge_gen2_direct_attach(hostbridge_channel *channel)
+{
+    hostbridge_direct_ring *ring;
+
+    ring = (hostbridge_direct_ring *)malloc(sizeof(*ring));
+    if (!ring) {
+        return -ENOMEM;
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->channel = channel;
+    ring->next = state.first;
+    state.first = ring;
+    state.rings[channel->number] = ring;
+    return 0;
+}
+
+/**
+ * @func peridot_sw_hostbridge_gen2_direct_drain
+ * @brief Pass data in rings to channels, and resume reception if stalled
+ * @param deliver Function to write data to channel
+ *                (called with NULL channel to count bytes for unregistered channels)
+ * @return Number of bytes received from host since last call
+ */
+int peridot_sw_hostbridge_gen2_direct_drain(void (*deliver)(hostbridge_channel *, const alt_u8 *, int, int))
+{
+    hostbridge_direct_ring *ring;
+    alt_u32 count;
+
+    for (ring = state.first; ring; ring = ring->next) {
+        alt_u16 head = ring->head;
+        while (ring->tail != head) {
+            int from = ring->tail & RX_RING_MASK;
+            int to = from + (alt_u16)(head - ring->tail);
+            if (to > PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_RX_RING) {
+                to = PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_RX_RING;
+            }
+            (*deliver)(ring->channel, ring->buffer, from, to);
+            ring->tail += to - from;
+        }
+    }
+
+    if (state.rx_stalled) {
+        // Every ring has space now => Read bytes left in UART
+        alt_irq_context context = alt_irq_disable_all();
+        state.rx_stalled = 0;
+        state.control |= UART_CONTROL_RX;
+        IOWR_ALTERA_AVALON_UART_CONTROL(HOSTBRIDGE_BASE, state.control);
+        alt_irq_enable_all(context);
+    }
+
+    count = state.rx_unrouted - state.rx_unrouted_reported;
+    if (count > 0) {
+        state.rx_unrouted_reported += count;
+        (*deliver)(NULL, NULL, 0, count);
+    }
+    count = state.rx_bytes - state.rx_bytes_reported;
+    state.rx_bytes_reported += count;
+    return count;
+}
+
+#endif  /* PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_UART */
@@ -0,0 +1,125 @@
+#include "system.h"
+#include "peridot_sw_hostbridge_gen2.h"
+#include <unistd.h>
+#include <errno.h>
+#include <sys/fcntl.h>
+
+#ifndef PERIDOT_SW_HOSTBRIDGE_GEN2_TRANSPORT_POSIX
+
+#ifndef HOSTBRIDGE_NAME
+# error "peridot_sw_hostbridge_gen2 requires UART device named 'hostbridge'!"
+#endif
+
+#define PERIDOT_SW_HOSTBRIDGE_PORT hostbridge
+#define PERIDOT_SW_HOSTBRIDGE_PATH "/dev/hostbridge"
+
+#ifdef ALT_USE_DIRECT_DRIVERS
+# include "sys/alt_driver.h"
+ALT_DRIVER_READ_EXTERNS(PERIDOT_SW_HOSTBRIDGE_PORT);
+ALT_DRIVER_WRITE_EXTERNS(PERIDOT_SW_HOSTBRIDGE_PORT);
+#endif
+
+/**
+ * @func fd_result
+ * @brief Convert result of HAL file I/O into result of transport
+ * @note HAL returns -1 with errno. Transport returns zero if the driver
+ *       would block, or negative errno.
+ */
+static int fd_result(int result)
+{
+    if (result >= 0) {
+        return result;
+    }
+    if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    return -errno;
+}
+
+/**
+ * @func hal_open
+ * @brief Open UART for hostbridge
+ * @note With direct drivers, UART is always accessed in non-blocking mode
+ */
+static int hal_open(hostbridge_transport *transport, int nonblock)
+{
+    transport->nonblock = nonblock;
+#ifndef ALT_USE_DIRECT_DRIVERS
+    transport->fd = open(PERIDOT_SW_HOSTBRIDGE_PATH, O_RDWR | (nonblock ? O_NONBLOCK : 0));
+    if (transport->fd < 0) {
+        return transport->fd;
+    }
+#endif
+    return 0;
+}
+
+static int hal_read(hostbridge_transport *transport, void *ptr, int len)
+{
+#ifndef ALT_USE_DIRECT_DRIVERS
+    return fd_result(read(transport->fd, ptr, len));
+#else
+    int result = ALT_DRIVER_READ(PERIDOT_SW_HOSTBRIDGE_PORT, ptr, len, O_NONBLOCK);
+    return ((result == -EAGAIN) || (result == -EWOULDBLOCK)) ? 0 : result;
+#endif
+}
+
+static int hal_write(hostbridge_transport *transport, const void *ptr, int len)
+{
+#ifndef ALT_USE_DIRECT_DRIVERS
+    return fd_result(write(transport->fd, ptr, len));
+#else
+    int result = ALT_DRIVER_WRITE(PERIDOT_SW_HOSTBRIDGE_PORT, ptr, len, O_NONBLOCK);
+    return ((result == -EAGAIN) || (result == -EWOULDBLOCK)) ? 0 : result;
+#endif
+}
+
+hostbridge_transport peridot_sw_hostbridge_gen2_hal_transport = {
+    .open = hal_open,
+    .read = hal_read,
+    .write = hal_write,
+    .fd = -1,
+};
+
+/**
+ * @func uart_open
+ * @brief Open additional UART with HAL file I/O
+ */
+static int uart_open(hostbridge_transport *transport, int nonblock)
+{
+    transport->nonblock = nonblock;
+    transport->fd = open(transport->path, O_RDWR | (nonblock ? O_NONBLOCK : 0));
+    if (transport->fd < 0) {
+        return transport->fd;
+    }
+    return 0;
+}
+
+static int uart_read(hostbridge_transport *transport, void *ptr, int len)
+{
+    return fd_result(read(transport->fd, ptr, len));
+}
+
+static int uart_write(hostbridge_transport *transport, const void *ptr, int len)
+{
+    return fd_result(write(transport->fd, ptr, len));
+}
+
+/**
+ * @func peridot_sw_hostbridge_gen2_uart_transport
+ * @brief Initialize transport for UART other than 'hostbridge'
+ * @param transport Transport to initialize
+ * @param path Device path of UART (e.g. "/dev/uart_1", must be kept valid)
+ * @note This is used to give transports to additional links.
+ */
+void peridot_sw_hostbridge_gen2_uart_transport(hostbridge_transport *transport, const char *path)
+{
+    transport->open = uart_open;
+    transport->read = uart_read;
+    transport->write = uart_write;
+    transport->fd = -1;
+    transport->nonblock = 0;
+    transport->path = path;
+    transport->notify_rx = 0;
+}
+
+#endif  /* !PERIDOT_SW_HOSTBRIDGE_GEN2_TRANSPORT_POSIX */
@@ -0,0 +1,441 @@
+/*
+ * Packet compression for hostbridge channels
+ *
+ * Packets are compressed one by one in LZF format (8 KB window at most,
+ * no dictionary across packets), so that memory use stays bounded:
+ *   - Hash table for compressor (512 bytes)
+ *   - Output buffer for each packet being sent (packet length, freed after sent)
+ *   - Work buffer for decompressor (max_packet bytes)
+ *   - Receive buffer for each compressible channel (max_packet bytes)
+ * Stored packets are passed through without buffering, thus only
+ * compressed packets are limited to max_packet bytes.
+ */
+#include "system.h"
+#include "peridot_sw_hostbridge_gen2.h"
+
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_COMPRESSION
+#include <errno.h>
+#include <malloc.h>
+#include <string.h>
+#include "os/alt_sem.h"
+
+#if (PERIDOT_SW_HOSTBRIDGE_GEN2_COMPRESS_MAX_PACKET > 65535)
+# error "peridot_sw_hostbridge_gen2.compress_max_packet must be 65535 or less"
+#endif
+
+#define LZF_MAX_LITERAL     32
+#define LZF_MAX_OFFSET      8192
+#define LZF_MAX_MATCH       (7 + 255 + 2)
+
+#define LZ_HASH_BITS        8
+#define LZ_HASH(p) \
+    ((((alt_u32)(p)[0] << 16 | (alt_u32)(p)[1] << 8 | (p)[2]) * 2654435761u) >> (32 - LZ_HASH_BITS))
+
+// Packets shorter than this are always stored
+#define LZ_MIN_LENGTH       8
+
+// Receive buffer is flushed to sink at every this number of bytes
+#define LZ_DELIVER_CHUNK    64
+
+enum {
+    LZ_RX_IDLE = 0,     // Outside packet
+    LZ_RX_METHOD,       // Waiting for method byte
+    LZ_RX_STORED,       // Passing stored packet through
+    LZ_RX_LZF,          // Receiving compressed packet
+};
+
+typedef struct hostbridge_lz_rx_s {
+    alt_u8 mode;
+    alt_u8 escape_prefix;
+    alt_u8 eop_prefix;
+    int len;
+    alt_u8 buffer[PERIDOT_SW_HOSTBRIDGE_GEN2_COMPRESS_MAX_PACKET];
+} hostbridge_lz_rx;
+
+struct peridot_sw_hostbridge_gen2_lz_state_s {
+    ALT_SEM(lock);      // Guards table (held only while compressing)
+    ALT_SEM(rx_lock);   // Guards rx_work (channels on different links are received in parallel)
+    alt_u16 table[1 << LZ_HASH_BITS];
+    alt_u8 rx_work[PERIDOT_SW_HOSTBRIDGE_GEN2_COMPRESS_MAX_PACKET];
+} peridot_sw_hostbridge_gen2_lz_state __attribute__((weak));
+
+static struct peridot_sw_hostbridge_gen2_lz_state_s state
+__attribute__((alias("peridot_sw_hostbridge_gen2_lz_state")));
+
+static const alt_u8 method_stored = HOSTBRIDGE_GEN2_COMPRESS_STORED;
+
+/**
+ * @func put_literals
+ * @brief Write literal runs
+ * @return New output offset (or negative if output is full)
+ */
+static int put_literals(alt_u8 *out, int op, int out_len, const alt_u8 *src, int len)
+{
+    while (len > 0) {
+        int run = (len > LZF_MAX_LITERAL) ? LZF_MAX_LITERAL : len;
+        if ((op + 1 + run) > out_len) {
+            return -1;
+        }
+        out[op++] = run - 1;
+        memcpy(out + op, src, run);
+        op += run;
+        src += run;
+        len -= run;
+    }
+    return op;
+}
+
+/**
+ * @func lzf_compress
+ * @brief Compress data in LZF format
+ * @param in Pointer to data
+ * @param in_len Length of data
+ * @param out Pointer to output buffer
+ * @param out_len Length of output buffer
+ * @return Length of compressed data (or negative if it does not fit in output buffer)
+ * @note Caller must hold state.lock.
+ */
+static int lzf_compress(const alt_u8 *in, int in_len, alt_u8 *out, int out_len)
+{
+    const alt_u8 *ip = in;
+    const alt_u8 *end = in + in_len;
+    const alt_u8 *literal = in;
+    int op = 0;
+
+    memset(state.table, 0, sizeof(state.table));
+    while ((end - ip) >= 3) {
+        alt_u32 hash = LZ_HASH(ip);
+        int pos = ip - in;
+        int ref = (int)state.table[hash] - 1;
+        int match_len;
+        int max_len;
+        int offset;
+
+        state.table[hash] = pos + 1;
+        if ((ref < 0) || ((pos - ref) > LZF_MAX_OFFSET) ||
+            (in[ref] != ip[0]) || (in[ref + 1] != ip[1]) || (in[ref + 2] != ip[2])) {
+            ++ip;
+            continue;
+        }
+
+        max_len = end - ip;
+        if (max_len > LZF_MAX_MATCH) {
+            max_len = LZF_MAX_MATCH;
+        }
+        for (match_len = 3; (match_len < max_len) && (in[ref + match_len] == ip[match_len]); ++match_len);
+
+        op = put_literals(out, op, out_len, literal, ip - literal);
+        if ((op < 0) || ((op + 3) > out_len)) {
+            return -1;
+        }
+        offset = pos - ref - 1;
+        if ((match_len - 2) < 7) {
+            out[op++] = ((match_len - 2) << 5) | (offset >> 8);
+        } else {
+            out[op++] = (7 << 5) | (offset >> 8);
+            out[op++] = match_len - 2 - 7;
+        }
+        out[op++] = offset & 0xff;
+        ip += match_len;
+        literal = ip;
+    }
+    return put_literals(out, op, out_len, literal, end - literal);
+}
+
+/**
+ * @func lzf_decompress
+ * @brief Decompress data in LZF format
+ * @param in Pointer to compressed data
+ * @param in_len Length of compressed data
+ * @param out Pointer to output buffer
+ * @param out_len Length of output buffer
+ * @return Length of decompressed data (or negative if data is broken or too long)
+ */
+static int lzf_decompress(const alt_u8 *in, int in_len, alt_u8 *out, int out_len)
+{
+    const alt_u8 *ip = in;
+    const alt_u8 *end = in + in_len;
+    int op = 0;
+
+    while (ip < end) {
+        int ctrl = *ip++;
+        if (ctrl < LZF_MAX_LITERAL) {
+            // Literal run
+            int run = ctrl + 1;
+            if (((end - ip) < run) || ((op + run) > out_len)) {
+                return -1;
+            }
+            memcpy(out + op, ip, run);
+            ip += run;
+            op += run;
+        } else {
+            // Back reference (may overlap with output)
+            int match_len = ctrl >> 5;
+            int ref;
+            if (match_len == 7) {
+                if (ip >= end) {
+                    return -1;
+                }
+                match_len += *ip++;
+            }
+            if (ip >= end) {
+                return -1;
+            }
+            ref = op - (((ctrl & 0x1f) << 8) | *ip++) - 1;
+            match_len += 2;
+            if ((ref < 0) || ((op + match_len) > out_len)) {
+                return -1;
+            }
+            for (; match_len > 0; --match_len) {
+                out[op++] = out[ref++];
+            }
+        }
+    }
+    return op;
+}
+
+/**
+ * @func peridot_sw_hostbridge_gen2_lz_init
+ * @brief Initialize compression
+ */
+int peridot_sw_hostbridge_gen2_lz_init(void)
+{
+    ALT_SEM_CREATE(&state.lock, 1);
+    ALT_SEM_CREATE(&state.rx_lock, 1);
+    return 0;
+}
+
+/**
+ * @func peridot_sw_hostbridge_gen2_lz_attach
+ * @brief Allocate receive buffer for compressible channel
+ * @param channel Channel
+ * @note Buffer is allocated at registration so that enabling compression never fails.
+ */
+int peridot_sw_hostbridge_gen2_lz_attach(hostbridge_channel *channel)
+{
+    if (!channel->lz_rx) {
+        channel->lz_rx = (hostbridge_lz_rx *)malloc(sizeof(hostbridge_lz_rx));
+        if (!channel->lz_rx) {
+            return -ENOMEM;
+        }
+    }
+    channel->compressed = 0;
+    return 0;
+}
+
+/**
+ * @func peridot_sw_hostbridge_gen2_lz_enable
+ * @brief Enable or disable compression of channel
+ * @param channel Channel (must be attached)
+ * @param enable Non-zero to enable
+ */
+void peridot_sw_hostbridge_gen2_lz_enable(hostbridge_channel *channel, int enable)
+{
+    if (enable && !channel->compressed) {
+        channel->lz_rx->mode = LZ_RX_IDLE;
+        channel->lz_rx->escape_prefix = 0;
+        channel->lz_rx->eop_prefix = 0;
+    }
+    channel->compressed = enable ? 1 : 0;
+}
+
+/**
+ * @func peridot_sw_hostbridge_gen2_lz_encode
+ * @brief Convert packet into compressed or stored form
+ * @param iov Array of segments
+ * @param iovcnt Number of segments
+ * @param len Total length of segments (must be positive)
+ * @param out Pointer to store array of converted segments
+ * @return Number of converted segments (or negative errno)
+ * @note On success, converted segments must be released by
+ *       peridot_sw_hostbridge_gen2_lz_release() after they are consumed.
+ *       Each segment is compressed separately because back references
+ *       of LZF are relative to output position.
+ */
+int peridot_sw_hostbridge_gen2_lz_encode(const hostbridge_iovec *iov, int iovcnt, int len, hostbridge_iovec **out)
+{
+    hostbridge_iovec *converted;
+    int i;
+
+    if ((LZ_MIN_LENGTH <= len) && (len <= PERIDOT_SW_HOSTBRIDGE_GEN2_COMPRESS_MAX_PACKET)) {
+        // Compressed packet must be shorter than stored one
+        converted = (hostbridge_iovec *)malloc(sizeof(*converted) + len);
+        if (converted) {
+            alt_u8 *work = (alt_u8 *)(converted + 1);
+            int total = 1;
+            work[0] = HOSTBRIDGE_GEN2_COMPRESS_LZF;
+            ALT_SEM_PEND(state.lock, 0);
+            for (i = 0; i < iovcnt; ++i) {
+                int compressed;
+                if (iov[i].len == 0) {
+                    continue;
+                }
+                compressed = lzf_compress((const alt_u8 *)iov[i].base, iov[i].len,
+                                          work + total, len - total);
+                if (compressed < 0) {
+                    break;
+                }
+                total += compressed;
+            }
+            ALT_SEM_POST(state.lock);
+            if (i == iovcnt) {
+                converted->base = work;
+                converted->len = total;
+                *out = converted;
+                return 1;
+            }
+            free(converted);
+        }
+    }
+
+    // Stored packet (method byte followed by original segments)
+    converted = (hostbridge_iovec *)malloc(sizeof(*converted) * (iovcnt + 1));
+    if (!converted) {
+        return -ENOMEM;
+    }
+    converted[0].base = &method_stored;
+    converted[0].len = 1;
+    memcpy(converted + 1, iov, sizeof(*converted) * iovcnt);
+    *out = converted;
+    return iovcnt + 1;
+}
+
+/**
+ * @func peridot_sw_hostbridge_gen2_lz_release
+ * @brief Release segments converted by peridot_sw_hostbridge_gen2_lz_encode()
+ * @param iov Array of converted segments
+ */
+void peridot_sw_hostbridge_gen2_lz_release(hostbridge_iovec *iov)
+{
+    free(iov);
+}
+
+/**
+ * @func deliver_packet
+ * @brief Pass decompressed data to sink as packet
+ */
+static void deliver_packet(hostbridge_channel *channel, const alt_u8 *src, int len,
+                           void (*deliver)(hostbridge_channel *, const alt_u8 *, int))
+{
+    alt_u8 buffer[LZ_DELIVER_CHUNK + 3];
+    int buffered = 0;
+
+    buffer[buffered++] = AST_SOP;
+    for (; len > 0; --len) {
+        alt_u8 byte = *src++;
+        if (len == 1) {
+            buffer[buffered++] = AST_EOP_PREFIX;
+        }
+        if (AST_NEEDS_ESCAPE(byte)) {
+            buffer[buffered++] = AST_ESCAPE_PREFIX;
+            byte ^= AST_ESCAPE_XOR;
+        }
+        buffer[buffered++] = byte;
+        if (buffered >= LZ_DELIVER_CHUNK) {
+            (*deliver)(channel, buffer, buffered);
+            buffered = 0;
+        }
+    }
+    if (buffered > 0) {
+        (*deliver)(channel, buffer, buffered);
+    }
+}
+
+/**
+ * @func peridot_sw_hostbridge_gen2_lz_sink
+ * @brief Receive packets from host on compressed channel
+ * @param channel Channel (packetized)
+ * @param ptr Pointer to received data (with SOP/EOP and escapes)
+ * @param len Length of received data
+ * @param deliver Function to pass data to sink of channel
+ * @note Sink of channel receives packets in ordinary form.
+ */
+void peridot_sw_hostbridge_gen2_lz_sink(hostbridge_channel *channel, const alt_u8 *ptr, int len,
+                                        void (*deliver)(hostbridge_channel *, const alt_u8 *, int))
+{
+    static const alt_u8 sop = AST_SOP;
+    hostbridge_lz_rx *rx = channel->lz_rx;
+    const alt_u8 *src = ptr;
+    const alt_u8 *end = ptr + len;
+    const alt_u8 *through = (rx->mode == LZ_RX_STORED) ? src : NULL;
+
+    while (src < end) {
+        alt_u8 byte = *src++;
+        switch (byte) {
+        case AST_SOP:
+            if (through) {
+                // Stored packet is interrupted (sink will see new SOP)
+                (*deliver)(channel, through, src - 1 - through);
+                through = NULL;
+            }
+            rx->mode = LZ_RX_METHOD;
+            rx->eop_prefix = 0;
+            rx->len = 0;
+            continue;
+        case AST_EOP_PREFIX:
+            rx->eop_prefix = 1;
+            continue;
+        case AST_ESCAPE_PREFIX:
+            rx->escape_prefix = 1;
+            continue;
+        }
+        if (rx->escape_prefix) {
+            byte ^= AST_ESCAPE_XOR;
+            rx->escape_prefix = 0;
+        }
+
+        switch (rx->mode) {
+        case LZ_RX_METHOD:
+            if (rx->eop_prefix) {
+                // Empty packet
+                rx->mode = LZ_RX_IDLE;
+            } else if (byte == HOSTBRIDGE_GEN2_COMPRESS_STORED) {
+                (*deliver)(channel, &sop, 1);
+                rx->mode = LZ_RX_STORED;
+                through = src;
+            } else if (byte == HOSTBRIDGE_GEN2_COMPRESS_LZF) {
+                rx->mode = LZ_RX_LZF;
+            } else {
+                // Unknown method
+                HOSTBRIDGE_GEN2_STATS_ADD(channel, rx_dropped, 1);
+                rx->mode = LZ_RX_IDLE;
+            }
+            break;
+        case LZ_RX_STORED:
+            if (rx->eop_prefix) {
+                (*deliver)(channel, through, src - through);
+                through = NULL;
+                rx->mode = LZ_RX_IDLE;
+            }
+            break;
+        case LZ_RX_LZF:
+            if (rx->len < (int)sizeof(rx->buffer)) {
+                rx->buffer[rx->len] = byte;
+            }
+            ++rx->len;
+            if (rx->eop_prefix) {
+                int decompressed = -1;
+                ALT_SEM_PEND(state.rx_lock, 0);
+                if (rx->len <= (int)sizeof(rx->buffer)) {
+                    decompressed = lzf_decompress(rx->buffer, rx->len, state.rx_work, sizeof(state.rx_work));
+                }
+                if (decompressed > 0) {
+                    deliver_packet(channel, state.rx_work, decompressed, deliver);
+                } else {
+                    HOSTBRIDGE_GEN2_STATS_ADD(channel, rx_dropped, rx->len);
+                }
+                ALT_SEM_POST(state.rx_lock);
+                rx->mode = LZ_RX_IDLE;
+            }
+            break;
+        default:
+            break;
+        }
+        rx->eop_prefix = 0;
+    }
+
+    if (through && (through < end)) {
+        (*deliver)(channel, through, end - through);
+    }
+}
+#endif  /* PERIDOT_SW_HOSTBRIDGE_GEN2_COMPRESSION */
@@ -19,16 +19,42 @@ inline static uint32_t roundup_pow2(uint32_t x)
     return ++x;
 }
 
+// Publish ring contents before counters (and vice versa)
+#define PIPE_BARRIER()  __sync_synchronize()
+
+/*
+ * Pipe from host with single-producer (sink) / single-consumer (reader) ring.
+ * Counters run freely and are masked by capacity (power of 2) on access,
+ * so that whole capacity can be used. Each counter is written by one side only.
+ */
 typedef struct hostbridge_pipe_s {
     hostbridge_channel channel;
-    ALT_SEM(sem_lock);
     ALT_SEM(sem_read);
     size_t capacity;
-    size_t read_offset;
-    size_t write_offset;
+    volatile alt_u32 head;      // Total bytes written (by sink)
+    volatile alt_u32 tail;      // Total bytes read (by reader)
+    volatile alt_u8 waiting;    // Reader is waiting for sem_read
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_FLOW_CONTROL
+    ALT_SEM(sem_credit);
+    struct hostbridge_pipe_s *next;
+    alt_u32 granted;            // Total bytes which host is allowed to send
+#endif
     char buffer[0];
 } hostbridge_pipe;
 
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_FLOW_CONTROL
+struct peridot_sw_hostbridge_gen2_pipe_state_s {
+    hostbridge_channel channel;
+    alt_u8 escape_prefix;
+    alt_u8 eop_prefix;
+    alt_u8 inside_packet;
+    hostbridge_pipe *first;
+} peridot_sw_hostbridge_gen2_pipe_state __attribute__((weak));
+
+static struct peridot_sw_hostbridge_gen2_pipe_state_s state
+__attribute__((alias("peridot_sw_hostbridge_gen2_pipe_state")));
+#endif  /* PERIDOT_SW_HOSTBRIDGE_GEN2_FLOW_CONTROL */
+
 static int hostbridge_pipe_read(alt_fd *fd, char *ptr, int len);
 static int hostbridge_pipe_write(alt_fd *fd, const char *ptr, int len);
 
@@ -37,53 +63,178 @@ static const alt_dev hostbridge_pipe_dev = {
     .write = hostbridge_pipe_write,
 };
 
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_FLOW_CONTROL
+/**
+ * @func send_credit
+ * @brief Send credit message to host over credit channel
+ * @param type HOSTBRIDGE_GEN2_CREDIT_GRANT or HOSTBRIDGE_GEN2_CREDIT_SYNC
+ * @param number Channel number of pipe
+ * @param credit Number of bytes
+ */
+static void send_credit(alt_u8 type, alt_u8 number, alt_u32 credit)
+{
+    alt_u8 message[6];
+
+    message[0] = type;
+    message[1] = number;
+    message[2] = (credit >>  0) & 0xff;
+    message[3] = (credit >>  8) & 0xff;
+    message[4] = (credit >> 16) & 0xff;
+    message[5] = (credit >> 24) & 0xff;
+    peridot_sw_hostbridge_gen2_source(&state.channel, message, sizeof(message), HOSTBRIDGE_GEN2_SOURCE_PACKETIZED);
+}
+
+/**
+ * @func sync_credit
+ * @brief Advertise whole free space of pipe to host
+ * @param pipe Pipe
+ * @note Host must not have data in flight for this channel
+ */
+static void sync_credit(hostbridge_pipe *pipe)
+{
+    alt_u32 credit;
+
+    ALT_SEM_PEND(pipe->sem_credit, 0);
+    pipe->granted = pipe->tail + pipe->capacity;
+    credit = pipe->granted - pipe->head;
+    ALT_SEM_POST(pipe->sem_credit);
+
+    send_credit(HOSTBRIDGE_GEN2_CREDIT_SYNC, pipe->channel.number, credit);
+}
+
+/**
+ * @func return_credit
+ * @brief Return space freed by reader to host as credit
+ * @param pipe Pipe
+ * @note Small returns are batched until host is running short of credit
+ */
+static void return_credit(hostbridge_pipe *pipe)
+{
+    alt_u32 grant = 0;
+    alt_u32 threshold = pipe->capacity / 4;
+    alt_u32 freed;
+
+    ALT_SEM_PEND(pipe->sem_credit, 0);
+    freed = (pipe->tail + pipe->capacity) - pipe->granted;
+    if ((freed > 0) && ((freed >= threshold) || ((pipe->granted - pipe->head) < threshold))) {
+        grant = freed;
+        pipe->granted += grant;
+    }
+    ALT_SEM_POST(pipe->sem_credit);
+
+    if (grant > 0) {
+        send_credit(HOSTBRIDGE_GEN2_CREDIT_GRANT, pipe->channel.number, grant);
+    }
+}
+
+/**
+ * @func credit_sink
+ * @brief Sink for credit channel
+ * @note Each byte in a packet from host is a channel number of pipe
+ *       whose credit should be synchronized (used when host connects).
+ */
+static int credit_sink(hostbridge_channel *channel, const void *ptr, int len)
+{
+    const alt_u8 *src = (const alt_u8 *)ptr;
+    int read_len;
+
+    for (read_len = 0; read_len < len; ++read_len) {
+        alt_u8 byte = *src++;
+        hostbridge_pipe *pipe;
+        switch (byte) {
+        case AST_SOP:
+            state.inside_packet = 1;
+            state.eop_prefix = 0;
+            continue;
+        case AST_EOP_PREFIX:
+            state.eop_prefix = 1;
+            continue;
+        case AST_ESCAPE_PREFIX:
+            state.escape_prefix = 1;
+            continue;
+        }
+        if (state.escape_prefix) {
+            byte ^= AST_ESCAPE_XOR;
+            state.escape_prefix = 0;
+        }
+        if (!state.inside_packet) {
+            continue;
+        }
+        if (state.eop_prefix) {
+            state.inside_packet = 0;
+            state.eop_prefix = 0;
+            HOSTBRIDGE_GEN2_STATS_ADD(channel, rx_packets, 1);
+        }
+        for (pipe = state.first; pipe; pipe = pipe->next) {
+            if (pipe->channel.number == byte) {
+                sync_credit(pipe);
+                break;
+            }
+        }
+    }
+
+    return len;
+}
+
+/**
+ * @func peridot_sw_hostbridge_gen2_pipe_init
+ * @brief Register credit channel for pipes
+ */
+int peridot_sw_hostbridge_gen2_pipe_init(void)
+{
+    state.channel.number = PERIDOT_SW_HOSTBRIDGE_GEN2_CREDIT_CHANNEL;
+    state.channel.packetized = 1;
+    state.channel.priority = HOSTBRIDGE_GEN2_PRIORITY_URGENT;
+    state.channel.dest.sink = credit_sink;
+    return peridot_sw_hostbridge_gen2_register_channel(&state.channel);
+}
+#endif  /* PERIDOT_SW_HOSTBRIDGE_GEN2_FLOW_CONTROL */
+
 static int hostbridge_pipe_read(alt_fd *fd, char *ptr, int len)
 {
     hostbridge_pipe *pipe = (hostbridge_pipe *)fd->priv;
-    int read_offset, write_offset;
-    int avail1, avail2;
-
-retry:
-    ALT_SEM_PEND(pipe->sem_lock, 0);
-    read_offset = pipe->read_offset;
-    write_offset = pipe->write_offset;
-    ALT_SEM_POST(pipe->sem_lock);
-
-    if (read_offset <= write_offset) {
-        // ----r----w----
-        //     aaaaa
-        avail1 = write_offset - read_offset;
-        if (avail1 == 0) {
-            ALT_SEM_PEND(pipe->sem_read, 0);
-            goto retry;
+    alt_u32 tail = pipe->tail;
+    size_t avail;
+    size_t offset;
+    size_t len1;
+
+    for (;;) {
+        avail = pipe->head - tail;
+        if (avail > 0) {
+            break;
         }
-        avail2 = 0;
-    } else {
-        // ----w----r----
-        // aaaa     aaaaa
-        avail1 = pipe->capacity - read_offset;
-        avail2 = write_offset;
-    }
-
-    if (len < avail1) {
-        avail1 = len;
-        avail2 = 0;
-    } else {
-        len -= avail1;
-        if (len < avail2) {
-            avail2 = len;
+        if (fd->fd_flags & O_NONBLOCK) {
+            return -EWOULDBLOCK;
         }
+        // Announce waiting, then check again not to miss wakeup from sink
+        pipe->waiting = 1;
+        PIPE_BARRIER();
+        if (pipe->head != tail) {
+            pipe->waiting = 0;
+            continue;
+        }
+        ALT_SEM_PEND(pipe->sem_read, 0);
     }
+    PIPE_BARRIER();
 
-    memcpy(ptr, pipe->buffer + read_offset, avail1);
-    if (avail2 > 0) {
-        memcpy(ptr + avail1, pipe->buffer, avail2);
-        pipe->read_offset = avail2;
-    } else {
-        pipe->read_offset = (read_offset + avail1) & (pipe->capacity - 1);
+    if ((size_t)len > avail) {
+        len = avail;
+    }
+    offset = tail & (pipe->capacity - 1);
+    len1 = pipe->capacity - offset;
+    if (len1 > (size_t)len) {
+        len1 = len;
     }
+    memcpy(ptr, pipe->buffer + offset, len1);
+    memcpy(ptr + len1, pipe->buffer, len - len1);
 
-    return (avail1 + avail2);
+    PIPE_BARRIER();
+    pipe->tail = tail + len;
+
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_FLOW_CONTROL
+    return_credit(pipe);
+#endif
+    return len;
 }
 
 static int hostbridge_pipe_write(alt_fd *fd, const char *ptr, int len)
@@ -99,58 +250,69 @@ static int hostbridge_pipe_write(alt_fd *fd, const char *ptr, int len)
 static int hostbridge_pipe_sink(hostbridge_channel *channel, const void *ptr, int len)
 {
     hostbridge_pipe *pipe = (hostbridge_pipe *)channel;
-    int read_offset, write_offset;
-    int free1, free2;
-
-    ALT_SEM_PEND(pipe->sem_lock, 0);
-    read_offset = pipe->read_offset;
-    write_offset = pipe->write_offset;
-    ALT_SEM_POST(pipe->sem_lock);
-
-    if (read_offset <= write_offset) {
-        // ----r----w----
-        // fff-     fffff
-        free1 = pipe->capacity - write_offset;
-        free2 = read_offset - 1;
-        if (free2 < 0) {
-            --free1;
-            free2 = 0;
-        }
-    } else {
-        // ----w----r----
-        //     ffff-
-        free1 = read_offset - write_offset - 1;
-        free2 = 0;
-    }
+    alt_u32 head = pipe->head;
+    size_t space = pipe->capacity - (head - pipe->tail);
+    size_t offset;
+    size_t len1;
 
-    if (free1 == 0) {
-        // Buffer overflow => Drop data
-        return 0;
+    if (space == 0) {
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_FLOW_CONTROL
+        // Host sent data beyond its credit => Drop data
+        HOSTBRIDGE_GEN2_STATS_ADD(channel, rx_dropped, len);
+        return len;
+#else
+        // Buffer overflow => Let caller decide to wait or drop
+        return -EWOULDBLOCK;
+#endif
     }
+    PIPE_BARRIER();
 
-    if (len < free1) {
-        free1 = len;
-        free2 = 0;
-    } else {
-        len -= free1;
-        if (len < free2) {
-            free2 = len;
-        }
+    if ((size_t)len > space) {
+        len = space;
     }
-
-    memcpy(pipe->buffer + write_offset, ptr, free1);
-    if (free2 > 0) {
-        memcpy(pipe->buffer, ptr + free1, free2);
-        pipe->write_offset = free2;
-    } else {
-        pipe->write_offset = (write_offset + free1) & (pipe->capacity - 1);
+    offset = head & (pipe->capacity - 1);
+    len1 = pipe->capacity - offset;
+    if (len1 > (size_t)len) {
+        len1 = len;
+    }
+    // Data may already be in place (received with hostbridge_pipe_get_rx_buffer)
+    if (ptr != pipe->buffer + offset) {
+        memmove(pipe->buffer + offset, ptr, len1);
     }
+    memmove(pipe->buffer, (const char *)ptr + len1, len - len1);
 
-    if (read_offset == write_offset) {
+    PIPE_BARRIER();
+    pipe->head = head + len;
+
+    // Wake reader up only when it is (going to be) blocked
+    PIPE_BARRIER();
+    if (pipe->waiting) {
+        pipe->waiting = 0;
         ALT_SEM_POST(pipe->sem_read);
     }
 
-    return (free1 + free2);
+    return len;
+}
+
+/**
+ * @func hostbridge_pipe_get_rx_buffer
+ * @brief Provide contiguous free space of ring for zero-copy receive
+ */
+static void *hostbridge_pipe_get_rx_buffer(hostbridge_channel *channel, int *len)
+{
+    hostbridge_pipe *pipe = (hostbridge_pipe *)channel;
+    alt_u32 head = pipe->head;
+    size_t space = pipe->capacity - (head - pipe->tail);
+    size_t offset = head & (pipe->capacity - 1);
+
+    if (space == 0) {
+        return NULL;
+    }
+    if (space > pipe->capacity - offset) {
+        space = pipe->capacity - offset;
+    }
+    *len = space;
+    return pipe->buffer + offset;
 }
 
 int peridot_sw_hostbridge_gen2_mkpipe(alt_u8 channel, int output_fd, int input_fd, size_t input_capacity)
@@ -175,11 +337,16 @@ int peridot_sw_hostbridge_gen2_mkpipe(alt_u8 channel, int output_fd, int input_f
     pipe->channel.number = channel;
     if (input_fd >= 0) {
         pipe->channel.dest.sink = hostbridge_pipe_sink;
-        ALT_SEM_CREATE(&pipe->sem_lock, 1);
+        pipe->channel.get_rx_buffer = hostbridge_pipe_get_rx_buffer;
         ALT_SEM_CREATE(&pipe->sem_read, 0);
         pipe->capacity = input_capacity;
-        pipe->read_offset = 0;
-        pipe->write_offset = 0;
+        pipe->head = 0;
+        pipe->tail = 0;
+        pipe->waiting = 0;
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_FLOW_CONTROL
+        ALT_SEM_CREATE(&pipe->sem_credit, 1);
+        pipe->granted = 0;
+#endif
     }
 
     result = peridot_sw_hostbridge_gen2_register_channel(&pipe->channel);
@@ -188,6 +355,14 @@ int peridot_sw_hostbridge_gen2_mkpipe(alt_u8 channel, int output_fd, int input_f
         return result;
     }
 
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_FLOW_CONTROL
+    if (input_fd >= 0) {
+        pipe->next = state.first;
+        state.first = pipe;
+        sync_credit(pipe);
+    }
+#endif
+
     if (output_fd >= 0) {
         alt_fd *fd = &alt_fd_list[output_fd];
         if (fd->dev) {
@@ -0,0 +1,126 @@
+/*
+ * POSIX transport for hostbridge (for running on Linux host)
+ *
+ * This file is not part of BSP. Build it with
+ * PERIDOT_SW_HOSTBRIDGE_GEN2_TRANSPORT_POSIX defined, and pass a pty
+ * or one end of socketpair() to peridot_sw_hostbridge_gen2_posix_transport()
+ * before calling peridot_sw_hostbridge_gen2_init().
+ */
+#include "system.h"
+#include "peridot_sw_hostbridge_gen2.h"
+
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_TRANSPORT_POSIX
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+/**
+ * @func posix_open
+ * @brief Prepare file descriptor
+ * @note Descriptor is always switched to non-blocking mode.
+ *       In blocking mode, read/write wait with poll() instead.
+ */
+static int posix_open(hostbridge_transport *transport, int nonblock)
+{
+    int flags;
+
+    if (transport->fd < 0) {
+        return -EBADF;
+    }
+    flags = fcntl(transport->fd, F_GETFL);
+    if ((flags < 0) || (fcntl(transport->fd, F_SETFL, flags | O_NONBLOCK) < 0)) {
+        return -errno;
+    }
+    transport->nonblock = nonblock;
+    return 0;
+}
+
+/**
+ * @func posix_wait
+ * @brief Wait until descriptor becomes ready
+ * @return 0 if ready, negative errno on error or hang-up
+ */
+static int posix_wait(hostbridge_transport *transport, short events)
+{
+    struct pollfd pfd;
+
+    pfd.fd = transport->fd;
+    pfd.events = events;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, -1) < 0) {
+        return (errno == EINTR) ? 0 : -errno;
+    }
+    if ((pfd.revents & (POLLHUP | POLLERR | POLLNVAL)) && !(pfd.revents & events)) {
+        return -EPIPE;
+    }
+    return 0;
+}
+
+static int posix_read(hostbridge_transport *transport, void *ptr, int len)
+{
+    for (;;) {
+        ssize_t result = read(transport->fd, ptr, len);
+        if (result > 0) {
+            return result;
+        }
+        if (result == 0) {
+            // Peer closed
+            return -EPIPE;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+            return -errno;
+        }
+        if (transport->nonblock) {
+            return 0;
+        }
+        result = posix_wait(transport, POLLIN);
+        if (result < 0) {
+            return result;
+        }
+    }
+}
+
+static int posix_write(hostbridge_transport *transport, const void *ptr, int len)
+{
+    for (;;) {
+        ssize_t result = write(transport->fd, ptr, len);
+        if (result >= 0) {
+            return result;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+            return -errno;
+        }
+        if (transport->nonblock) {
+            return 0;
+        }
+        result = posix_wait(transport, POLLOUT);
+        if (result < 0) {
+            return result;
+        }
+    }
+}
+
+/**
+ * @func peridot_sw_hostbridge_gen2_posix_transport
+ * @brief Initialize POSIX transport
+ * @param transport Transport to initialize
+ * @param fd File descriptor connected to host (pty, socket, etc.)
+ */
+void peridot_sw_hostbridge_gen2_posix_transport(hostbridge_transport *transport, int fd)
+{
+    transport->open = posix_open;
+    transport->read = posix_read;
+    transport->write = posix_write;
+    transport->fd = fd;
+    transport->nonblock = 0;
+    transport->notify_rx = 0;
+}
+
+#endif  /* PERIDOT_SW_HOSTBRIDGE_GEN2_TRANSPORT_POSIX */
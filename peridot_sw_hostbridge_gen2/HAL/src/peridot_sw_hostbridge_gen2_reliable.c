@@ -0,0 +1,548 @@
+/*
+ * Reliable framing for hostbridge channels
+ *
+ * Each packet on a channel with reliable framing enabled carries a sequence
+ * number and CRC-32. Broken or out-of-order packets are dropped by receiver,
+ * which asks sender to resend them by NAK on reliable control channel.
+ * Memory use:
+ *   - Receive state for each recoverable channel (about 20 bytes)
+ *   - History of last (reliable_history) packets sent on each recoverable
+ *     channel (buffers are allocated on demand and reused)
+ * Received packets are not buffered. Sink sees each packet with its last byte
+ * (and EOP) held back until CRC is verified, so a broken packet never
+ * completes and is discarded by sink when next SOP arrives.
+ */
+#include "system.h"
+#include "peridot_sw_hostbridge_gen2.h"
+
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_RELIABLE
+#include <errno.h>
+#include <limits.h>
+#include <malloc.h>
+#include <string.h>
+#include "os/alt_sem.h"
+#include "crc32.h"
+
+#ifndef DIGESTS_CRC32_ENABLE
+# error "digests.crc32.enable must be enabled for peridot_sw_hostbridge_gen2.reliable"
+#endif
+
+#if (PERIDOT_SW_HOSTBRIDGE_GEN2_RELIABLE_HISTORY < 1) || (PERIDOT_SW_HOSTBRIDGE_GEN2_RELIABLE_HISTORY > 128)
+# error "peridot_sw_hostbridge_gen2.reliable_history must be between 1 and 128"
+#endif
+
+// Sequence number (1 byte) + CRC-32 (4 bytes)
+#define REL_OVERHEAD        5
+
+// Last payload byte + CRC-32
+#define REL_HOLD_LEN        5
+
+// Released bytes are passed to sink at every this number of bytes
+#define REL_DELIVER_CHUNK   32
+
+enum {
+    REL_RX_IDLE = 0,    // Outside packet
+    REL_RX_SEQUENCE,    // Waiting for sequence number
+    REL_RX_DATA,        // Receiving expected packet
+    REL_RX_SKIP,        // Discarding packet
+};
+
+typedef struct hostbridge_rel_s {
+    struct hostbridge_rel_s *next_rel;
+    hostbridge_channel *channel;
+    // Receive state
+    alt_u8 mode;
+    alt_u8 escape_prefix;
+    alt_u8 eop_prefix;
+    alt_u8 expected;        // Sequence number of next packet from host
+    alt_u8 nak_sent;        // NAK for expected is already sent
+    alt_u8 held;
+    alt_u8 hold[REL_HOLD_LEN];
+    digest_crc32_t crc;
+    int rx_len;
+    // Transmit state
+    alt_u8 next;            // Sequence number of next packet to host
+    alt_u8 *frames[PERIDOT_SW_HOSTBRIDGE_GEN2_RELIABLE_HISTORY];
+    alt_u32 lengths[PERIDOT_SW_HOSTBRIDGE_GEN2_RELIABLE_HISTORY];
+    alt_u32 capacities[PERIDOT_SW_HOSTBRIDGE_GEN2_RELIABLE_HISTORY];
+} hostbridge_rel;
+
+struct peridot_sw_hostbridge_gen2_rel_state_s {
+    ALT_SEM(lock);
+    hostbridge_channel channel;
+    int (*transmit)(hostbridge_channel *channel, const void *ptr, int len);
+    hostbridge_rel *first;
+    alt_u8 message[4];
+    alt_u8 message_len;
+    alt_u8 inside_packet;
+    alt_u8 escape_prefix;
+    alt_u8 eop_prefix;
+} peridot_sw_hostbridge_gen2_rel_state __attribute__((weak));
+
+static struct peridot_sw_hostbridge_gen2_rel_state_s state
+__attribute__((alias("peridot_sw_hostbridge_gen2_rel_state")));
+
+/**
+ * @func send_message
+ * @brief Send message to host over reliable control channel
+ * @param type HOSTBRIDGE_GEN2_RELIABLE_xxx
+ * @param number Channel number
+ * @param sequence Sequence number
+ */
+static void send_message(alt_u8 type, alt_u8 number, alt_u8 sequence)
+{
+    alt_u8 message[4];
+
+    message[0] = type;
+    message[1] = number;
+    message[2] = sequence;
+    message[3] = ~(type ^ number ^ sequence);
+    peridot_sw_hostbridge_gen2_source(&state.channel, message, sizeof(message), HOSTBRIDGE_GEN2_SOURCE_PACKETIZED);
+}
+
+/**
+ * @func reset_channel
+ * @brief Reset sequence numbers of both directions
+ * @param channel Channel (must be attached)
+ * @note Caller must hold state.lock.
+ */
+static void reset_channel(hostbridge_channel *channel)
+{
+    hostbridge_rel *rel = channel->rel;
+    int i;
+
+    rel->mode = REL_RX_IDLE;
+    rel->escape_prefix = 0;
+    rel->eop_prefix = 0;
+    rel->expected = 0;
+    rel->nak_sent = 0;
+    rel->next = 0;
+    for (i = 0; i < PERIDOT_SW_HOSTBRIDGE_GEN2_RELIABLE_HISTORY; ++i) {
+        rel->lengths[i] = 0;
+    }
+}
+
+/**
+ * @func resend
+ * @brief Resend packets from history
+ * @param channel Channel
+ * @param sequence Sequence number of first packet to resend
+ * @return 0 on success, -ENOENT if requested packet is not in history
+ */
+static int resend(hostbridge_channel *channel, alt_u8 sequence)
+{
+    hostbridge_rel *rel = channel->rel;
+    alt_u8 count;
+
+    ALT_SEM_PEND(state.lock, 0);
+    count = rel->next - sequence;
+    if ((count == 0) || (count > PERIDOT_SW_HOSTBRIDGE_GEN2_RELIABLE_HISTORY)) {
+        ALT_SEM_POST(state.lock);
+        return -ENOENT;
+    }
+    for (; count > 0; --count, ++sequence) {
+        int slot = sequence % PERIDOT_SW_HOSTBRIDGE_GEN2_RELIABLE_HISTORY;
+        if (rel->lengths[slot] == 0) {
+            // Packet before reset
+            continue;
+        }
+        (*state.transmit)(channel, rel->frames[slot], rel->lengths[slot]);
+        HOSTBRIDGE_GEN2_STATS_ADD(channel, tx_packets, 1);
+    }
+    ALT_SEM_POST(state.lock);
+    return 0;
+}
+
+/**
+ * @func handle_message
+ * @brief Process message from host
+ */
+static void handle_message(const alt_u8 *message)
+{
+    hostbridge_channel *channel = NULL;
+    hostbridge_rel *rel;
+
+    if (message[3] != (alt_u8)~(message[0] ^ message[1] ^ message[2])) {
+        // Broken message (host will time out and retry)
+        return;
+    }
+    for (rel = state.first; rel; rel = rel->next_rel) {
+        if (rel->channel->number == message[1]) {
+            channel = rel->channel;
+            break;
+        }
+    }
+
+    switch (message[0]) {
+    case HOSTBRIDGE_GEN2_RELIABLE_ENABLE:
+    case HOSTBRIDGE_GEN2_RELIABLE_DISABLE:
+        if (!channel) {
+            send_message(HOSTBRIDGE_GEN2_RELIABLE_DISABLE, message[1], 0);
+            break;
+        }
+        ALT_SEM_PEND(state.lock, 0);
+        reset_channel(channel);
+        ALT_SEM_POST(state.lock);
+        // Reply before switching, so that the reply itself is sent without framing
+        send_message(message[0], message[1], 0);
+        channel->reliable = (message[0] == HOSTBRIDGE_GEN2_RELIABLE_ENABLE) ? 1 : 0;
+        break;
+    case HOSTBRIDGE_GEN2_RELIABLE_NAK:
+        if (channel && channel->reliable && (resend(channel, message[2]) < 0)) {
+            send_message(HOSTBRIDGE_GEN2_RELIABLE_LOST, message[1], message[2]);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * @func control_sink
+ * @brief Sink for reliable control channel
+ */
+static int control_sink(hostbridge_channel *channel, const void *ptr, int len)
+{
+    const alt_u8 *src = (const alt_u8 *)ptr;
+    int read_len;
+
+    for (read_len = 0; read_len < len; ++read_len) {
+        alt_u8 byte = *src++;
+        switch (byte) {
+        case AST_SOP:
+            state.inside_packet = 1;
+            state.eop_prefix = 0;
+            state.message_len = 0;
+            continue;
+        case AST_EOP_PREFIX:
+            state.eop_prefix = 1;
+            continue;
+        case AST_ESCAPE_PREFIX:
+            state.escape_prefix = 1;
+            continue;
+        }
+        if (state.escape_prefix) {
+            byte ^= AST_ESCAPE_XOR;
+            state.escape_prefix = 0;
+        }
+        if (!state.inside_packet) {
+            continue;
+        }
+        if (state.message_len < sizeof(state.message)) {
+            state.message[state.message_len] = byte;
+        }
+        ++state.message_len;
+        if (state.eop_prefix) {
+            state.inside_packet = 0;
+            state.eop_prefix = 0;
+            HOSTBRIDGE_GEN2_STATS_ADD(channel, rx_packets, 1);
+            if (state.message_len == sizeof(state.message)) {
+                handle_message(state.message);
+            } else {
+                HOSTBRIDGE_GEN2_STATS_ADD(channel, rx_dropped, state.message_len);
+            }
+        }
+    }
+
+    return len;
+}
+
+/**
+ * @func peridot_sw_hostbridge_gen2_rel_init
+ * @brief Register reliable control channel
+ * @param transmit Function to send framed packet without further conversion
+ */
+int peridot_sw_hostbridge_gen2_rel_init(int (*transmit)(hostbridge_channel *channel, const void *ptr, int len))
+{
+#ifndef DIGESTS_CRC32_STATIC_TABLE
+    digest_crc32_init();
+#endif
+    ALT_SEM_CREATE(&state.lock, 1);
+    state.transmit = transmit;
+    state.channel.number = PERIDOT_SW_HOSTBRIDGE_GEN2_RELIABLE_CHANNEL;
+    state.channel.packetized = 1;
+    state.channel.priority = HOSTBRIDGE_GEN2_PRIORITY_URGENT;
+    state.channel.dest.sink = control_sink;
+    return peridot_sw_hostbridge_gen2_register_channel(&state.channel);
+}
+
+/**
+ * @func peridot_sw_hostbridge_gen2_rel_attach
+ * @brief Allocate state for recoverable channel
+ * @param channel Channel
+ * @note State is allocated at registration so that enabling framing never fails.
+ */
+int peridot_sw_hostbridge_gen2_rel_attach(hostbridge_channel *channel)
+{
+    if (!channel->rel) {
+        channel->rel = (hostbridge_rel *)calloc(1, sizeof(hostbridge_rel));
+        if (!channel->rel) {
+            return -ENOMEM;
+        }
+        channel->rel->channel = channel;
+        channel->rel->next_rel = state.first;
+        state.first = channel->rel;
+    }
+    channel->reliable = 0;
+    return 0;
+}
+
+/**
+ * @func peridot_sw_hostbridge_gen2_rel_encode
+ * @brief Add sequence number and CRC to packet, and keep it in history
+ * @param channel Channel (reliable framing enabled)
+ * @param iov Array of segments
+ * @param iovcnt Number of segments
+ * @param len Total length of segments (must be positive)
+ * @param out Pointer to store framed packet
+ * @return Length of framed packet (or negative errno)
+ * @note On success, peridot_sw_hostbridge_gen2_rel_release() must be called
+ *       after the framed packet is consumed. Packets are kept in order of
+ *       sequence numbers because the lock is held until then.
+ */
+int peridot_sw_hostbridge_gen2_rel_encode(hostbridge_channel *channel, const hostbridge_iovec *iov, int iovcnt, int len, const alt_u8 **out)
+{
+    hostbridge_rel *rel = channel->rel;
+    int slot;
+    alt_u8 *frame;
+    digest_crc32_t crc;
+    int i;
+
+    if (len > INT_MAX - REL_OVERHEAD) {
+        return -EMSGSIZE;
+    }
+
+    ALT_SEM_PEND(state.lock, 0);
+
+    slot = rel->next % PERIDOT_SW_HOSTBRIDGE_GEN2_RELIABLE_HISTORY;
+    if (rel->capacities[slot] < (len + REL_OVERHEAD)) {
+        free(rel->frames[slot]);
+        rel->frames[slot] = (alt_u8 *)malloc(len + REL_OVERHEAD);
+        rel->capacities[slot] = rel->frames[slot] ? (len + REL_OVERHEAD) : 0;
+        rel->lengths[slot] = 0;
+        if (!rel->frames[slot]) {
+            ALT_SEM_POST(state.lock);
+            return -ENOMEM;
+        }
+    }
+
+    frame = rel->frames[slot];
+    frame[0] = rel->next;
+    for (i = 0, len = 1; i < iovcnt; ++i) {
+        memcpy(frame + len, iov[i].base, iov[i].len);
+        len += iov[i].len;
+    }
+    digest_crc32_calc(&crc, frame, len);
+    frame[len++] = (crc >>  0) & 0xff;
+    frame[len++] = (crc >>  8) & 0xff;
+    frame[len++] = (crc >> 16) & 0xff;
+    frame[len++] = (crc >> 24) & 0xff;
+    rel->lengths[slot] = len;
+    ++rel->next;
+
+    *out = frame;
+    return len;
+}
+
+/**
+ * @func peridot_sw_hostbridge_gen2_rel_release
+ * @brief Release packet framed by peridot_sw_hostbridge_gen2_rel_encode()
+ */
+void peridot_sw_hostbridge_gen2_rel_release(void)
+{
+    ALT_SEM_POST(state.lock);
+}
+
+/**
+ * @func reject_packet
+ * @brief Drop packet from host and request retransmission
+ * @param channel Channel
+ * @param len Length of dropped data
+ */
+static void reject_packet(hostbridge_channel *channel, int len)
+{
+    hostbridge_rel *rel = channel->rel;
+
+    HOSTBRIDGE_GEN2_STATS_ADD(channel, rx_dropped, len);
+    if (!rel->nak_sent) {
+        rel->nak_sent = 1;
+        send_message(HOSTBRIDGE_GEN2_RELIABLE_NAK, channel->number, rel->expected);
+    }
+}
+
+/**
+ * @func flush_released
+ * @brief Pass released bytes to sink with CRC updated
+ */
+static void flush_released(hostbridge_channel *channel, const alt_u8 *plain, int len,
+                           void (*deliver)(hostbridge_channel *, const alt_u8 *, int))
+{
+    alt_u8 buffer[REL_DELIVER_CHUNK * 2];
+    int buffered = 0;
+    int i;
+
+    digest_crc32_update(&channel->rel->crc, plain, len);
+    for (i = 0; i < len; ++i) {
+        alt_u8 byte = plain[i];
+        if (AST_NEEDS_ESCAPE(byte)) {
+            buffer[buffered++] = AST_ESCAPE_PREFIX;
+            byte ^= AST_ESCAPE_XOR;
+        }
+        buffer[buffered++] = byte;
+    }
+    (*deliver)(channel, buffer, buffered);
+}
+
+/**
+ * @func complete_packet
+ * @brief Verify CRC and pass the last byte with EOP to sink
+ * @return Non-zero if packet is accepted
+ */
+static int complete_packet(hostbridge_channel *channel,
+                           void (*deliver)(hostbridge_channel *, const alt_u8 *, int))
+{
+    hostbridge_rel *rel = channel->rel;
+    alt_u8 buffer[3];
+    int buffered = 0;
+    digest_crc32_t received;
+
+    if (rel->held < REL_HOLD_LEN) {
+        // Too short
+        return 0;
+    }
+    digest_crc32_update(&rel->crc, rel->hold, 1);
+    received = ((digest_crc32_t)rel->hold[1] <<  0) |
+               ((digest_crc32_t)rel->hold[2] <<  8) |
+               ((digest_crc32_t)rel->hold[3] << 16) |
+               ((digest_crc32_t)rel->hold[4] << 24);
+    if (rel->crc != received) {
+        return 0;
+    }
+    buffer[buffered++] = AST_EOP_PREFIX;
+    if (AST_NEEDS_ESCAPE(rel->hold[0])) {
+        buffer[buffered++] = AST_ESCAPE_PREFIX;
+        buffer[buffered++] = rel->hold[0] ^ AST_ESCAPE_XOR;
+    } else {
+        buffer[buffered++] = rel->hold[0];
+    }
+    (*deliver)(channel, buffer, buffered);
+    return 1;
+}
+
+/**
+ * @func peridot_sw_hostbridge_gen2_rel_sink
+ * @brief Receive packets from host on channel with reliable framing
+ * @param channel Channel (packetized)
+ * @param ptr Pointer to received data (with SOP/EOP and escapes)
+ * @param len Length of received data
+ * @param deliver Function to pass data to sink of channel
+ * @note Sink of channel receives packets without sequence numbers and CRCs.
+ */
+void peridot_sw_hostbridge_gen2_rel_sink(hostbridge_channel *channel, const alt_u8 *ptr, int len,
+                                         void (*deliver)(hostbridge_channel *, const alt_u8 *, int))
+{
+    static const alt_u8 sop = AST_SOP;
+    hostbridge_rel *rel = channel->rel;
+    alt_u8 plain[REL_DELIVER_CHUNK];
+    int released = 0;
+    const alt_u8 *src = ptr;
+    const alt_u8 *end = ptr + len;
+
+    while (src < end) {
+        alt_u8 byte = *src++;
+        switch (byte) {
+        case AST_SOP:
+            if (released > 0) {
+                flush_released(channel, plain, released, deliver);
+                released = 0;
+            }
+            if (rel->mode == REL_RX_DATA) {
+                // EOP of previous packet is lost
+                reject_packet(channel, rel->rx_len);
+            }
+            rel->mode = REL_RX_SEQUENCE;
+            rel->eop_prefix = 0;
+            rel->rx_len = 0;
+            continue;
+        case AST_EOP_PREFIX:
+            rel->eop_prefix = 1;
+            continue;
+        case AST_ESCAPE_PREFIX:
+            rel->escape_prefix = 1;
+            continue;
+        }
+        if (rel->escape_prefix) {
+            byte ^= AST_ESCAPE_XOR;
+            rel->escape_prefix = 0;
+        }
+        ++rel->rx_len;
+
+        switch (rel->mode) {
+        case REL_RX_SEQUENCE:
+            if (byte == rel->expected) {
+                // NAK again if this (possibly resent) packet is also broken
+                rel->mode = REL_RX_DATA;
+                rel->nak_sent = 0;
+                rel->held = 0;
+                rel->crc = 0;
+                digest_crc32_update(&rel->crc, &byte, 1);
+                (*deliver)(channel, &sop, 1);
+            } else if ((alt_u8)(rel->expected - byte) <= 128) {
+                // Duplicate of accepted packet (sent again by NAK)
+                rel->mode = REL_RX_SKIP;
+                HOSTBRIDGE_GEN2_STATS_ADD(channel, rx_dropped, 1);
+            } else {
+                // Packet(s) lost
+                rel->mode = REL_RX_SKIP;
+                reject_packet(channel, 1);
+            }
+            if (rel->eop_prefix) {
+                if (rel->mode == REL_RX_DATA) {
+                    reject_packet(channel, 1);
+                }
+                rel->mode = REL_RX_IDLE;
+            }
+            break;
+        case REL_RX_DATA:
+            if (rel->held == REL_HOLD_LEN) {
+                // Oldest held byte is neither the last payload byte nor CRC
+                plain[released++] = rel->hold[0];
+                memmove(rel->hold, rel->hold + 1, REL_HOLD_LEN - 1);
+                --rel->held;
+                if (released == REL_DELIVER_CHUNK) {
+                    flush_released(channel, plain, released, deliver);
+                    released = 0;
+                }
+            }
+            rel->hold[rel->held++] = byte;
+            if (rel->eop_prefix) {
+                if (released > 0) {
+                    flush_released(channel, plain, released, deliver);
+                    released = 0;
+                }
+                if (complete_packet(channel, deliver)) {
+                    ++rel->expected;
+                    rel->nak_sent = 0;
+                } else {
+                    reject_packet(channel, rel->rx_len);
+                }
+                rel->mode = REL_RX_IDLE;
+            }
+            break;
+        case REL_RX_SKIP:
+            if (rel->eop_prefix) {
+                HOSTBRIDGE_GEN2_STATS_ADD(channel, rx_dropped, rel->rx_len - 1);
+                rel->mode = REL_RX_IDLE;
+            }
+            break;
+        default:
+            break;
+        }
+        rel->eop_prefix = 0;
+    }
+
+    if (released > 0) {
+        flush_released(channel, plain, released, deliver);
+    }
+}
+#endif  /* PERIDOT_SW_HOSTBRIDGE_GEN2_RELIABLE */
@@ -14,7 +14,12 @@ set_sw_property bsp_subdirectory services
 
 add_sw_property c_source HAL/src/peridot_sw_hostbridge_gen2.c
 add_sw_property c_source HAL/src/peridot_sw_hostbridge_gen2_avm.c
+add_sw_property c_source HAL/src/peridot_sw_hostbridge_gen2_capture.c
+add_sw_property c_source HAL/src/peridot_sw_hostbridge_gen2_direct.c
+add_sw_property c_source HAL/src/peridot_sw_hostbridge_gen2_hal.c
+add_sw_property c_source HAL/src/peridot_sw_hostbridge_gen2_lz.c
 add_sw_property c_source HAL/src/peridot_sw_hostbridge_gen2_pipe.c
+add_sw_property c_source HAL/src/peridot_sw_hostbridge_gen2_reliable.c
 
 add_sw_property include_source HAL/inc/peridot_sw_hostbridge_gen2.h
 add_sw_property include_directory inc
@@ -25,5 +30,26 @@ add_sw_property supported_bsp_type HAL
 # BSP settings...
 #
 add_sw_setting boolean_define_only system_h_define use_receiver_thread PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD 0 "Use receiver thread in multi-thread system"
+add_sw_setting decimal_number system_h_define channels PERIDOT_SW_HOSTBRIDGE_GEN2_CHANNELS 256 "Size of channel table (channel numbers from 0 to this value minus 1 can be registered). Each entry uses 4 bytes."
+add_sw_setting decimal_number system_h_define tx_queue_depth PERIDOT_SW_HOSTBRIDGE_GEN2_TX_QUEUE_DEPTH 0 "Maximum number of encoded frames queued for transmission (0: disable TX queue and write to UART in caller's context). Queued frames are written by a flush thread when receiver thread is used, otherwise by peridot_sw_hostbridge_gen2_service(). Frames of channels with higher priority can interrupt a long frame."
+add_sw_setting decimal_number system_h_define coalesce_size PERIDOT_SW_HOSTBRIDGE_GEN2_COALESCE_SIZE 0 "Size of buffer to gather small non-packetized writes of each channel (0: disable). Gathered data is sent in a burst when the buffer is full, when coalesce_ms passes, or before other writes on the same channel. Each channel allocates the buffer at its first small write."
+add_sw_setting decimal_number system_h_define coalesce_ms PERIDOT_SW_HOSTBRIDGE_GEN2_COALESCE_MS 2 "Maximum time in milliseconds to keep small writes in coalescing buffer (rounded down to system ticks). Without receiver thread, buffers are flushed by peridot_sw_hostbridge_gen2_service()."
+add_sw_setting decimal_number system_h_define links PERIDOT_SW_HOSTBRIDGE_GEN2_LINKS 1 "Number of physical links (UARTs) to host. Each channel is pinned to the link selected by its 'link' field (data from host for the channel is accepted only on that link). Link 0 uses UART named 'hostbridge' by default, and other links are started when peridot_sw_hostbridge_gen2_set_link_transport() is called (e.g. from main())."
+add_sw_setting boolean_define_only system_h_define manual_start PERIDOT_SW_HOSTBRIDGE_GEN2_MANUAL_START 0 "Do not start link 0 in initialization (alt_sys_init). Call peridot_sw_hostbridge_gen2_set_transport() from application to start it (e.g. with peridot_sw_hostbridge_gen2_hal_transport wrapped by peridot_sw_hostbridge_gen2_capture()). Not used with direct_uart."
+add_sw_setting boolean_define_only system_h_define rx_event PERIDOT_SW_HOSTBRIDGE_GEN2_RX_EVENT 0 "Read UART only after peridot_sw_hostbridge_gen2_notify_rx() is called by UART driver. Receiver thread sleeps while the link is idle, and peridot_sw_hostbridge_gen2_service() returns without reading. Applies only to links whose transports have notify_rx set (e.g. direct_uart). Other links (including HAL UART transport) are read as without this setting."
+add_sw_setting boolean_define_only system_h_define flow_control PERIDOT_SW_HOSTBRIDGE_GEN2_FLOW_CONTROL 0 "Use credit-based flow control for pipes. Free space of each pipe is advertised to host over credit channel, and host must not send more data than credited."
+add_sw_setting decimal_number system_h_define credit_channel PERIDOT_SW_HOSTBRIDGE_GEN2_CREDIT_CHANNEL 2 "Channel number for credit messages of flow control"
+add_sw_setting boolean_define_only system_h_define statistics PERIDOT_SW_HOSTBRIDGE_GEN2_STATISTICS 0 "Count traffic of each channel and time blocked by UART"
+add_sw_setting boolean_define_only system_h_define compression PERIDOT_SW_HOSTBRIDGE_GEN2_COMPRESSION 0 "Allow host to enable LZF compression of packets on channels marked as compressible. Compression is off until host requests it, so that older hosts still work."
+add_sw_setting decimal_number system_h_define compress_max_packet PERIDOT_SW_HOSTBRIDGE_GEN2_COMPRESS_MAX_PACKET 1024 "Maximum length of packet (before and after compression) handled by compression. Larger packets are sent without compression. Each compressible channel allocates a receive buffer of this size, and a work buffer of this size is shared for decompression. Each packet being compressed allocates an output buffer of its length until it is sent."
+add_sw_setting boolean_define_only system_h_define reliable PERIDOT_SW_HOSTBRIDGE_GEN2_RELIABLE 0 "Allow host to enable reliable framing (sequence number and CRC-32 for each packet, with retransmission by NAK) on channels marked as recoverable. Requires digests package with CRC-32 enabled."
+add_sw_setting decimal_number system_h_define reliable_channel PERIDOT_SW_HOSTBRIDGE_GEN2_RELIABLE_CHANNEL 3 "Channel number for control messages of reliable framing"
+add_sw_setting decimal_number system_h_define reliable_history PERIDOT_SW_HOSTBRIDGE_GEN2_RELIABLE_HISTORY 4 "Number of packets kept for retransmission on each recoverable channel (1 to 128)"
+add_sw_setting boolean_define_only system_h_define block_framing PERIDOT_SW_HOSTBRIDGE_GEN2_BLOCK_FRAMING 0 "Allow host to switch non-packetized channels to block framing (length-prefixed blocks whose payload is not escaped). Framing is unchanged until host requests it."
+add_sw_setting boolean_define_only system_h_define direct_uart PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_UART 0 "Drive UART 'hostbridge' (altera_avalon_uart) by registers instead of HAL driver. Data from host is decoded in RX interrupt handler and stored into a ring of each registered channel, and data to host is written by TX interrupt handler. Interrupt handler of HAL driver is replaced, so do not open /dev/hostbridge. Use with rx_event to wake receiver by interrupt."
+add_sw_setting decimal_number system_h_define direct_rx_ring PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_RX_RING 256 "Size of RX ring allocated for each registered channel with direct_uart (power of 2). While the ring is full, RX interrupt is masked (and RTS is deasserted if UART has CTS/RTS). Without CTS/RTS, the host must not send more than the ring holds to a channel before it is drained, or bytes are lost by UART overrun."
+add_sw_setting decimal_number system_h_define direct_tx_ring PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_TX_RING 256 "Size of TX ring with direct_uart (power of 2)"
+add_sw_setting boolean_define_only system_h_define telemetry PERIDOT_SW_HOSTBRIDGE_GEN2_TELEMETRY 0 "Export telemetry block (traffic counters, queue depths, heap usage, worker states) which host can read with one AVM burst read"
+add_sw_setting unquoted_string system_h_define telemetry_base PERIDOT_SW_HOSTBRIDGE_GEN2_TELEMETRY_BASE 0x10000100 "Host-side AVM address of telemetry block"
 
 # End of file
@@ -0,0 +1,37 @@
+/*
+ * Minimal HAL headers for building hostbridge on Linux (tools only)
+ * Registers of UART are emulated by uart_model.c.
+ */
+#ifndef __ALTERA_AVALON_UART_REGS_H__
+#define __ALTERA_AVALON_UART_REGS_H__
+
+#include "alt_types.h"
+
+extern alt_u32 uart_model_read(alt_u32 base, int reg);
+extern void uart_model_write(alt_u32 base, int reg, alt_u32 data);
+
+#define ALTERA_AVALON_UART_RXDATA_REG   0
+#define ALTERA_AVALON_UART_TXDATA_REG   1
+#define ALTERA_AVALON_UART_STATUS_REG   2
+#define ALTERA_AVALON_UART_CONTROL_REG  3
+
+#define IORD_ALTERA_AVALON_UART_RXDATA(base)        uart_model_read(base, ALTERA_AVALON_UART_RXDATA_REG)
+#define IOWR_ALTERA_AVALON_UART_TXDATA(base, data)  uart_model_write(base, ALTERA_AVALON_UART_TXDATA_REG, data)
+#define IORD_ALTERA_AVALON_UART_STATUS(base)        uart_model_read(base, ALTERA_AVALON_UART_STATUS_REG)
+#define IOWR_ALTERA_AVALON_UART_STATUS(base, data)  uart_model_write(base, ALTERA_AVALON_UART_STATUS_REG, data)
+#define IORD_ALTERA_AVALON_UART_CONTROL(base)       uart_model_read(base, ALTERA_AVALON_UART_CONTROL_REG)
+#define IOWR_ALTERA_AVALON_UART_CONTROL(base, data) uart_model_write(base, ALTERA_AVALON_UART_CONTROL_REG, data)
+
+#define ALTERA_AVALON_UART_STATUS_PE_MSK    (0x1)
+#define ALTERA_AVALON_UART_STATUS_FE_MSK    (0x2)
+#define ALTERA_AVALON_UART_STATUS_BRK_MSK   (0x4)
+#define ALTERA_AVALON_UART_STATUS_ROE_MSK   (0x8)
+#define ALTERA_AVALON_UART_STATUS_TMT_MSK   (0x20)
+#define ALTERA_AVALON_UART_STATUS_TRDY_MSK  (0x40)
+#define ALTERA_AVALON_UART_STATUS_RRDY_MSK  (0x80)
+
+#define ALTERA_AVALON_UART_CONTROL_TRDY_MSK (0x40)
+#define ALTERA_AVALON_UART_CONTROL_RRDY_MSK (0x80)
+#define ALTERA_AVALON_UART_CONTROL_RTS_MSK  (0x800)
+
+#endif  /* __ALTERA_AVALON_UART_REGS_H__ */
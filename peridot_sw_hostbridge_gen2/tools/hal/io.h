@@ -0,0 +1,16 @@
+/*
+ * Minimal HAL headers for building hostbridge on Linux (tools only)
+ * Included by rubic_agent.c, which accesses registers only when
+ * dual boot IP is configured (never in tools).
+ */
+#ifndef __IO_H__
+#define __IO_H__
+
+#include "alt_types.h"
+
+#define IORD(base, offset) \
+    (((volatile alt_u32 *)(base))[offset])
+#define IOWR(base, offset, data) \
+    (((volatile alt_u32 *)(base))[offset] = (data))
+
+#endif  /* __IO_H__ */
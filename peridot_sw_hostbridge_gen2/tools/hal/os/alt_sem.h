@@ -0,0 +1,19 @@
+/*
+ * Minimal HAL headers for building hostbridge on Linux (tools only)
+ * Semaphores are mapped to POSIX semaphores, so that tests with
+ * receiver threads (-D__tinythreads__ and -lpthread) are serialized
+ * as on tinythreads.
+ */
+#ifndef __ALT_SEM_H__
+#define __ALT_SEM_H__
+
+#include <semaphore.h>
+
+#define ALT_SEM(sem)            sem_t sem
+#define ALT_STATIC_SEM(sem)     static sem_t sem
+#define ALT_EXTERN_SEM(sem)     extern sem_t sem
+#define ALT_SEM_CREATE(sem, v)  sem_init((sem), 0, (v))
+#define ALT_SEM_PEND(sem, t)    sem_wait(&(sem))
+#define ALT_SEM_POST(sem)       sem_post(&(sem))
+
+#endif  /* __ALT_SEM_H__ */
@@ -0,0 +1,14 @@
+/*
+ * Minimal HAL headers for building hostbridge on Linux (tools only)
+ */
+#ifndef __ALT_FILE_H__
+#define __ALT_FILE_H__
+
+#include "sys/alt_dev.h"
+#include "os/alt_sem.h"   /* Included by HAL, and pipes depend on it */
+
+#define ALT_MAX_FD  32
+
+extern alt_fd alt_fd_list[ALT_MAX_FD];
+
+#endif  /* __ALT_FILE_H__ */
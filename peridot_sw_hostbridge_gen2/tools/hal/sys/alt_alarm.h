@@ -0,0 +1,31 @@
+/*
+ * Minimal HAL headers for building hostbridge on Linux (tools only)
+ */
+#ifndef __ALT_ALARM_H__
+#define __ALT_ALARM_H__
+
+#include <time.h>
+#include "alt_types.h"
+
+typedef struct alt_alarm_s {
+    alt_u32 nticks;
+    alt_u32 (*callback)(void *context);
+    void *context;
+} alt_alarm;
+
+/* Implemented by tools which use alarms (e.g. coalescing with receiver thread) */
+extern int alt_alarm_start(alt_alarm *alarm, alt_u32 nticks, alt_u32 (*callback)(void *context), void *context);
+
+static inline alt_u32 alt_ticks_per_second(void)
+{
+    return 1000;
+}
+
+static inline alt_u32 alt_nticks(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (alt_u32)ts.tv_sec * 1000u + ts.tv_nsec / 1000000;
+}
+
+#endif  /* __ALT_ALARM_H__ */
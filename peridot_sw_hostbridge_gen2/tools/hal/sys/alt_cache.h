@@ -0,0 +1,12 @@
+/*
+ * Minimal HAL headers for building hostbridge on Linux (tools only)
+ * Host memory is coherent, so cache operations do nothing.
+ */
+#ifndef __ALT_CACHE_H__
+#define __ALT_CACHE_H__
+
+static inline void alt_dcache_flush(void *start, unsigned long len)
+{
+}
+
+#endif  /* __ALT_CACHE_H__ */
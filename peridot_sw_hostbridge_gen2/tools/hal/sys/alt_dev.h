@@ -0,0 +1,33 @@
+/*
+ * Minimal HAL headers for building hostbridge on Linux (tools only)
+ * Used by pipes (peridot_sw_hostbridge_gen2_pipe.c), which are accessed
+ * through alt_fd_list[] defined by each tool instead of open()/read()/write().
+ */
+#ifndef __ALT_DEV_H__
+#define __ALT_DEV_H__
+
+#include <sys/stat.h>
+#include "alt_types.h"
+#include "sys/alt_llist.h"
+
+struct alt_dev_s;
+
+typedef struct alt_fd_s {
+    struct alt_dev_s *dev;
+    alt_u8 *priv;
+    int fd_flags;
+} alt_fd;
+
+typedef struct alt_dev_s {
+    alt_llist llist;
+    const char *name;
+    int (*open)(alt_fd *fd, const char *name, int flags, int mode);
+    int (*close)(alt_fd *fd);
+    int (*read)(alt_fd *fd, char *ptr, int len);
+    int (*write)(alt_fd *fd, const char *ptr, int len);
+    int (*lseek)(alt_fd *fd, int ptr, int dir);
+    int (*fstat)(alt_fd *fd, struct stat *buf);
+    int (*ioctl)(alt_fd *fd, int req, void *arg);
+} alt_dev;
+
+#endif  /* __ALT_DEV_H__ */
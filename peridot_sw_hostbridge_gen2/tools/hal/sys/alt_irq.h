@@ -0,0 +1,20 @@
+/*
+ * Minimal HAL headers for building hostbridge on Linux (tools only)
+ * Interrupts are emulated by uart_model.c (other tools which need
+ * alt_irq_disable_all() and alt_irq_enable_all() define them by themselves).
+ */
+#ifndef __ALT_IRQ_H__
+#define __ALT_IRQ_H__
+
+#include "alt_types.h"
+
+#define ALT_ENHANCED_INTERRUPT_API_PRESENT
+
+typedef int alt_irq_context;
+typedef void (*alt_isr_func)(void *isr_context);
+
+extern int alt_ic_isr_register(alt_u32 ic_id, alt_u32 irq, alt_isr_func isr, void *isr_context, void *flags);
+extern alt_irq_context alt_irq_disable_all(void);
+extern void alt_irq_enable_all(alt_irq_context context);
+
+#endif  /* __ALT_IRQ_H__ */
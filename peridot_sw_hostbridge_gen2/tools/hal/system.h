@@ -0,0 +1,14 @@
+/*
+ * Minimal HAL headers for building hostbridge on Linux (tools only)
+ * Settings of hostbridge (and other packages) are given by -D options instead.
+ */
+#ifndef __SYSTEM_H_
+#define __SYSTEM_H_
+
+// UART 'hostbridge' emulated by uart_model.c (used with direct_uart)
+#define HOSTBRIDGE_BASE                         0
+#define HOSTBRIDGE_IRQ                          0
+#define HOSTBRIDGE_IRQ_INTERRUPT_CONTROLLER_ID  0
+#define HOSTBRIDGE_USE_CTS_RTS                  1
+
+#endif  /* __SYSTEM_H_ */
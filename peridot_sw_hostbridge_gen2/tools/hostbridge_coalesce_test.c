@@ -0,0 +1,241 @@
+/*
+ * Ordering test of coalesced writes (runs on Linux host)
+ *
+ * Firmware side sends random bytes to channel 3 with a mix of small writes
+ * (buffered by coalescing and flushed by coalescer thread after coalesce_ms)
+ * and large writes (sent directly). A thread acting as host decodes the
+ * stream and compares it with what was sent, so that a large write must
+ * never overtake small writes buffered before it.
+ * Another thread keeps sending large writes to channel 4, and send buffer
+ * of socket is small, so that flushes often wait for the link.
+ *
+ * Build (in this directory):
+ *   gcc -O2 -D_GNU_SOURCE -D__tinythreads__ \
+ *       -DPERIDOT_SW_HOSTBRIDGE_GEN2_TRANSPORT_POSIX \
+ *       -DPERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD \
+ *       -DPERIDOT_SW_HOSTBRIDGE_GEN2_COALESCE_SIZE=64 \
+ *       -DPERIDOT_SW_HOSTBRIDGE_GEN2_COALESCE_MS=1 -Ihal -I../HAL/inc \
+ *       hostbridge_coalesce_test.c ../HAL/src/peridot_sw_hostbridge_gen2.c \
+ *       ../HAL/src/peridot_sw_hostbridge_gen2_avm.c \
+ *       ../HAL/src/peridot_sw_hostbridge_gen2_posix.c \
+ *       -lpthread -o hostbridge_coalesce_test
+ *
+ * Usage:
+ *   hostbridge_coalesce_test
+ *     Exit status is zero if passed.
+ */
+#include "system.h"
+#include "peridot_sw_hostbridge_gen2.h"
+#include "sys/alt_alarm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#if !defined(PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD) || \
+    !(PERIDOT_SW_HOSTBRIDGE_GEN2_COALESCE_SIZE > 0)
+# error "Build with receiver thread and coalesce_size (see above)"
+#endif
+
+#define TEST_CHANNEL    3
+#define OTHER_CHANNEL   4
+#define TEST_BYTES      (4 * 1024 * 1024)
+#define TEST_LARGE_MAX  1500
+#define TEST_SNDBUF     4096
+
+static hostbridge_transport transport;
+static hostbridge_channel channel;
+static hostbridge_channel other_channel;
+static int host_fd;
+static alt_u8 sent[TEST_BYTES];
+static alt_u8 received[TEST_BYTES];
+static volatile long received_len;
+static volatile int finished;
+
+/**
+ * @func alarm_thread
+ * @brief Call alarm callback after its ticks (1 tick = 1 ms)
+ */
+static void *alarm_thread(void *param)
+{
+    alt_alarm *alarm = (alt_alarm *)param;
+
+    usleep(alarm->nticks * 1000);
+    (*alarm->callback)(alarm->context);
+    return NULL;
+}
+
+int alt_alarm_start(alt_alarm *alarm, alt_u32 nticks, alt_u32 (*callback)(void *context), void *context)
+{
+    pthread_t tid;
+
+    alarm->nticks = nticks;
+    alarm->callback = callback;
+    alarm->context = context;
+    if (pthread_create(&tid, NULL, alarm_thread, alarm) != 0) {
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+/**
+ * @func discard_sink
+ * @brief Sink of test channel (nothing is sent from host)
+ */
+static int discard_sink(hostbridge_channel *ch, const void *ptr, int len)
+{
+    return len;
+}
+
+/**
+ * @func other_sender
+ * @brief Keep link busy with large writes to other channel
+ */
+static void *other_sender(void *param)
+{
+    static alt_u8 buffer[TEST_LARGE_MAX];
+
+    while (!finished) {
+        if (peridot_sw_hostbridge_gen2_source(&other_channel, buffer, sizeof(buffer), 0) < 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @func host_receiver
+ * @brief Decode data sent to host on test channel
+ */
+static void *host_receiver(void *param)
+{
+    alt_u8 buffer[1024];
+    int channel_prefix = 0;
+    int escape_prefix = 0;
+    int current = -1;
+
+    while (received_len < TEST_BYTES) {
+        int len = read(host_fd, buffer, sizeof(buffer));
+        int index;
+        if (len <= 0) {
+            perror("host read");
+            break;
+        }
+        for (index = 0; index < len; ++index) {
+            alt_u8 byte = buffer[index];
+            if (byte == AST_CHANNEL_PREFIX) {
+                channel_prefix = 1;
+                continue;
+            }
+            if (byte == AST_ESCAPE_PREFIX) {
+                escape_prefix = 1;
+                continue;
+            }
+            if (escape_prefix) {
+                byte ^= AST_ESCAPE_XOR;
+                escape_prefix = 0;
+            } else if ((byte == AST_SOP) || (byte == AST_EOP_PREFIX)) {
+                continue;
+            }
+            if (channel_prefix) {
+                current = byte;
+                channel_prefix = 0;
+                continue;
+            }
+            if ((current == TEST_CHANNEL) && (received_len < TEST_BYTES)) {
+                received[received_len++] = byte;
+            }
+        }
+    }
+    return NULL;
+}
+
+int main(void)
+{
+    pthread_t receiver, other;
+    unsigned int seed = 3;
+    int sndbuf = TEST_SNDBUF;
+    long offset;
+    int sv[2];
+    int result;
+    int failed = 0;
+
+    for (offset = 0; offset < TEST_BYTES; ++offset) {
+        sent[offset] = (alt_u8)rand_r(&seed);
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        perror("socketpair");
+        return 1;
+    }
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    host_fd = sv[1];
+    peridot_sw_hostbridge_gen2_posix_transport(&transport, sv[0]);
+    channel.number = TEST_CHANNEL;
+    channel.dest.sink = discard_sink;
+    other_channel.number = OTHER_CHANNEL;
+    other_channel.dest.sink = discard_sink;
+    result = peridot_sw_hostbridge_gen2_set_transport(&transport);
+    if (result == 0) {
+        result = peridot_sw_hostbridge_gen2_init();
+    }
+    if (result == 0) {
+        result = peridot_sw_hostbridge_gen2_register_channel(&channel);
+    }
+    if (result == 0) {
+        result = peridot_sw_hostbridge_gen2_register_channel(&other_channel);
+    }
+    if (result != 0) {
+        printf("initialization failed (%d)\n", result);
+        return 1;
+    }
+
+    alarm(120);
+    pthread_create(&receiver, NULL, host_receiver, NULL);
+    pthread_create(&other, NULL, other_sender, NULL);
+    for (offset = 0; offset < TEST_BYTES;) {
+        long len;
+        if (rand_r(&seed) % 2) {
+            len = rand_r(&seed) % (PERIDOT_SW_HOSTBRIDGE_GEN2_COALESCE_SIZE - 1) + 1;
+        } else {
+            len = rand_r(&seed) % (TEST_LARGE_MAX - PERIDOT_SW_HOSTBRIDGE_GEN2_COALESCE_SIZE) +
+                  PERIDOT_SW_HOSTBRIDGE_GEN2_COALESCE_SIZE;
+        }
+        if (len > TEST_BYTES - offset) {
+            len = TEST_BYTES - offset;
+        }
+        result = peridot_sw_hostbridge_gen2_source(&channel, sent + offset, len, 0);
+        if (result < 0) {
+            printf("source failed (%d)\n", result);
+            failed = 1;
+            break;
+        }
+        offset += len;
+        if (rand_r(&seed) % 16 == 0) {
+            // Let coalescer thread flush small writes
+            usleep(rand_r(&seed) % 1500);
+        }
+    }
+    if (!failed) {
+        // Last small writes are flushed after coalesce_ms
+        pthread_join(receiver, NULL);
+    }
+    finished = 1;
+    alarm(0);
+
+    printf("received: %ld/%d bytes\n", received_len, TEST_BYTES);
+    for (offset = 0; offset < received_len; ++offset) {
+        if (received[offset] != sent[offset]) {
+            printf("order broken at offset %ld\n", offset);
+            failed = 1;
+            break;
+        }
+    }
+    if (received_len != TEST_BYTES) {
+        failed = 1;
+    }
+    puts(failed ? "FAILED" : "passed");
+    return failed;
+}
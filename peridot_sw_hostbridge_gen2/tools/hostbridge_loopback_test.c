@@ -0,0 +1,260 @@
+/*
+ * Loopback test of hostbridge transports (runs on Linux host)
+ *
+ * A thread acting as host sends random bytes (including special bytes)
+ * to channel 3, and firmware side sends everything received on the
+ * channel back with peridot_sw_hostbridge_gen2_source(). The host thread
+ * decodes the response and compares it with what it sent.
+ * Before that, the transport must return zero when nothing is received,
+ * and peridot_sw_hostbridge_gen2_service() must return without data.
+ *
+ * Build with POSIX transport over socketpair (in this directory):
+ *   gcc -O2 -D_GNU_SOURCE -DPERIDOT_SW_HOSTBRIDGE_GEN2_TRANSPORT_POSIX \
+ *       -Ihal -I../HAL/inc hostbridge_loopback_test.c \
+ *       ../HAL/src/peridot_sw_hostbridge_gen2.c \
+ *       ../HAL/src/peridot_sw_hostbridge_gen2_avm.c \
+ *       ../HAL/src/peridot_sw_hostbridge_gen2_posix.c \
+ *       -lpthread -o hostbridge_loopback_test
+ *
+ * Build with HAL UART transport (file I/O) over pseudo terminal:
+ *   gcc -O2 -D_GNU_SOURCE -DHOSTBRIDGE_NAME='"/dev/hostbridge"' \
+ *       -Ihal -I../HAL/inc hostbridge_loopback_test.c \
+ *       ../HAL/src/peridot_sw_hostbridge_gen2.c \
+ *       ../HAL/src/peridot_sw_hostbridge_gen2_avm.c \
+ *       ../HAL/src/peridot_sw_hostbridge_gen2_hal.c \
+ *       -lpthread -lutil -o hostbridge_loopback_test_hal
+ *
+ * Usage:
+ *   hostbridge_loopback_test
+ *     Exit status is zero if passed.
+ */
+#include "system.h"
+#include "peridot_sw_hostbridge_gen2.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_TRANSPORT_POSIX
+# include <sys/socket.h>
+#else
+# include <pty.h>
+# include <termios.h>
+#endif
+
+#define TEST_CHANNEL    3
+#define TEST_BYTES      (256 * 1024)
+#define TEST_CHUNK_MAX  700
+
+static hostbridge_transport transport;
+static hostbridge_channel channel;
+static int host_fd;
+static alt_u8 sent[TEST_BYTES];
+static alt_u8 echoed[TEST_BYTES];
+static volatile long echoed_len;
+static alt_u8 pending[TEST_BYTES];
+static volatile long pending_len;
+static long pending_sent;
+
+/**
+ * @func loopback_sink
+ * @brief Keep data received on channel (sent back from main loop)
+ */
+static int loopback_sink(hostbridge_channel *ch, const void *ptr, int len)
+{
+    if (len > TEST_BYTES - pending_len) {
+        len = TEST_BYTES - pending_len;
+    }
+    memcpy(pending + pending_len, ptr, len);
+    pending_len += len;
+    return len;
+}
+
+/**
+ * @func host_sender
+ * @brief Send escaped data to channel in random chunks
+ */
+static void *host_sender(void *param)
+{
+    static alt_u8 stream[2 + TEST_BYTES * 2];
+    unsigned int seed = 1;
+    long stream_len = 0;
+    long offset;
+    long index;
+
+    stream[stream_len++] = AST_CHANNEL_PREFIX;
+    stream[stream_len++] = TEST_CHANNEL;
+    for (index = 0; index < TEST_BYTES; ++index) {
+        alt_u8 byte = sent[index];
+        if (AST_NEEDS_ESCAPE(byte)) {
+            stream[stream_len++] = AST_ESCAPE_PREFIX;
+            byte ^= AST_ESCAPE_XOR;
+        }
+        stream[stream_len++] = byte;
+    }
+    for (offset = 0; offset < stream_len;) {
+        int len = rand_r(&seed) % TEST_CHUNK_MAX + 1;
+        int written;
+        if (len > stream_len - offset) {
+            len = stream_len - offset;
+        }
+        written = write(host_fd, stream + offset, len);
+        if (written <= 0) {
+            perror("host write");
+            break;
+        }
+        offset += written;
+    }
+    return NULL;
+}
+
+/**
+ * @func host_receiver
+ * @brief Decode data sent back from channel
+ */
+static void *host_receiver(void *param)
+{
+    alt_u8 buffer[1024];
+    int channel_prefix = 0;
+    int escape_prefix = 0;
+    int current = -1;
+
+    while (echoed_len < TEST_BYTES) {
+        int len = read(host_fd, buffer, sizeof(buffer));
+        int index;
+        if (len <= 0) {
+            perror("host read");
+            break;
+        }
+        for (index = 0; index < len; ++index) {
+            alt_u8 byte = buffer[index];
+            if (byte == AST_CHANNEL_PREFIX) {
+                channel_prefix = 1;
+                continue;
+            }
+            if (byte == AST_ESCAPE_PREFIX) {
+                escape_prefix = 1;
+                continue;
+            }
+            if (escape_prefix) {
+                byte ^= AST_ESCAPE_XOR;
+                escape_prefix = 0;
+            } else if ((byte == AST_SOP) || (byte == AST_EOP_PREFIX)) {
+                continue;
+            }
+            if (channel_prefix) {
+                current = byte;
+                channel_prefix = 0;
+                continue;
+            }
+            if ((current == TEST_CHANNEL) && (echoed_len < TEST_BYTES)) {
+                echoed[echoed_len++] = byte;
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @func open_host
+ * @brief Connect host side and prepare transport
+ * @return 0 on success, -1 on error
+ */
+static int open_host(void)
+{
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_TRANSPORT_POSIX
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        perror("socketpair");
+        return -1;
+    }
+    host_fd = sv[1];
+    peridot_sw_hostbridge_gen2_posix_transport(&transport, sv[0]);
+#else
+    static char name[64];
+    struct termios tio;
+    int slave_fd;
+
+    if (openpty(&host_fd, &slave_fd, name, NULL, NULL) != 0) {
+        perror("openpty");
+        return -1;
+    }
+    // Pass bytes as they are (Slave is kept open to keep settings)
+    tcgetattr(slave_fd, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slave_fd, TCSANOW, &tio);
+    tcgetattr(host_fd, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(host_fd, TCSANOW, &tio);
+    peridot_sw_hostbridge_gen2_uart_transport(&transport, name);
+#endif
+    return 0;
+}
+
+int main(void)
+{
+    pthread_t sender, receiver;
+    alt_u8 buffer[64];
+    unsigned int seed = 2;
+    long index;
+    int result;
+    int failed = 0;
+
+    for (index = 0; index < TEST_BYTES; ++index) {
+        sent[index] = (rand_r(&seed) % 4) ? (alt_u8)rand_r(&seed) : (AST_SOP + (index % 4));
+    }
+    if (open_host() < 0) {
+        return 1;
+    }
+    channel.number = TEST_CHANNEL;
+    channel.dest.sink = loopback_sink;
+    result = peridot_sw_hostbridge_gen2_set_transport(&transport);
+    if (result == 0) {
+        result = peridot_sw_hostbridge_gen2_init();
+    }
+    if (result == 0) {
+        result = peridot_sw_hostbridge_gen2_register_channel(&channel);
+    }
+    if (result != 0) {
+        printf("initialization failed (%d)\n", result);
+        return 1;
+    }
+
+    // Nothing received yet
+    alarm(5);
+    result = (*transport.read)(&transport, buffer, sizeof(buffer));
+    printf("read without data: %d\n", result);
+    if (result != 0) {
+        failed = 1;
+    }
+    peridot_sw_hostbridge_gen2_service();
+    alarm(0);
+
+    alarm(60);
+    pthread_create(&receiver, NULL, host_receiver, NULL);
+    pthread_create(&sender, NULL, host_sender, NULL);
+    while (echoed_len < TEST_BYTES) {
+        peridot_sw_hostbridge_gen2_service();
+        if (pending_sent < pending_len) {
+            long len = pending_len - pending_sent;
+            result = peridot_sw_hostbridge_gen2_source(&channel, pending + pending_sent, len, 0);
+            if (result < 0) {
+                printf("source failed (%d)\n", result);
+                failed = 1;
+                break;
+            }
+            pending_sent += len;
+        }
+    }
+    pthread_join(sender, NULL);
+    alarm(0);
+
+    printf("loopback: %ld/%d bytes\n", echoed_len, TEST_BYTES);
+    if ((echoed_len != TEST_BYTES) || memcmp(sent, echoed, TEST_BYTES)) {
+        failed = 1;
+    }
+    puts(failed ? "FAILED" : "passed");
+    return failed;
+}
@@ -0,0 +1,222 @@
+/*
+ * Round-trip test of packet compression (runs on Linux host)
+ *
+ * Packets are converted by peridot_sw_hostbridge_gen2_lz_encode(), framed
+ * as Avalon-ST packets (as they are sent to host), and given back to
+ * peridot_sw_hostbridge_gen2_lz_sink() (as if host sent them). The packet
+ * delivered to sink must be identical to the original one.
+ * Inputs cover incompressible data, all-zero data, and lengths around
+ * minimum length, literal run, match length and max_packet boundaries.
+ *
+ * Build (in this directory):
+ *   gcc -O2 -DPERIDOT_SW_HOSTBRIDGE_GEN2_COMPRESSION -Ihal -I../HAL/inc \
+ *       hostbridge_lz_test.c ../HAL/src/peridot_sw_hostbridge_gen2_lz.c \
+ *       -o hostbridge_lz_test
+ * Add -DPERIDOT_SW_HOSTBRIDGE_GEN2_COMPRESS_MAX_PACKET=<n> to test other
+ * max_packet settings.
+ *
+ * Usage:
+ *   hostbridge_lz_test
+ *     Exit status is zero if passed.
+ */
+#include "system.h"
+#include "peridot_sw_hostbridge_gen2.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_PACKET  PERIDOT_SW_HOSTBRIDGE_GEN2_COMPRESS_MAX_PACKET
+#define TEST_MAX    (MAX_PACKET + 64)
+
+extern int peridot_sw_hostbridge_gen2_lz_init(void);
+extern int peridot_sw_hostbridge_gen2_lz_attach(hostbridge_channel *channel);
+extern void peridot_sw_hostbridge_gen2_lz_enable(hostbridge_channel *channel, int enable);
+extern int peridot_sw_hostbridge_gen2_lz_encode(const hostbridge_iovec *iov, int iovcnt, int len, hostbridge_iovec **out);
+extern void peridot_sw_hostbridge_gen2_lz_release(hostbridge_iovec *iov);
+extern void peridot_sw_hostbridge_gen2_lz_sink(hostbridge_channel *channel, const alt_u8 *ptr, int len,
+                                               void (*deliver)(hostbridge_channel *, const alt_u8 *, int));
+
+static hostbridge_channel channel;
+static alt_u8 wire[TEST_MAX * 2 + 16];
+static alt_u8 received[TEST_MAX];
+static int received_len;
+static int received_packets;
+static int escape_prefix;
+static int eop_prefix;
+
+/**
+ * @func deliver
+ * @brief Parse packets passed to sink of channel
+ */
+static void deliver(hostbridge_channel *ch, const alt_u8 *ptr, int len)
+{
+    for (; len > 0; ++ptr, --len) {
+        alt_u8 byte = *ptr;
+        if (byte == AST_SOP) {
+            received_len = 0;
+            eop_prefix = 0;
+            continue;
+        }
+        if (byte == AST_EOP_PREFIX) {
+            eop_prefix = 1;
+            continue;
+        }
+        if (byte == AST_ESCAPE_PREFIX) {
+            escape_prefix = 1;
+            continue;
+        }
+        if (escape_prefix) {
+            byte ^= AST_ESCAPE_XOR;
+            escape_prefix = 0;
+        }
+        if (received_len < TEST_MAX) {
+            received[received_len] = byte;
+        }
+        ++received_len;
+        if (eop_prefix) {
+            eop_prefix = 0;
+            ++received_packets;
+        }
+    }
+}
+
+/**
+ * @func frame_packet
+ * @brief Convert segments into Avalon-ST packet
+ * @return Length of packet
+ */
+static int frame_packet(const hostbridge_iovec *iov, int iovcnt)
+{
+    int total = 0;
+    int len = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; ++i) {
+        total += iov[i].len;
+    }
+    wire[len++] = AST_SOP;
+    for (i = 0; i < iovcnt; ++i) {
+        const alt_u8 *src = (const alt_u8 *)iov[i].base;
+        int j;
+        for (j = 0; j < iov[i].len; ++j) {
+            alt_u8 byte = src[j];
+            if (--total == 0) {
+                wire[len++] = AST_EOP_PREFIX;
+            }
+            if (AST_NEEDS_ESCAPE(byte)) {
+                wire[len++] = AST_ESCAPE_PREFIX;
+                byte ^= AST_ESCAPE_XOR;
+            }
+            wire[len++] = byte;
+        }
+    }
+    return len;
+}
+
+/**
+ * @func round_trip
+ * @brief Test one packet
+ * @param name Name of input pattern
+ * @param data Packet
+ * @param len Length of packet (positive)
+ * @param segments Number of segments to split packet into
+ * @param shrink Non-zero if packet must be compressed
+ * @return Zero if passed
+ */
+static int round_trip(const char *name, const alt_u8 *data, int len, int segments, int shrink)
+{
+    hostbridge_iovec iov[4];
+    hostbridge_iovec *converted;
+    int iovcnt;
+    int converted_len = 0;
+    int wire_len;
+    int offset = 0;
+    int i;
+
+    for (i = 0; i < segments; ++i) {
+        int seg_len = (i == segments - 1) ? (len - offset) : (len / segments);
+        iov[i].base = data + offset;
+        iov[i].len = seg_len;
+        offset += seg_len;
+    }
+    iovcnt = peridot_sw_hostbridge_gen2_lz_encode(iov, segments, len, &converted);
+    if (iovcnt < 0) {
+        printf("%s (%d bytes): encode failed (%d)\n", name, len, iovcnt);
+        return 1;
+    }
+    for (i = 0; i < iovcnt; ++i) {
+        converted_len += converted[i].len;
+    }
+    if ((converted_len > len + 1) || (shrink && (converted_len >= len))) {
+        printf("%s (%d bytes): converted into %d bytes\n", name, len, converted_len);
+        peridot_sw_hostbridge_gen2_lz_release(converted);
+        return 1;
+    }
+    wire_len = frame_packet(converted, iovcnt);
+    peridot_sw_hostbridge_gen2_lz_release(converted);
+
+    // Give packet to sink in small pieces to test resumption
+    received_len = -1;
+    received_packets = 0;
+    for (offset = 0; offset < wire_len; offset += 7) {
+        int piece = wire_len - offset;
+        if (piece > 7) {
+            piece = 7;
+        }
+        peridot_sw_hostbridge_gen2_lz_sink(&channel, wire + offset, piece, deliver);
+    }
+    if ((received_packets != 1) || (received_len != len) || memcmp(received, data, len)) {
+        printf("%s (%d bytes): mismatch (%d packets, %d bytes received)\n",
+                name, len, received_packets, received_len);
+        return 1;
+    }
+    return 0;
+}
+
+int main(void)
+{
+    static const int lengths[] = {
+        1, 2, 3, 7, 8, 9, 31, 32, 33, 34, 263, 264, 265, 266,
+        MAX_PACKET / 2, MAX_PACKET - 1, MAX_PACKET, MAX_PACKET + 1, TEST_MAX,
+    };
+    static alt_u8 zero[TEST_MAX];
+    static alt_u8 noise[TEST_MAX];
+    static alt_u8 text[TEST_MAX];
+    static alt_u8 special[TEST_MAX];
+    unsigned int seed = 1;
+    int failed = 0;
+    int tests = 0;
+    unsigned int i;
+
+    for (i = 0; i < TEST_MAX; ++i) {
+        noise[i] = rand_r(&seed);
+        text[i] = "hostbridge gen2 packet "[i % 23];
+        special[i] = AST_SOP + (i % 4);
+    }
+    peridot_sw_hostbridge_gen2_lz_init();
+    channel.number = 1;
+    channel.packetized = 1;
+    if (peridot_sw_hostbridge_gen2_lz_attach(&channel) < 0) {
+        puts("attach failed");
+        return 1;
+    }
+    peridot_sw_hostbridge_gen2_lz_enable(&channel, 1);
+
+    for (i = 0; i < sizeof(lengths) / sizeof(*lengths); ++i) {
+        int len = lengths[i];
+        int segments;
+        for (segments = 1; segments <= 3; ++segments) {
+            int shrink = (len <= MAX_PACKET) && (len / segments >= 64);
+            if (len < segments) {
+                continue;
+            }
+            failed += round_trip("incompressible", noise, len, segments, 0);
+            failed += round_trip("all-zero", zero, len, segments, shrink);
+            failed += round_trip("repeated", text, len, segments, shrink);
+            failed += round_trip("special bytes", special, len, segments, shrink);
+            tests += 4;
+        }
+    }
+    printf("%d/%d passed (max_packet=%d)\n", tests - failed, tests, MAX_PACKET);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,651 @@
+/*
+ * Replay benchmark for hostbridge (runs on Linux host)
+ *
+ * Feeds bytes received from host in a capture file (recorded by
+ * peridot_sw_hostbridge_gen2_capture()) through
+ * peridot_sw_hostbridge_gen2_service() and registered sinks, and reports
+ * throughput, time spent in sink of each channel and number of allocations.
+ *
+ * Build (in this directory):
+ *   gcc -O2 -DPERIDOT_SW_HOSTBRIDGE_GEN2_TRANSPORT_POSIX -Ihal -I../HAL/inc \
+ *       hostbridge_replay.c ../HAL/src/peridot_sw_hostbridge_gen2.c \
+ *       ../HAL/src/peridot_sw_hostbridge_gen2_avm.c \
+ *       ../HAL/src/peridot_sw_hostbridge_gen2_lz.c -o hostbridge_replay
+ * Add other -D options (PERIDOT_SW_HOSTBRIDGE_GEN2_STATISTICS etc.) to
+ * match the BSP settings of the captured target.
+ * Receiver thread and TX queue are not supported in replay.
+ * To replay through direct UART driver, add
+ *   -DPERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_UART \
+ *       ../HAL/src/peridot_sw_hostbridge_gen2_direct.c uart_model.c
+ * Then bytes are given to the emulated UART registers, decoded by the
+ * interrupt handler, and passed to sinks by peridot_sw_hostbridge_gen2_service().
+ *
+ * Usage:
+ *   hostbridge_replay [-r <repeat>] [-o] [-p <channel>]... <capture file>
+ *   hostbridge_replay [-r <repeat>] [-o] -s <percent> [-n <bytes>]
+ *     -r  Replay the stream <repeat> times (default: 1)
+ *     -o  Also run the decoder used before single-pass decoding
+ *         (copied below) on the same stream, and compare throughput
+ *     -p  Treat data of <channel> as packets
+ *         (Channels without sinks in firmware get counting sinks)
+ *     -s  Replay synthetic stream for channel 1 instead of capture file,
+ *         where <percent> % of payload bytes need escape
+ *     -n  Payload length of synthetic stream (default: 4194304)
+ *   Exit status is non-zero if payload bytes of synthetic stream do not all
+ *   reach the sink, or bytes are lost by overrun of emulated UART.
+ */
+#include "system.h"
+#include "peridot_sw_hostbridge_gen2.h"
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_UART
+# include "uart_model.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#define CAPTURE_FILE_HEADER_LEN     12
+#define CAPTURE_RECORD_HEADER_LEN   8
+
+#define READ_BUFFER_LEN         256     // Same as hostbridge
+#define SYNTHETIC_CHANNEL       1
+#define SYNTHETIC_RECORD_LEN    1024
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+typedef struct replay_channel_s {
+    hostbridge_channel channel;     // Used only for counting sinks
+    int (*sink)(hostbridge_channel *channel, const void *ptr, int len);
+    unsigned long long bytes;
+    unsigned long long calls;
+    unsigned long long nsec;
+    alt_u8 seen;
+    alt_u8 counting;
+    alt_u8 packetized;
+} replay_channel;
+
+static struct {
+    hostbridge_transport transport;
+    alt_u8 *rx;                     // RX records joined (lengths are kept in rx_len)
+    alt_u16 *rx_len;
+    long rx_records;
+    long rx_bytes;
+    long tx_bytes;
+    long record;
+    int offset;
+    unsigned long long written;
+    unsigned long allocs;
+    unsigned long frees;
+    unsigned long long alloc_bytes;
+    int counting_allocs;
+    long expected;                  // Payload length of synthetic stream
+    replay_channel channels[256];
+} replay;
+
+void *malloc(size_t size)
+{
+    if (replay.counting_allocs) {
+        ++replay.allocs;
+        replay.alloc_bytes += size;
+    }
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    if (replay.counting_allocs) {
+        ++replay.allocs;
+        replay.alloc_bytes += nmemb * size;
+    }
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (replay.counting_allocs) {
+        ++replay.allocs;
+        replay.alloc_bytes += size;
+    }
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    if (replay.counting_allocs && ptr) {
+        ++replay.frees;
+    }
+    __libc_free(ptr);
+}
+
+static unsigned long long nsec_now(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#ifndef PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_UART
+static int replay_open(hostbridge_transport *transport, int nonblock)
+{
+    transport->nonblock = nonblock;
+    return 0;
+}
+
+/**
+ * @func replay_read
+ * @brief Return next RX record (never exceeds record boundaries)
+ */
+static int replay_read(hostbridge_transport *transport, void *ptr, int len)
+{
+    int left;
+
+    if (replay.record >= replay.rx_records) {
+        return 0;
+    }
+    left = replay.rx_len[replay.record] - replay.offset;
+    if (len > left) {
+        len = left;
+    }
+    memcpy(ptr, replay.rx, len);
+    replay.rx += len;
+    replay.offset += len;
+    if (replay.offset == replay.rx_len[replay.record]) {
+        ++replay.record;
+        replay.offset = 0;
+    }
+    return len;
+}
+
+static int replay_write(hostbridge_transport *transport, const void *ptr, int len)
+{
+    replay.written += len;
+    return len;
+}
+#endif  /* !PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_UART */
+
+static int counting_sink(hostbridge_channel *channel, const void *ptr, int len)
+{
+    return len;
+}
+
+/**
+ * @func timed_sink
+ * @brief Measure time spent in original sink
+ */
+static int timed_sink(hostbridge_channel *channel, const void *ptr, int len)
+{
+    replay_channel *rc = &replay.channels[channel->number];
+    unsigned long long start = nsec_now(CLOCK_MONOTONIC);
+    int result = (*rc->sink)(channel, ptr, len);
+
+    rc->nsec += nsec_now(CLOCK_MONOTONIC) - start;
+    ++rc->calls;
+    if (result > 0) {
+        rc->bytes += result;
+    }
+    return result;
+}
+
+/**
+ * @func load_capture
+ * @brief Load RX records from capture file
+ * @return 0 on success, -1 on error
+ */
+static int load_capture(const char *path)
+{
+    FILE *fp;
+    alt_u8 header[CAPTURE_FILE_HEADER_LEN];
+    alt_u8 record[CAPTURE_RECORD_HEADER_LEN];
+    long capacity = 0, records = 0;
+
+    fp = fopen(path, "rb");
+    if (!fp) {
+        perror(path);
+        return -1;
+    }
+    if ((fread(header, 1, sizeof(header), fp) != sizeof(header)) ||
+        (memcmp(header, "HBCP", 4) != 0) || (header[4] != 1) || (header[5] != 0)) {
+        fprintf(stderr, "%s: not a hostbridge capture\n", path);
+        fclose(fp);
+        return -1;
+    }
+    while (fread(record, 1, sizeof(record), fp) == sizeof(record)) {
+        int len = record[4] | (record[5] << 8);
+        if (record[6] != HOSTBRIDGE_GEN2_CAPTURE_RX) {
+            replay.tx_bytes += len;
+            fseek(fp, len, SEEK_CUR);
+            continue;
+        }
+        if (replay.rx_bytes + len > capacity) {
+            long new_capacity = (capacity + len) * 2;
+            alt_u8 *rx = realloc(replay.rx, new_capacity);
+            if (!rx) {
+                goto no_memory;
+            }
+            replay.rx = rx;
+            capacity = new_capacity;
+        }
+        if (replay.rx_records == records) {
+            long new_records = records * 2 + 1024;
+            alt_u16 *rx_len = realloc(replay.rx_len, new_records * sizeof(*replay.rx_len));
+            if (!rx_len) {
+                goto no_memory;
+            }
+            replay.rx_len = rx_len;
+            records = new_records;
+        }
+        if (fread(replay.rx + replay.rx_bytes, 1, len, fp) != (size_t)len) {
+            break;
+        }
+        replay.rx_len[replay.rx_records++] = len;
+        replay.rx_bytes += len;
+    }
+    fclose(fp);
+    return 0;
+
+no_memory:
+    fprintf(stderr, "%s: out of memory\n", path);
+    fclose(fp);
+    free(replay.rx);
+    free(replay.rx_len);
+    replay.rx = NULL;
+    replay.rx_len = NULL;
+    replay.rx_records = 0;
+    replay.rx_bytes = 0;
+    return -1;
+}
+
+/**
+ * @func generate_stream
+ * @brief Generate RX records of synthetic stream for channel 1
+ * @param percent Percentage of payload bytes which need escape
+ * @param size Payload length
+ * @return 0 on success, -1 on error
+ */
+static int generate_stream(int percent, long size)
+{
+    unsigned int seed = 1;
+    long records = (size * 2 + 2) / SYNTHETIC_RECORD_LEN + 1;
+    long left;
+    alt_u8 *dest;
+
+    replay.rx = malloc(size * 2 + 2);
+    replay.rx_len = malloc(records * sizeof(*replay.rx_len));
+    if (!replay.rx || !replay.rx_len) {
+        fprintf(stderr, "out of memory\n");
+        free(replay.rx);
+        free(replay.rx_len);
+        replay.rx = NULL;
+        replay.rx_len = NULL;
+        return -1;
+    }
+    dest = replay.rx;
+    *dest++ = AST_CHANNEL_PREFIX;
+    *dest++ = SYNTHETIC_CHANNEL;
+    for (left = size; left > 0; --left) {
+        alt_u8 byte;
+        if ((int)(rand_r(&seed) % 100) < percent) {
+            byte = AST_SOP + (rand_r(&seed) % 4);
+            *dest++ = AST_ESCAPE_PREFIX;
+            *dest++ = byte ^ AST_ESCAPE_XOR;
+        } else {
+            do {
+                byte = rand_r(&seed);
+            } while (AST_NEEDS_ESCAPE(byte));
+            *dest++ = byte;
+        }
+    }
+    replay.rx_bytes = dest - replay.rx;
+    for (left = replay.rx_bytes; left > 0; left -= SYNTHETIC_RECORD_LEN) {
+        replay.rx_len[replay.rx_records++] = (left > SYNTHETIC_RECORD_LEN) ? SYNTHETIC_RECORD_LEN : left;
+    }
+    replay.expected = size;
+    return 0;
+}
+
+/*
+ * Decoder used before single-pass decoding (kept for comparison)
+ * This is a copy of the receive loop in peridot_sw_hostbridge_gen2_service()
+ * before the rewrite, including its known bugs (memmove() from head of
+ * buffer, escaped SOP/EOP dropped), so its output is not exactly the same.
+ */
+static struct {
+    hostbridge_channel *sink_channel;
+    alt_u8 channel_prefix;
+    alt_u8 escape_prefix;
+} old;
+
+static void old_write_to_channel(hostbridge_channel *channel, const alt_u8 *buffer, int from, int to)
+{
+    int len;
+
+    if (!channel) {
+        return;
+    }
+
+    buffer += from;
+    len = to - from;
+    while (len > 0) {
+        int written = (*channel->dest.sink)(channel, buffer, len);
+        if (written > 0) {
+            buffer += written;
+            len -= written;
+        }
+    }
+}
+
+static void old_decode(alt_u8 *buffer, int read_len)
+{
+    int index;
+    int head;
+
+    head = 0;
+    for (index = 0; index < read_len; ++index) {
+        alt_u8 byte = buffer[index];
+        switch (byte) {
+        case AST_CHANNEL_PREFIX:
+            old.channel_prefix = 1;
+            continue;
+        case AST_ESCAPE_PREFIX:
+            old.escape_prefix = 1;
+            if (old.sink_channel && !old.sink_channel->packetized) {
+                // Drop special byte
+                --read_len;
+                memmove(buffer, buffer + 1, read_len - index);
+            }
+            continue;
+        }
+        if (old.escape_prefix) {
+            byte ^= AST_ESCAPE_XOR;
+            if (old.sink_channel && !old.sink_channel->packetized) {
+                buffer[index] = byte;
+            }
+            old.escape_prefix = 0;
+        }
+        if (old.channel_prefix) {
+            old_write_to_channel(old.sink_channel, buffer, head, index - 1);
+            old.sink_channel = peridot_sw_hostbridge_gen2_find_channel(byte);
+            head = index + 1;
+            old.channel_prefix = 0;
+            continue;
+        }
+        if (old.sink_channel && !old.sink_channel->packetized) {
+            // Drop special bytes
+            switch (byte) {
+            case AST_SOP:
+            case AST_EOP_PREFIX:
+                --read_len;
+                memmove(buffer, buffer + 1, read_len - index);
+                continue;
+            }
+        }
+    }
+
+    old_write_to_channel(old.sink_channel, buffer, head, read_len);
+}
+
+/**
+ * @func sink_totals
+ * @brief Sum up bytes and time of all sinks
+ */
+static void sink_totals(unsigned long long *bytes, unsigned long long *nsec)
+{
+    int number;
+
+    *bytes = 0;
+    *nsec = 0;
+    for (number = 0; number < 256; ++number) {
+        *bytes += replay.channels[number].bytes;
+        *nsec += replay.channels[number].nsec;
+    }
+}
+
+/**
+ * @func replay_old
+ * @brief Replay RX records through old decoder
+ * @param repeat Number of passes
+ */
+static void replay_old(int repeat)
+{
+    alt_u8 buffer[READ_BUFFER_LEN];
+    unsigned long long wall, cpu, bytes, sink_nsec;
+    unsigned long long start_bytes, start_nsec;
+    double total;
+    int pass;
+
+    sink_totals(&start_bytes, &start_nsec);
+    wall = nsec_now(CLOCK_MONOTONIC);
+    cpu = nsec_now(CLOCK_PROCESS_CPUTIME_ID);
+    for (pass = 0; pass < repeat; ++pass) {
+        const alt_u8 *rx = replay.rx;
+        long record;
+        for (record = 0; record < replay.rx_records; ++record) {
+            int left = replay.rx_len[record];
+            // Read in the same pieces as new decoder
+            while (left > 0) {
+                int len = (left > READ_BUFFER_LEN) ? READ_BUFFER_LEN : left;
+                memcpy(buffer, rx, len);
+                old_decode(buffer, len);
+                rx += len;
+                left -= len;
+            }
+        }
+    }
+    cpu = nsec_now(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+    wall = nsec_now(CLOCK_MONOTONIC) - wall;
+    sink_totals(&bytes, &sink_nsec);
+    bytes -= start_bytes;
+    sink_nsec -= start_nsec;
+
+    total = (double)replay.rx_bytes * repeat;
+    printf("old replay: %.0f bytes in %.3f s (CPU %.3f s), %.2f MB/s, %.1f ns/byte\n",
+            total, wall / 1e9, cpu / 1e9,
+            (wall > 0) ? (total * 1e3 / wall) : 0.0, (total > 0) ? (cpu / total) : 0.0);
+    printf("old decoder (CPU excluding sinks): %.3f ms, %llu bytes to sinks\n",
+            (cpu > sink_nsec) ? ((cpu - sink_nsec) / 1e6) : 0.0, bytes);
+}
+
+/**
+ * @func scan_channels
+ * @brief Find channels which appear in RX stream
+ */
+static void scan_channels(void)
+{
+    int state = 0;
+    long i;
+
+    for (i = 0; i < replay.rx_bytes; ++i) {
+        alt_u8 byte = replay.rx[i];
+        if (state == 2) {
+            replay.channels[byte ^ AST_ESCAPE_XOR].seen = 1;
+            state = 0;
+        } else if (state == 1) {
+            if (byte == AST_ESCAPE_PREFIX) {
+                state = 2;
+            } else {
+                replay.channels[byte].seen = 1;
+                state = 0;
+            }
+        } else if (byte == AST_CHANNEL_PREFIX) {
+            state = 1;
+        }
+    }
+}
+
+/**
+ * @func attach_channels
+ * @brief Attach counting sinks to new channels, and wrap all sinks
+ */
+static void attach_channels(void)
+{
+    int number;
+
+    for (number = 0; number < 256; ++number) {
+        replay_channel *rc = &replay.channels[number];
+        hostbridge_channel *channel;
+
+        if (rc->seen && !peridot_sw_hostbridge_gen2_find_channel(number)) {
+            rc->channel.number = number;
+            rc->channel.packetized = rc->packetized;
+            rc->channel.dest.sink = counting_sink;
+            peridot_sw_hostbridge_gen2_register_channel(&rc->channel);
+            rc->counting = 1;
+        }
+        channel = peridot_sw_hostbridge_gen2_find_channel(number);
+        if (!channel || channel->use_fd) {
+            continue;
+        }
+        rc->sink = channel->dest.sink;
+        channel->dest.sink = timed_sink;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int repeat = 1;
+    int compare = 0;
+    int failed = 0;
+    int percent = -1;
+    long size = 4 * 1024 * 1024;
+    int opt, number, pass, result;
+    unsigned long long wall, cpu, sink_nsec = 0, sink_bytes = 0;
+    double total;
+
+    while ((opt = getopt(argc, argv, "r:p:os:n:")) != -1) {
+        switch (opt) {
+        case 'r':
+            repeat = atoi(optarg);
+            break;
+        case 'o':
+            compare = 1;
+            break;
+        case 's':
+            percent = atoi(optarg);
+            break;
+        case 'n':
+            size = atol(optarg);
+            break;
+        case 'p':
+            replay.channels[atoi(optarg) & 0xff].packetized = 1;
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+    if ((optind != argc - ((percent < 0) ? 1 : 0)) || (repeat < 1) ||
+        (percent > 100) || (size < 1)) {
+        fprintf(stderr, "usage: %s [-r <repeat>] [-o] [-p <channel>]... <capture file>\n"
+                        "       %s [-r <repeat>] [-o] -s <percent> [-n <bytes>]\n", argv[0], argv[0]);
+        return 1;
+    }
+    if (percent >= 0) {
+        if (generate_stream(percent, size) < 0) {
+            return 1;
+        }
+    } else if (load_capture(argv[optind]) < 0) {
+        return 1;
+    }
+
+#ifndef PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_UART
+    replay.transport.open = replay_open;
+    replay.transport.read = replay_read;
+    replay.transport.write = replay_write;
+    replay.transport.fd = -1;
+    peridot_sw_hostbridge_gen2_set_transport(&replay.transport);
+#endif
+    result = peridot_sw_hostbridge_gen2_init();
+    if (result < 0) {
+        fprintf(stderr, "init failed (%d)\n", result);
+        return 1;
+    }
+    scan_channels();
+    attach_channels();
+
+    if (percent >= 0) {
+        printf("synthetic: %ld bytes payload (%d%% escaped) in %ld bytes\n",
+                replay.expected, percent, replay.rx_bytes);
+    } else {
+        printf("capture: %ld RX records (%ld bytes), %ld TX bytes\n",
+                replay.rx_records, replay.rx_bytes, replay.tx_bytes);
+    }
+
+    replay.counting_allocs = 1;
+    wall = nsec_now(CLOCK_MONOTONIC);
+    cpu = nsec_now(CLOCK_PROCESS_CPUTIME_ID);
+    for (pass = 0; pass < repeat; ++pass) {
+        alt_u8 *rx = replay.rx;
+        replay.record = 0;
+        replay.offset = 0;
+        while (replay.record < replay.rx_records) {
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_UART
+            // Raise interrupt for each byte of record, then pass rings to sinks
+            // (Rest of record is sent after rings are drained if RTS is deasserted)
+            int len = replay.rx_len[replay.record++];
+            while (len > 0) {
+                int sent = uart_model_receive(replay.rx, len);
+                replay.rx += sent;
+                len -= sent;
+                peridot_sw_hostbridge_gen2_service();
+            }
+#else
+            peridot_sw_hostbridge_gen2_service();
+#endif
+        }
+        replay.rx = rx;
+    }
+    cpu = nsec_now(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+    wall = nsec_now(CLOCK_MONOTONIC) - wall;
+    replay.counting_allocs = 0;
+#ifdef PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_UART
+    {
+        uart_model_stats stats;
+        uart_model_get_stats(&stats);
+        replay.written = stats.tx_bytes;
+        printf("uart: %lu interrupts, %lu overruns\n", stats.interrupts, stats.overruns);
+        if (stats.overruns > 0) {
+            failed = 1;
+        }
+    }
+#endif
+
+    total = (double)replay.rx_bytes * repeat;
+    printf("replay: %.0f bytes in %.3f s (CPU %.3f s), %.2f MB/s, %.1f ns/byte\n",
+            total, wall / 1e9, cpu / 1e9,
+            (wall > 0) ? (total * 1e3 / wall) : 0.0, (total > 0) ? (cpu / total) : 0.0);
+    printf("response: %llu bytes written to host\n", replay.written);
+    printf("allocations: %lu malloc, %lu free (%llu bytes)\n",
+            replay.allocs, replay.frees, replay.alloc_bytes);
+    printf("channel     sink calls        bytes      sink ms    ns/byte\n");
+    for (number = 0; number < 256; ++number) {
+        replay_channel *rc = &replay.channels[number];
+        if (!rc->calls) {
+            continue;
+        }
+        sink_nsec += rc->nsec;
+        printf("%3d%-9s %10llu %12llu %12.3f %10.1f\n",
+                number, rc->counting ? " (count)" : "",
+                rc->calls, rc->bytes, rc->nsec / 1e6,
+                rc->bytes ? ((double)rc->nsec / rc->bytes) : 0.0);
+    }
+    printf("decoder (CPU excluding sinks): %.3f ms\n",
+            (cpu > sink_nsec) ? ((cpu - sink_nsec) / 1e6) : 0.0);
+    if (percent >= 0) {
+        sink_totals(&sink_bytes, &sink_nsec);
+        printf("payload: %llu/%ld bytes to sink\n", sink_bytes, replay.expected * repeat);
+        if (sink_bytes != (unsigned long long)replay.expected * repeat) {
+            failed = 1;
+        }
+    }
+    if (compare) {
+        replay_old(repeat);
+    }
+    if (failed) {
+        puts("FAILED (bytes lost)");
+    }
+    return failed;
+}
@@ -0,0 +1,223 @@
+/*
+ * Test of event-driven RX (rx_event) with receiver threads (runs on Linux host)
+ *
+ * Two links are connected to socketpairs. Link 0 emulates a UART driver
+ * which calls peridot_sw_hostbridge_gen2_notify_rx() after bytes arrive
+ * (like RX interrupt handler). Link 1 uses plain POSIX transport which
+ * never signals, and must be read without waiting for events.
+ * Data sent by host on each link must reach the channel pinned to it,
+ * and link 0 must not be read while it is idle.
+ *
+ * Build (in this directory):
+ *   gcc -O2 -D_GNU_SOURCE -D__tinythreads__ \
+ *       -DPERIDOT_SW_HOSTBRIDGE_GEN2_TRANSPORT_POSIX \
+ *       -DPERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD \
+ *       -DPERIDOT_SW_HOSTBRIDGE_GEN2_RX_EVENT \
+ *       -DPERIDOT_SW_HOSTBRIDGE_GEN2_LINKS=2 -Ihal -I../HAL/inc \
+ *       hostbridge_rxevent_test.c ../HAL/src/peridot_sw_hostbridge_gen2.c \
+ *       ../HAL/src/peridot_sw_hostbridge_gen2_avm.c \
+ *       ../HAL/src/peridot_sw_hostbridge_gen2_posix.c \
+ *       -lpthread -o hostbridge_rxevent_test
+ *
+ * Usage:
+ *   hostbridge_rxevent_test
+ *     Exit status is zero if passed.
+ */
+#include "system.h"
+#include "peridot_sw_hostbridge_gen2.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#if !defined(PERIDOT_SW_HOSTBRIDGE_GEN2_RX_EVENT) || \
+    !defined(PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD) || \
+    (PERIDOT_SW_HOSTBRIDGE_GEN2_LINKS < 2)
+# error "Build with rx_event, receiver thread and two links (see above)"
+#endif
+
+#define TEST_BYTES      (1 << 20)
+#define TEST_CHUNK_MAX  3000
+#define TEST_IDLE_USEC  200000
+
+typedef struct test_link_s {
+    hostbridge_channel channel;
+    hostbridge_transport posix;     // Inner transport
+    hostbridge_transport transport; // Transport given to hostbridge
+    int host_fd;
+    volatile long received;
+    volatile long reads;
+    int errors;
+} test_link;
+
+static test_link links[2];
+
+/**
+ * @func event_read
+ * @brief Read from emulated UART which signals arrival
+ */
+static int event_read(hostbridge_transport *transport, void *ptr, int len)
+{
+    ++links[0].reads;
+    return (*links[0].posix.read)(&links[0].posix, ptr, len);
+}
+
+static int event_open(hostbridge_transport *transport, int nonblock)
+{
+    if (!nonblock) {
+        // Signalling transport must be opened in non-blocking mode
+        return -1;
+    }
+    return (*links[0].posix.open)(&links[0].posix, nonblock);
+}
+
+static int event_write(hostbridge_transport *transport, const void *ptr, int len)
+{
+    return (*links[0].posix.write)(&links[0].posix, ptr, len);
+}
+
+static int plain_read(hostbridge_transport *transport, void *ptr, int len)
+{
+    ++links[1].reads;
+    return (*links[1].posix.read)(&links[1].posix, ptr, len);
+}
+
+/**
+ * @func test_sink
+ * @brief Check data received on channel
+ */
+static int test_sink(hostbridge_channel *channel, const void *ptr, int len)
+{
+    test_link *link = &links[channel->link];
+    const alt_u8 *src = (const alt_u8 *)ptr;
+    int index;
+
+    for (index = 0; index < len; ++index) {
+        if (src[index] != ((link->received + index) & 0x3f)) {
+            ++link->errors;
+        }
+    }
+    link->received += len;
+    return len;
+}
+
+/**
+ * @func host_sender
+ * @brief Send bursts from host on link
+ */
+static void *host_sender(void *param)
+{
+    int number = (int)(long)param;
+    test_link *link = &links[number];
+    alt_u8 buffer[2 + TEST_CHUNK_MAX];
+    long sent = 0;
+    unsigned int seed = number + 1;
+
+    buffer[0] = AST_CHANNEL_PREFIX;
+    buffer[1] = link->channel.number;
+    write(link->host_fd, buffer, 2);
+    while (sent < TEST_BYTES) {
+        int len = rand_r(&seed) % TEST_CHUNK_MAX + 1;
+        int index;
+        if (len > TEST_BYTES - sent) {
+            len = TEST_BYTES - sent;
+        }
+        for (index = 0; index < len; ++index) {
+            buffer[index] = (sent + index) & 0x3f;
+        }
+        if (write(link->host_fd, buffer, len) != len) {
+            break;
+        }
+        sent += len;
+        if (number == 0) {
+            // Emulate RX interrupt
+            peridot_sw_hostbridge_gen2_notify_rx();
+        }
+        if ((rand_r(&seed) % 16) == 0) {
+            usleep(1000);
+        }
+    }
+    return NULL;
+}
+
+int main(void)
+{
+    pthread_t senders[2];
+    long reads;
+    int number;
+    int result;
+    int failed = 0;
+
+    for (number = 0; number < 2; ++number) {
+        test_link *link = &links[number];
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+            perror("socketpair");
+            return 1;
+        }
+        link->host_fd = sv[1];
+        peridot_sw_hostbridge_gen2_posix_transport(&link->posix, sv[0]);
+        link->transport = link->posix;
+        link->channel.number = 5 + number;
+        link->channel.link = number;
+        link->channel.dest.sink = test_sink;
+    }
+    links[0].transport.open = event_open;
+    links[0].transport.read = event_read;
+    links[0].transport.write = event_write;
+    links[0].transport.notify_rx = 1;
+    links[1].transport.read = plain_read;
+
+    result = peridot_sw_hostbridge_gen2_init();
+    if (result == 0) {
+        result = peridot_sw_hostbridge_gen2_register_channel(&links[0].channel);
+    }
+    if (result == 0) {
+        result = peridot_sw_hostbridge_gen2_register_channel(&links[1].channel);
+    }
+    if (result == 0) {
+        result = peridot_sw_hostbridge_gen2_set_link_transport(0, &links[0].transport);
+    }
+    if (result == 0) {
+        result = peridot_sw_hostbridge_gen2_set_link_transport(1, &links[1].transport);
+    }
+    if (result != 0) {
+        printf("initialization failed (%d)\n", result);
+        return 1;
+    }
+
+    for (number = 0; number < 2; ++number) {
+        pthread_create(&senders[number], NULL, host_sender, (void *)(long)number);
+    }
+    for (number = 0; number < 2; ++number) {
+        pthread_join(senders[number], NULL);
+    }
+    for (number = 0; number < 1000; ++number) {
+        if ((links[0].received >= TEST_BYTES) && (links[1].received >= TEST_BYTES)) {
+            break;
+        }
+        usleep(10000);
+    }
+
+    // Link 0 is idle now
+    reads = links[0].reads;
+    usleep(TEST_IDLE_USEC);
+    reads = links[0].reads - reads;
+
+    for (number = 0; number < 2; ++number) {
+        test_link *link = &links[number];
+        printf("link %d: received %ld/%d bytes, %d errors, %ld reads\n",
+                number, link->received, TEST_BYTES, link->errors, link->reads);
+        if ((link->received != TEST_BYTES) || (link->errors > 0)) {
+            failed = 1;
+        }
+    }
+    printf("link 0: %ld reads while idle\n", reads);
+    if (reads > 1) {
+        failed = 1;
+    }
+    puts(failed ? "FAILED" : "passed");
+    return failed;
+}
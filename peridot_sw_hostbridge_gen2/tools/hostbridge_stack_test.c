@@ -0,0 +1,508 @@
+/*
+ * End-to-end test of hostbridge with RPC server, fs client, Rubic agent and
+ * pipes (runs on Linux host)
+ *
+ * Firmware side connects hostbridge (with receiver thread) to a socketpair
+ * by POSIX transport, and starts RPC server (with worker thread), fs client
+ * (a temporary file is allowed to read), Rubic agent (with a test runtime)
+ * and a pipe whose input is echoed back by another thread. Then main thread
+ * enters rubic_agent_service() as firmware does.
+ * A thread acting as host sends JSON-RPC requests in BSON and checks replies:
+ *   - fs.open, fs.read (until EOF) and fs.close of the temporary file
+ *   - fs.read of closed fd and fs.open of unlisted path must fail
+ *   - rubic.info, and rubic.queue which starts the test runtime
+ *   - Random bytes sent to the pipe must be echoed back
+ * (Rubic programmer and fs.hash are not included.)
+ *
+ * Build (in this directory):
+ *   gcc -O2 -D_GNU_SOURCE -D__tinythreads__ \
+ *       -DPERIDOT_SW_HOSTBRIDGE_GEN2_TRANSPORT_POSIX \
+ *       -DPERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD \
+ *       -DPERIDOT_RPCSRV_CHANNEL=1 -DPERIDOT_RPCSRV_MAX_REQUEST_LENGTH=8192 \
+ *       -DPERIDOT_RPCSRV_MULTI_THREADED -DPERIDOT_RPCSRV_WORKER_THREADS=1 \
+ *       -DPERIDOT_CLIENT_FS_MAX_FDS=16 \
+ *       -DRUBIC_AGENT_RUBIC_VERSION='">=1.0.0"' \
+ *       -DRUBIC_AGENT_WORKER_THREADS=1 -DRUBIC_AGENT_MAX_RUNTIMES=1 \
+ *       -DRUBIC_AGENT_MAX_STORAGES=1 \
+ *       -Ihal -I../HAL/inc -I../../peridot_rpc_server/HAL/inc \
+ *       -I../../peridot_client_fs/HAL/inc -I../../rubic_agent/HAL/inc \
+ *       hostbridge_stack_test.c ../HAL/src/peridot_sw_hostbridge_gen2.c \
+ *       ../HAL/src/peridot_sw_hostbridge_gen2_avm.c \
+ *       ../HAL/src/peridot_sw_hostbridge_gen2_posix.c \
+ *       ../HAL/src/peridot_sw_hostbridge_gen2_pipe.c \
+ *       ../../peridot_rpc_server/HAL/src/peridot_rpc_server.c \
+ *       ../../peridot_rpc_server/HAL/src/bson.c \
+ *       ../../peridot_client_fs/HAL/src/peridot_client_fs.c \
+ *       ../../rubic_agent/HAL/src/rubic_agent.c \
+ *       -lpthread -o hostbridge_stack_test
+ *
+ * Usage:
+ *   hostbridge_stack_test
+ *     Exit status is zero if passed.
+ */
+#include "system.h"
+#include "peridot_sw_hostbridge_gen2.h"
+#include "peridot_rpc_server.h"
+#include "peridot_client_fs.h"
+#include "rubic_agent.h"
+#include "bson.h"
+#include "sys/alt_irq.h"
+#include "priv/alt_file.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#if !defined(PERIDOT_SW_HOSTBRIDGE_GEN2_USE_RECEIVER_THREAD) || \
+    !defined(PERIDOT_RPCSRV_MULTI_THREADED)
+# error "Build with receiver thread and multi-threaded RPC server (see above)"
+#endif
+
+#define PIPE_CHANNEL    8
+#define PIPE_FD         3
+#define PIPE_CAPACITY   1024
+#define PIPE_BYTES      (64 * 1024)
+#define FILE_BYTES      (1024 * 1024)
+#define READ_LENGTH     4096
+#define REPLY_MAX       (READ_LENGTH + 256)
+#define TEST_SOURCE     "puts 'hello'"
+
+alt_fd alt_fd_list[ALT_MAX_FD];
+
+static hostbridge_transport transport;
+static int host_fd;
+static char file_path[] = "/tmp/hostbridge_stack_test.XXXXXX";
+static alt_u8 file_data[FILE_BYTES];
+static alt_u8 reply[REPLY_MAX];
+static sem_t reply_sem;
+static alt_u8 pipe_sent[PIPE_BYTES];
+static alt_u8 pipe_echoed[PIPE_BYTES];
+static volatile long pipe_echoed_len;
+static char runner_source[64];
+static int request_id;
+
+/*
+ * Interrupts are not used by this test
+ * (peridot_client_fs.c disables them to update its table)
+ */
+alt_irq_context alt_irq_disable_all(void)
+{
+    return 0;
+}
+
+void alt_irq_enable_all(alt_irq_context context)
+{
+}
+
+/**
+ * @func test_runner
+ * @brief Runner of test runtime (keeps source given by rubic.queue)
+ */
+static int test_runner(const char *data, int flags, void *context)
+{
+    if (flags & RUBIC_AGENT_RUNNER_FLAG_SOURCE) {
+        strncpy(runner_source, data, sizeof(runner_source) - 1);
+    }
+    return rubic_agent_runner_notify_init(context);
+}
+
+/**
+ * @func pipe_echo
+ * @brief Send data received from pipe back to host through the same pipe
+ */
+static void *pipe_echo(void *param)
+{
+    alt_fd *fd = &alt_fd_list[PIPE_FD];
+    char buffer[256];
+
+    for (;;) {
+        int len = (*fd->dev->read)(fd, buffer, sizeof(buffer));
+        if ((len <= 0) || ((*fd->dev->write)(fd, buffer, len) < 0)) {
+            printf("pipe echo failed (%d)\n", len);
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @func host_send
+ * @brief Send escaped data to channel (as a packet if specified)
+ */
+static void host_send(alt_u8 channel, const void *ptr, int len, int packet)
+{
+    const alt_u8 *src = (const alt_u8 *)ptr;
+    alt_u8 *stream = (alt_u8 *)malloc(5 + len * 2);
+    int stream_len = 0;
+    int index;
+    int offset;
+
+    stream[stream_len++] = AST_CHANNEL_PREFIX;
+    stream[stream_len++] = channel;
+    if (packet) {
+        stream[stream_len++] = AST_SOP;
+    }
+    for (index = 0; index < len; ++index) {
+        alt_u8 byte = src[index];
+        if (packet && (index == len - 1)) {
+            stream[stream_len++] = AST_EOP_PREFIX;
+        }
+        if (AST_NEEDS_ESCAPE(byte)) {
+            stream[stream_len++] = AST_ESCAPE_PREFIX;
+            byte ^= AST_ESCAPE_XOR;
+        }
+        stream[stream_len++] = byte;
+    }
+    for (offset = 0; offset < stream_len;) {
+        int written = write(host_fd, stream + offset, stream_len - offset);
+        if (written <= 0) {
+            perror("host write");
+            break;
+        }
+        offset += written;
+    }
+    free(stream);
+}
+
+/**
+ * @func host_receiver
+ * @brief Decode replies of RPC and data echoed from pipe
+ */
+static void *host_receiver(void *param)
+{
+    alt_u8 buffer[1024];
+    int channel_prefix = 0;
+    int escape_prefix = 0;
+    int eop_prefix = 0;
+    int current = -1;
+    int reply_len = 0;
+
+    for (;;) {
+        int len = read(host_fd, buffer, sizeof(buffer));
+        int index;
+        if (len <= 0) {
+            perror("host read");
+            break;
+        }
+        for (index = 0; index < len; ++index) {
+            alt_u8 byte = buffer[index];
+            if (escape_prefix) {
+                byte ^= AST_ESCAPE_XOR;
+                escape_prefix = 0;
+            } else if (byte == AST_CHANNEL_PREFIX) {
+                channel_prefix = 1;
+                continue;
+            } else if (byte == AST_ESCAPE_PREFIX) {
+                escape_prefix = 1;
+                continue;
+            } else if (byte == AST_SOP) {
+                if (current == PERIDOT_RPCSRV_CHANNEL) {
+                    reply_len = 0;
+                }
+                continue;
+            } else if (byte == AST_EOP_PREFIX) {
+                eop_prefix = 1;
+                continue;
+            }
+            if (channel_prefix) {
+                current = byte;
+                channel_prefix = 0;
+                continue;
+            }
+            if (current == PERIDOT_RPCSRV_CHANNEL) {
+                if (reply_len < REPLY_MAX) {
+                    reply[reply_len++] = byte;
+                }
+                if (eop_prefix) {
+                    sem_post(&reply_sem);
+                }
+            } else if ((current == PIPE_CHANNEL) && (pipe_echoed_len < PIPE_BYTES)) {
+                pipe_echoed[pipe_echoed_len++] = byte;
+            }
+            eop_prefix = 0;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @func host_call
+ * @brief Call method and wait for its reply
+ * @param method Name of method
+ * @param params Parameters (BSON document or NULL)
+ * @param result Pointer to store result (NULL if result is null)
+ * @return 0 on success, error code on error
+ */
+static int host_call(const char *method, const void *params, void **result)
+{
+    void *request;
+    void *error;
+    int len;
+    int off_id, off_result, off_error, off_code;
+
+    len = bson_empty_size +
+        bson_measure_string("jsonrpc", PERIDOT_RPCSRV_JSONRPC_VER) +
+        bson_measure_string("method", method) +
+        bson_measure_int32("id");
+    if (params) {
+        len += bson_measure_subdocument("params", params);
+    }
+    request = malloc(len);
+    bson_create_empty_document(request);
+    bson_set_string(request, "jsonrpc", PERIDOT_RPCSRV_JSONRPC_VER);
+    bson_set_string(request, "method", method);
+    if (params) {
+        bson_set_subdocument(request, "params", params);
+    }
+    bson_set_int32(request, "id", ++request_id);
+    host_send(PERIDOT_RPCSRV_CHANNEL, request, len, 1);
+    free(request);
+
+    sem_wait(&reply_sem);
+    bson_get_props(reply,
+        "id", &off_id,
+        "result", &off_result,
+        "error", &off_error,
+        NULL
+    );
+    if (bson_get_int32(reply, off_id, -1) != request_id) {
+        printf("%s: id mismatch\n", method);
+        return JSONRPC_ERR_INTERNAL_ERROR;
+    }
+    error = bson_get_subdocument(reply, off_error, NULL);
+    if (error) {
+        bson_get_props(error, "code", &off_code, NULL);
+        return bson_get_int32(error, off_code, JSONRPC_ERR_INTERNAL_ERROR);
+    }
+    *result = bson_get_subdocument(reply, off_result, NULL);
+    return 0;
+}
+
+/**
+ * @func test_fs
+ * @brief Read temporary file with fs.open, fs.read and fs.close
+ * @return 0 if passed
+ */
+static int test_fs(void)
+{
+    char params[256];
+    void *result;
+    struct timespec start, end;
+    long offset = 0;
+    int off_fd, off_data, off_length;
+    int fd;
+    int code;
+    double elapsed;
+
+    bson_create_empty_document(params);
+    bson_set_string(params, "path", file_path);
+    bson_set_int32(params, "flags", O_RDONLY);
+    if ((code = host_call("fs.open", params, &result)) != 0) {
+        printf("fs.open failed (%d)\n", code);
+        return 1;
+    }
+    bson_get_props(result, "fd", &off_fd, NULL);
+    fd = bson_get_int32(result, off_fd, -1);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;) {
+        const void *data;
+        int data_len;
+        bson_create_empty_document(params);
+        bson_set_int32(params, "fd", fd);
+        bson_set_int32(params, "length", READ_LENGTH);
+        if ((code = host_call("fs.read", params, &result)) != 0) {
+            printf("fs.read failed (%d)\n", code);
+            return 1;
+        }
+        bson_get_props(result, "data", &off_data, "length", &off_length, NULL);
+        if (bson_get_int32(result, off_length, -1) == 0) {
+            // EOF
+            break;
+        }
+        data = bson_get_binary(result, off_data, &data_len);
+        if (!data || (data_len != bson_get_int32(result, off_length, -1)) ||
+            (data_len > FILE_BYTES - offset) ||
+            memcmp(data, file_data + offset, data_len)) {
+            printf("fs.read: wrong data at offset %ld\n", offset);
+            return 1;
+        }
+        offset += data_len;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    printf("fs.read: %ld/%d bytes (%.1f MB/s)\n", offset, FILE_BYTES, offset / elapsed / 1e6);
+    if (offset != FILE_BYTES) {
+        return 1;
+    }
+
+    bson_create_empty_document(params);
+    bson_set_int32(params, "fd", fd);
+    if ((code = host_call("fs.close", params, &result)) != 0) {
+        printf("fs.close failed (%d)\n", code);
+        return 1;
+    }
+
+    // Closed fd
+    bson_set_int32(params, "length", READ_LENGTH);
+    code = host_call("fs.read", params, &result);
+    printf("fs.read after close: %d\n", code);
+    if (code != EBADF) {
+        return 1;
+    }
+
+    // Unlisted path
+    bson_create_empty_document(params);
+    bson_set_string(params, "path", "/etc/passwd");
+    bson_set_int32(params, "flags", O_RDONLY);
+    code = host_call("fs.open", params, &result);
+    printf("fs.open of unlisted path: %d\n", code);
+    if (code != EACCES) {
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @func test_rubic
+ * @brief Query information and start test runtime
+ * @return 0 if passed
+ */
+static int test_rubic(void)
+{
+    char params[128];
+    void *result;
+    int off_version, off_tid;
+    const char *version;
+    int code;
+
+    if ((code = host_call("rubic.info", NULL, &result)) != 0) {
+        printf("rubic.info failed (%d)\n", code);
+        return 1;
+    }
+    bson_get_props(result, "rubicVersion", &off_version, NULL);
+    version = bson_get_string(result, off_version, "");
+    printf("rubic.info: rubicVersion=%s\n", version);
+    if (strcmp(version, RUBIC_AGENT_RUBIC_VERSION) != 0) {
+        return 1;
+    }
+
+    bson_create_empty_document(params);
+    bson_set_string(params, "name", "start");
+    bson_set_string(params, "runtime", "test");
+    bson_set_string(params, "source", TEST_SOURCE);
+    if ((code = host_call("rubic.queue", params, &result)) != 0) {
+        printf("rubic.queue failed (%d)\n", code);
+        return 1;
+    }
+    bson_get_props(result, "tid", &off_tid, NULL);
+    printf("rubic.queue: tid=%d, source=\"%s\"\n",
+        bson_get_int32(result, off_tid, -1), runner_source);
+    if ((bson_get_int32(result, off_tid, -1) != 0) ||
+        (strcmp(runner_source, TEST_SOURCE) != 0)) {
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @func test_pipe
+ * @brief Send random bytes to pipe and compare with echoed bytes
+ * @return 0 if passed
+ */
+static int test_pipe(void)
+{
+    unsigned int seed = 4;
+    long index;
+
+    for (index = 0; index < PIPE_BYTES; ++index) {
+        pipe_sent[index] = (rand_r(&seed) % 4) ? (alt_u8)rand_r(&seed) : (AST_SOP + (index % 4));
+    }
+    host_send(PIPE_CHANNEL, pipe_sent, PIPE_BYTES, 0);
+    while (pipe_echoed_len < PIPE_BYTES) {
+        usleep(1000);
+    }
+    printf("pipe: %ld/%d bytes\n", pipe_echoed_len, PIPE_BYTES);
+    return memcmp(pipe_sent, pipe_echoed, PIPE_BYTES) ? 1 : 0;
+}
+
+/**
+ * @func host_main
+ * @brief Run tests and exit
+ */
+static void *host_main(void *param)
+{
+    pthread_t receiver;
+    int failed = 0;
+
+    pthread_create(&receiver, NULL, host_receiver, NULL);
+    failed |= test_fs();
+    failed |= test_rubic();
+    failed |= test_pipe();
+    unlink(file_path);
+    puts(failed ? "FAILED" : "passed");
+    exit(failed);
+}
+
+int main(void)
+{
+    pthread_t host, echo;
+    unsigned int seed = 5;
+    long index;
+    int sv[2];
+    int fd;
+    int result;
+
+    for (index = 0; index < FILE_BYTES; ++index) {
+        file_data[index] = (alt_u8)rand_r(&seed);
+    }
+    fd = mkstemp(file_path);
+    if ((fd < 0) || (write(fd, file_data, FILE_BYTES) != FILE_BYTES)) {
+        perror("temporary file");
+        return 1;
+    }
+    close(fd);
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        perror("socketpair");
+        return 1;
+    }
+    host_fd = sv[1];
+    sem_init(&reply_sem, 0, 0);
+
+    // Initialize in the same order as alt_sys_init()
+    peridot_sw_hostbridge_gen2_posix_transport(&transport, sv[0]);
+    result = peridot_sw_hostbridge_gen2_set_transport(&transport);
+    if (result == 0) {
+        result = peridot_sw_hostbridge_gen2_init();
+    }
+    if (result == 0) {
+        result = peridot_rpc_server_init();
+    }
+    if (result == 0) {
+        peridot_client_fs_init("", file_path, "");
+        result = rubic_agent_init();
+    }
+    if (result == 0) {
+        result = rubic_agent_register_runtime("test", "1.0.0", test_runner);
+    }
+    if (result == 0) {
+        result = peridot_sw_hostbridge_gen2_mkpipe(PIPE_CHANNEL, PIPE_FD, PIPE_FD, PIPE_CAPACITY);
+    }
+    if (result != 0) {
+        printf("initialization failed (%d)\n", result);
+        unlink(file_path);
+        return 1;
+    }
+
+    alarm(60);
+    pthread_create(&echo, NULL, pipe_echo, NULL);
+    pthread_create(&host, NULL, host_main, NULL);
+    rubic_agent_service(1);
+    return 1;
+}
@@ -0,0 +1,152 @@
+/*
+ * Register-level model of altera_avalon_uart (runs on Linux host)
+ *
+ * Emulates registers and interrupt of UART 'hostbridge' for building
+ * hostbridge with PERIDOT_SW_HOSTBRIDGE_GEN2_DIRECT_UART on Linux.
+ * Received bytes are given one by one with uart_model_receive(), and
+ * the interrupt handler is called synchronously while RX/TX interrupt is
+ * pending and enabled. Host stops sending while RTS is deasserted (CTS/RTS
+ * flow control). Transmitter accepts every byte immediately.
+ */
+#include "system.h"
+#include "altera_avalon_uart_regs.h"
+#include "sys/alt_irq.h"
+#include "uart_model.h"
+
+#define UART_STATUS_ERRORS \
+    (ALTERA_AVALON_UART_STATUS_PE_MSK | ALTERA_AVALON_UART_STATUS_FE_MSK | \
+     ALTERA_AVALON_UART_STATUS_BRK_MSK | ALTERA_AVALON_UART_STATUS_ROE_MSK)
+
+static struct {
+    alt_u32 status;
+    alt_u32 control;
+    alt_u8 rxdata;
+    alt_isr_func isr;
+    void *isr_context;
+    int irq_disabled;
+    int in_isr;
+    void (*transmit)(alt_u8 byte);
+    uart_model_stats stats;
+} model = {
+    .status = ALTERA_AVALON_UART_STATUS_TRDY_MSK | ALTERA_AVALON_UART_STATUS_TMT_MSK,
+};
+
+/**
+ * @func raise_irq
+ * @brief Call interrupt handler while interrupt is pending
+ */
+static void raise_irq(void)
+{
+    if (model.in_isr || model.irq_disabled || !model.isr) {
+        return;
+    }
+    while (model.status & model.control &
+           (ALTERA_AVALON_UART_STATUS_RRDY_MSK | ALTERA_AVALON_UART_STATUS_TRDY_MSK)) {
+        model.in_isr = 1;
+        ++model.stats.interrupts;
+        (*model.isr)(model.isr_context);
+        model.in_isr = 0;
+    }
+}
+
+alt_u32 uart_model_read(alt_u32 base, int reg)
+{
+    switch (reg) {
+    case ALTERA_AVALON_UART_RXDATA_REG:
+        model.status &= ~ALTERA_AVALON_UART_STATUS_RRDY_MSK;
+        return model.rxdata;
+    case ALTERA_AVALON_UART_STATUS_REG:
+        return model.status;
+    case ALTERA_AVALON_UART_CONTROL_REG:
+        return model.control;
+    }
+    return 0;
+}
+
+void uart_model_write(alt_u32 base, int reg, alt_u32 data)
+{
+    switch (reg) {
+    case ALTERA_AVALON_UART_TXDATA_REG:
+        ++model.stats.tx_bytes;
+        if (model.transmit) {
+            (*model.transmit)(data);
+        }
+        break;
+    case ALTERA_AVALON_UART_STATUS_REG:
+        // Any write clears error bits
+        model.status &= ~UART_STATUS_ERRORS;
+        break;
+    case ALTERA_AVALON_UART_CONTROL_REG:
+        model.control = data;
+        raise_irq();
+        break;
+    }
+}
+
+int alt_ic_isr_register(alt_u32 ic_id, alt_u32 irq, alt_isr_func isr, void *isr_context, void *flags)
+{
+    model.isr = isr;
+    model.isr_context = isr_context;
+    return 0;
+}
+
+alt_irq_context alt_irq_disable_all(void)
+{
+    alt_irq_context context = model.irq_disabled;
+    model.irq_disabled = 1;
+    return context;
+}
+
+void alt_irq_enable_all(alt_irq_context context)
+{
+    model.irq_disabled = context;
+    raise_irq();
+}
+
+/**
+ * @func uart_model_receive
+ * @brief Receive bytes from host
+ * @param ptr Pointer to bytes
+ * @param len Number of bytes
+ * @return Number of bytes sent (less than len if RTS is deasserted)
+ * @note A byte not read by the interrupt handler before the next byte
+ *       is lost with overrun error.
+ */
+int uart_model_receive(const void *ptr, int len)
+{
+    const alt_u8 *src = (const alt_u8 *)ptr;
+    int sent;
+
+    for (sent = 0; sent < len; ++sent) {
+        if (!(model.control & ALTERA_AVALON_UART_CONTROL_RTS_MSK)) {
+            break;
+        }
+        if (model.status & ALTERA_AVALON_UART_STATUS_RRDY_MSK) {
+            model.status |= ALTERA_AVALON_UART_STATUS_ROE_MSK;
+            ++model.stats.overruns;
+        }
+        model.rxdata = *src++;
+        model.status |= ALTERA_AVALON_UART_STATUS_RRDY_MSK;
+        ++model.stats.rx_bytes;
+        raise_irq();
+    }
+    return sent;
+}
+
+/**
+ * @func uart_model_set_transmitter
+ * @brief Set function which receives bytes written to TXDATA
+ */
+void uart_model_set_transmitter(void (*transmit)(alt_u8 byte))
+{
+    model.transmit = transmit;
+}
+
+/**
+ * @func uart_model_get_stats
+ * @brief Get counters of model
+ */
+void uart_model_get_stats(uart_model_stats *stats)
+{
+    *stats = model.stats;
+}
@@ -0,0 +1,20 @@
+/*
+ * Register-level model of altera_avalon_uart (see uart_model.c)
+ */
+#ifndef __UART_MODEL_H__
+#define __UART_MODEL_H__
+
+#include "alt_types.h"
+
+typedef struct uart_model_stats_s {
+    unsigned long long rx_bytes;    // Bytes given by uart_model_receive()
+    unsigned long long tx_bytes;    // Bytes written to TXDATA
+    unsigned long interrupts;       // Calls of interrupt handler
+    unsigned long overruns;         // Bytes lost by overrun
+} uart_model_stats;
+
+extern int uart_model_receive(const void *ptr, int len);
+extern void uart_model_set_transmitter(void (*transmit)(alt_u8 byte));
+extern void uart_model_get_stats(uart_model_stats *stats);
+
+#endif  /* __UART_MODEL_H__ */
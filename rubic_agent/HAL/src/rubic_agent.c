@@ -9,6 +9,7 @@
 #include "system.h"
 #include "bson.h"
 #include "peridot_rpc_server.h"
+#include "peridot_sw_hostbridge_gen2.h"
 #ifdef RUBIC_AGENT_ENABLE_PROGRAMMER
 # include "md5.h"
 #endif  /* RUBIC_AGENT_ENABLE_PROGRAMMER */
@@ -63,6 +64,20 @@ struct rubic_agent_state_s {
 static struct rubic_agent_state_s state
 __attribute__((alias("rubic_agent_state")));
 
+/**
+ * @func set_worker_state
+ * @brief Change state of worker (and telemetry)
+ */
+static void set_worker_state(rubic_agent_worker *worker, char new_state)
+{
+	int index = worker - state.workers;
+
+	worker->state = new_state;
+	if (index < HOSTBRIDGE_TELEMETRY_WORKERS) {
+		HOSTBRIDGE_TELEMETRY_SET(agent_worker_state[index], new_state);
+	}
+}
+
 /**
  * @func find_runtime
  * @brief Find runtime from its name
@@ -248,15 +263,15 @@ static void *worker_thread(rubic_agent_worker *worker)
 		if (worker->state == WORKER_STATE_AUTOBOOT) {
 			file_or_source = parse_boot_json(&runtime, &flags);
 			if (!file_or_source) {
-				worker->state = WORKER_STATE_IDLE;
+				set_worker_state(worker, WORKER_STATE_IDLE);
 				continue;
 			}
 			context = NULL;
-			worker->state = WORKER_STATE_STARTING;
+			set_worker_state(worker, WORKER_STATE_STARTING);
 			pthread_mutex_unlock(&worker->mutex);
 			goto invoke_runner;
 		}
-		worker->state = WORKER_STATE_IDLE;
+		set_worker_state(worker, WORKER_STATE_IDLE);
 		pthread_mutex_unlock(&worker->mutex);
 
 		// Wait new start request
@@ -264,7 +279,7 @@ static void *worker_thread(rubic_agent_worker *worker)
 		pthread_mutex_lock(&worker->mutex);
 		context = worker->context;
 		if (context) {
-			worker->state = WORKER_STATE_STARTING;
+			set_worker_state(worker, WORKER_STATE_STARTING);
 		}
 		pthread_mutex_unlock(&worker->mutex);
 		if (!context) {
@@ -339,7 +354,7 @@ int rubic_agent_runner_notify_init(void *context)
 	if (!output) {
 		peridot_rpc_server_async_callback(worker->context, NULL, -ENOMEM);
 		worker->context = NULL;
-		worker->state = WORKER_STATE_FAILED;
+		set_worker_state(worker, WORKER_STATE_FAILED);
 		return 1;
 	}
 
@@ -347,7 +362,7 @@ int rubic_agent_runner_notify_init(void *context)
 	bson_set_int32(output, "tid", worker->thread_index);
 	peridot_rpc_server_async_callback(worker->context, output, 0);
 	worker->context = NULL;
-	worker->state = WORKER_STATE_RUNNING;
+	set_worker_state(worker, WORKER_STATE_RUNNING);
 	return 0;
 }
 
@@ -372,7 +387,7 @@ void rubic_agent_runner_cooperate(void *context)
 	name = bson_get_string(rpc_ctx->params, off_name, "");
 	if (strcmp(name, "abort") == 0) {
 		// Abort request always succeeds with "null" response
-		worker->state = WORKER_STATE_ABORTING;
+		set_worker_state(worker, WORKER_STATE_ABORTING);
 		peridot_rpc_server_async_callback(rpc_ctx, NULL, 0);
 		return;
 	} else if (strcmp(name, "callback") == 0) {
@@ -528,7 +543,7 @@ static int rubic_agent_method_queue(peridot_rpc_server_async_context *context)
 		for (tid = 0; tid < RUBIC_AGENT_WORKER_THREADS; ++tid, ++worker) {
 			pthread_mutex_lock(&worker->mutex);
 			if (worker->state == WORKER_STATE_IDLE) {
-				worker->state = WORKER_STATE_STARTING;
+				set_worker_state(worker, WORKER_STATE_STARTING);
 				worker->context = context;
 				pthread_mutex_unlock(&worker->mutex);
 				sem_post(&worker->sem);
@@ -847,7 +862,7 @@ int rubic_agent_service(int disableAutoBoot)
 #endif  /* RUBIC_AGENT_WORKER_THREADS > 1 */
 	state.workers[0].tid = pthread_self();
 	if (!disableAutoBoot) {
-		state.workers[0].state = WORKER_STATE_AUTOBOOT;
+		set_worker_state(&state.workers[0], WORKER_STATE_AUTOBOOT);
 	}
 	worker_thread(&state.workers[0]);
 	return 0;